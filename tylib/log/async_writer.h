@@ -0,0 +1,399 @@
+// Per-thread SPSC byte rings drained by one background flusher thread.
+// Used by CMLogger in MLOG_M_ASYNC mode, see log.h. The flusher is not
+// forked, a child writes synchronously and leaves the rings to the parent.
+
+#ifndef TYLIB_LOG_ASYNC_WRITER_H_
+#define TYLIB_LOG_ASYNC_WRITER_H_
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+namespace tylib {
+
+// what to do when the calling thread's ring has no room for a line
+enum MLOG_FULL_POLICY {
+  MLOG_FULL_BLOCK = 0,  // wait for the flusher, never lose a line
+  MLOG_FULL_DROP = 1,   // drop the line, count it and report it later
+  MLOG_FULL_SPILL = 2,  // write synchronously on the caller thread
+};
+
+struct MLogAsyncConf {
+  size_t ring_size = 1024 * 1024;  // bytes per thread, rounded up to 2^n
+  int policy = MLOG_FULL_DROP;
+  int flush_ms = 10;  // max delay before a line reaches the file
+};
+
+namespace mlog {
+
+// Single producer single consumer ring of bytes. Producer pushes whole
+// lines or nothing, so consumer always sees complete lines.
+class SpscByteRing {
+ public:
+  explicit SpscByteRing(size_t capacity) {
+    size_t n = 4096;
+    while (n < capacity) n <<= 1;
+    mask = n - 1;
+    data.reset(new char[n]);
+  }
+
+  size_t Capacity() const { return mask + 1; }
+
+  size_t Size() const {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
+  }
+
+  // producer side
+  bool Push(const char* buf, size_t len) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t + len - cachedHead > Capacity()) {
+      cachedHead = head.load(std::memory_order_acquire);
+      if (t + len - cachedHead > Capacity()) return false;
+    }
+
+    size_t pos = t & mask;
+    size_t first = std::min(len, Capacity() - pos);
+    memcpy(data.get() + pos, buf, first);
+    memcpy(data.get(), buf + first, len - first);
+    tail.store(t + len, std::memory_order_release);
+    return true;
+  }
+
+  // consumer side, fill at most 2 iovec (ring may wrap), return bytes
+  size_t Peek(iovec iov[2], int* cnt) const {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t n = tail.load(std::memory_order_acquire) - h;
+    *cnt = 0;
+    if (n == 0) return 0;
+
+    size_t pos = h & mask;
+    size_t first = std::min(n, Capacity() - pos);
+    iov[0].iov_base = data.get() + pos;
+    iov[0].iov_len = first;
+    *cnt = 1;
+    if (first < n) {
+      iov[1].iov_base = data.get();
+      iov[1].iov_len = n - first;
+      *cnt = 2;
+    }
+    return n;
+  }
+
+  void Consume(size_t n) {
+    head.store(head.load(std::memory_order_relaxed) + n,
+               std::memory_order_release);
+  }
+
+ private:
+  size_t mask;
+  std::unique_ptr<char[]> data;
+
+  alignas(64) std::atomic<size_t> head{0};  // written by consumer
+  alignas(64) std::atomic<size_t> tail{0};  // written by producer
+  size_t cachedHead = 0;                    // producer's copy of head
+};
+
+class AsyncWriter {
+ public:
+  // sink writes a batch to the file, called on flusher thread or on caller
+  // thread when spilling
+  using Sink = std::function<int(const iovec* iov, int cnt)>;
+
+  AsyncWriter(const MLogAsyncConf& conf, Sink sink);
+  ~AsyncWriter() { Stop(); }
+
+  int Push(const char* buf, int len);
+
+  // wait until lines pushed before this call are handed to sink
+  void Flush();
+
+  // drain every ring and join flusher, later Push write synchronously.
+  // In a forked child only the latter
+  void Stop();
+
+  unsigned long Dropped() const { return droppedTotal.load(); }
+
+  // rings the calling thread holds, its live writers' and stopped ones'
+  // not dropped yet
+  static size_t LocalRingCount() { return LocalRings().rings.size(); }
+
+ private:
+  struct Ring {
+    explicit Ring(size_t size) : ring(size) {}
+
+    SpscByteRing ring;
+    std::atomic<int> busy{0};  // producer is inside Push
+    std::atomic<bool> orphan{false};
+    std::atomic<bool> closed{false};  // its writer stopped, no more Push
+  };
+
+  // rings of current thread, one per live writer
+  struct ThreadRings {
+    std::vector<std::pair<unsigned long, std::shared_ptr<Ring>>> rings;
+
+    ~ThreadRings() {
+      for (auto& r : rings) r.second->orphan.store(true);
+    }
+  };
+
+  static ThreadRings& LocalRings() {
+    static thread_local ThreadRings local;
+    return local;
+  }
+
+  static unsigned long NextId() {
+    static std::atomic<unsigned long> id{0};
+    return ++id;
+  }
+
+  // forks done by the process, counted in the child
+  static std::atomic<unsigned>& Forks() {
+    static std::atomic<unsigned> forks{0};
+    static std::once_flag once;
+    std::call_once(once, []() {
+      pthread_atfork(nullptr, nullptr, []() { ++Forks(); });
+    });
+    return forks;
+  }
+
+  // in a child forked since the writer was made, its flusher is gone
+  bool Forked() const {
+    return Forks().load(std::memory_order_relaxed) != forks;
+  }
+
+  Ring* LocalRing();
+  int WriteSync(const char* buf, int len);
+  size_t Drain();
+  void Run();
+
+  const unsigned long id;
+  const unsigned forks;  // Forks() when the writer was made
+  const MLogAsyncConf conf;
+  Sink sink;
+
+  std::mutex lock;  // protect rings
+  std::vector<std::shared_ptr<Ring>> rings;
+  std::vector<std::shared_ptr<Ring>> snap;  // only used by Drain
+
+  std::mutex flushLock;  // serialize Drain between flusher and Flush()
+  // a forked child leaks it: the flusher may have been waiting on it, and
+  // destroying it would wait for that thread forever
+  std::unique_ptr<std::condition_variable> cond{new std::condition_variable};
+  std::atomic<bool> stop{false};
+  std::atomic<unsigned long> dropped{0};  // not reported yet
+  std::atomic<unsigned long> droppedTotal{0};
+  std::thread flusher;
+};
+
+inline AsyncWriter::AsyncWriter(const MLogAsyncConf& _conf, Sink _sink)
+    : id(NextId()),
+      forks(Forks().load()),
+      conf(_conf),
+      sink(std::move(_sink)) {
+  flusher = std::thread(&AsyncWriter::Run, this);
+}
+
+inline AsyncWriter::Ring* AsyncWriter::LocalRing() {
+  ThreadRings& local = LocalRings();
+  for (auto& r : local.rings) {
+    if (r.first == id) return r.second.get();
+  }
+
+  // rings of stopped writers are dropped here, or a long lived thread
+  // keeps one per writer it ever logged through
+  auto& v = local.rings;
+  v.erase(std::remove_if(v.begin(), v.end(),
+                         [](const std::pair<unsigned long,
+                                            std::shared_ptr<Ring>>& r) {
+                           return r.second->closed.load();
+                         }),
+          v.end());
+
+  std::shared_ptr<Ring> r = std::make_shared<Ring>(conf.ring_size);
+  local.rings.emplace_back(id, r);
+  std::lock_guard<std::mutex> guard(lock);
+  rings.push_back(r);
+  return r.get();
+}
+
+inline int AsyncWriter::WriteSync(const char* buf, int len) {
+  iovec iov;
+  iov.iov_base = const_cast<char*>(buf);
+  iov.iov_len = len;
+  return sink(&iov, 1);
+}
+
+inline int AsyncWriter::Push(const char* buf, int len) {
+  if (stop.load(std::memory_order_relaxed) || Forked()) {
+    return WriteSync(buf, len);
+  }
+
+  Ring* r = LocalRing();
+  if (static_cast<size_t>(len) > r->ring.Capacity() / 2) {
+    return WriteSync(buf, len);
+  }
+
+  // busy and stop make a Dekker pair with Stop(), so a line is either in
+  // ring before final drain or written synchronously
+  r->busy.store(1, std::memory_order_seq_cst);
+  if (stop.load(std::memory_order_seq_cst)) {
+    r->busy.store(0, std::memory_order_release);
+    return WriteSync(buf, len);
+  }
+
+  int ret = len;
+  if (r->ring.Push(buf, len)) {
+    if (r->ring.Size() > r->ring.Capacity() / 2) cond->notify_one();
+  } else if (conf.policy == MLOG_FULL_DROP) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    droppedTotal.fetch_add(1, std::memory_order_relaxed);
+    ret = 0;
+  } else if (conf.policy == MLOG_FULL_SPILL) {
+    r->busy.store(0, std::memory_order_release);
+    return WriteSync(buf, len);
+  } else {
+    while (!r->ring.Push(buf, len)) {
+      if (stop.load()) {
+        r->busy.store(0, std::memory_order_release);
+        return WriteSync(buf, len);
+      }
+      cond->notify_one();
+      sched_yield();
+    }
+  }
+
+  r->busy.store(0, std::memory_order_release);
+  return ret;
+}
+
+inline size_t AsyncWriter::Drain() {
+  std::lock_guard<std::mutex> guard(flushLock);
+
+  snap.clear();
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    snap.assign(rings.begin(), rings.end());
+  }
+
+  size_t total = 0;
+  iovec iov[IOV_MAX];
+  size_t peeked[IOV_MAX / 2];
+  size_t i = 0;
+  while (i < snap.size()) {
+    // one writev for up to IOV_MAX/2 rings
+    int cnt = 0;
+    size_t first = i;
+    for (; i < snap.size() && cnt + 2 <= IOV_MAX; ++i) {
+      int n = 0;
+      peeked[i - first] = snap[i]->ring.Peek(iov + cnt, &n);
+      cnt += n;
+    }
+
+    if (cnt > 0) sink(iov, cnt);  // on error lines are lost, as in sync mode
+
+    for (size_t j = first; j < i; ++j) {
+      snap[j]->ring.Consume(peeked[j - first]);
+      total += peeked[j - first];
+    }
+  }
+
+  unsigned long n = dropped.exchange(0);
+  if (n > 0) {
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf),
+                       "mlog: ring full, dropped %lu lines\n", n);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len;
+    sink(iov, 1);
+  }
+
+  // free rings of exited threads, no more push after orphan is set
+  bool hasOrphan = false;
+  for (auto& r : snap) {
+    if (r->orphan.load() && r->ring.Size() == 0) hasOrphan = true;
+  }
+  if (hasOrphan) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t j = 0; j < rings.size();) {
+      if (rings[j]->orphan.load() && rings[j]->ring.Size() == 0) {
+        rings[j] = rings.back();
+        rings.pop_back();
+      } else {
+        ++j;
+      }
+    }
+  }
+  snap.clear();
+
+  return total;
+}
+
+inline void AsyncWriter::Flush() {
+  if (stop.load() || Forked()) return;
+  Drain();
+}
+
+inline void AsyncWriter::Run() {
+  while (!stop.load()) {
+    if (Drain() == 0) {
+      std::unique_lock<std::mutex> guard(lock);
+      cond->wait_for(guard, std::chrono::milliseconds(conf.flush_ms));
+    }
+  }
+}
+
+inline void AsyncWriter::Stop() {
+  if (stop.exchange(true)) return;
+
+  // Lines in the rings are the parent's to write, and a lock may have been
+  // held by a thread that is gone. Rings of this thread are only closed.
+  if (Forked()) {
+    if (flusher.joinable()) flusher.detach();
+    cond.release();
+    for (auto& r : LocalRings().rings) {
+      if (r.first == id) r.second->closed.store(true);
+    }
+    return;
+  }
+
+  cond->notify_one();
+  if (flusher.joinable()) flusher.join();
+
+  // wait producers already past the stop check
+  std::vector<std::shared_ptr<Ring>> all;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    all = rings;
+  }
+  for (auto& r : all) {
+    while (r->busy.load(std::memory_order_seq_cst)) sched_yield();
+  }
+
+  Drain();
+  for (auto& r : all) r->closed.store(true);
+}
+
+}  // namespace mlog
+
+}  // namespace tylib
+
+#endif  // TYLIB_LOG_ASYNC_WRITER_H_
@@ -0,0 +1,541 @@
+// Binary records of MLOG_M_BINARY mode: the call site writes a format id and
+// raw arguments, text is rendered offline by mlog_decode.
+//
+// A segment holds DEF records (format string and call site of an id) and LOG
+// records (id, time, pid, tid, arguments). Ids are per process, so a record
+// is keyed by (pid, id). DEF of a site is written again after each rotation,
+// decode segments in order to render records written around a rotation.
+// Bytes not starting with kBinMagic are text lines and are passed through.
+
+#ifndef TYLIB_LOG_BINARY_LOG_H_
+#define TYLIB_LOG_BINARY_LOG_H_
+
+#include <time.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace tylib {
+
+namespace mlog {
+
+const uint16_t kBinMagic = 0xB10C;
+
+enum BIN_RECORD_TYPE {
+  BIN_DEF = 1,
+  BIN_LOG = 2,
+};
+
+enum BIN_ARG_TYPE {
+  BIN_ARG_INT = 1,     // int64_t
+  BIN_ARG_UINT = 2,    // uint64_t
+  BIN_ARG_DOUBLE = 3,  // double
+  BIN_ARG_STR = 4,     // uint32_t length, bytes
+  BIN_ARG_PTR = 5,     // uint64_t
+};
+
+struct BinHeader {
+  uint16_t magic;
+  uint8_t type;
+  uint8_t level;
+  uint32_t len;  // whole record
+};
+
+// followed by file, func, fmt and pname, each '\0' terminated. h.level is
+// unused, level of a line is in its LOG record.
+struct BinDef {
+  BinHeader h;
+  uint32_t pid;
+  uint32_t id;
+  uint32_t format;
+  uint32_t line;
+};
+
+// followed by arguments, each a BIN_ARG_TYPE byte and its value
+struct BinLog {
+  BinHeader h;
+  uint32_t pid;
+  uint32_t tid;
+  uint32_t id;
+  uint32_t reserved;
+  uint64_t ns;  // CLOCK_REALTIME
+};
+
+// one per MLOG_BIN call site, constant initialized, so fmt must be a literal
+struct BinSite {
+  const char* fmt;
+  const char* file;  // __FILE__, decoder strips the directory
+  int line;
+  const char* func;
+  uint32_t id;  // 0 until first used
+};
+
+// segment and process a logger wrote a site's DEF for, a forked child
+// writes its own, its records are keyed by its pid
+inline uint64_t BinEpoch(uint32_t pid, unsigned long gen) {
+  return static_cast<uint64_t>(pid) << 32 | static_cast<uint32_t>(gen);
+}
+
+inline uint32_t BinSiteId(BinSite* site) {
+  uint32_t id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+  if (id == 0) {
+    static uint32_t next = 0;
+    uint32_t mine = __atomic_add_fetch(&next, 1, __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&site->id, &id, mine, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      id = mine;
+    }
+  }
+  return id;
+}
+
+// Append to a fixed buffer, too long data is cut and ok() turns false.
+class BinWriter {
+ public:
+  BinWriter(char* buf, size_t size) : begin(buf), p(buf), end(buf + size) {}
+
+  size_t Size() const { return p - begin; }
+  char* Data() const { return begin; }
+  bool ok() const { return good; }
+
+  char* Reserve(size_t n) {
+    if (static_cast<size_t>(end - p) < n) {
+      good = false;
+      return nullptr;
+    }
+    char* r = p;
+    p += n;
+    return r;
+  }
+
+  void Put(const void* data, size_t n) {
+    char* dst = Reserve(n);
+    if (dst) memcpy(dst, data, n);
+  }
+
+  void PutStr(const char* s) { Put(s, strlen(s) + 1); }
+
+  template <class T>
+  void PutTagged(uint8_t tag, T v) {
+    char* dst = Reserve(1 + sizeof(v));
+    if (!dst) return;
+    *dst = tag;
+    memcpy(dst + 1, &v, sizeof(v));
+  }
+
+  template <class T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                          std::is_signed<T>::value>::type
+  Arg(T v) {
+    PutTagged(BIN_ARG_INT, static_cast<int64_t>(v));
+  }
+
+  template <class T>
+  typename std::enable_if<std::is_integral<T>::value &&
+                          !std::is_signed<T>::value>::type
+  Arg(T v) {
+    PutTagged(BIN_ARG_UINT, static_cast<uint64_t>(v));
+  }
+
+  template <class T>
+  typename std::enable_if<std::is_enum<T>::value>::type Arg(T v) {
+    Arg(static_cast<typename std::underlying_type<T>::type>(v));
+  }
+
+  template <class T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type Arg(T v) {
+    PutTagged(BIN_ARG_DOUBLE, static_cast<double>(v));
+  }
+
+  void Arg(const char* s) {
+    if (!s) s = "(null)";
+    size_t n = strlen(s);
+    size_t room = end - p;
+    if (room < 1 + sizeof(uint32_t)) {
+      good = false;
+      return;
+    }
+    if (n > room - 1 - sizeof(uint32_t)) {
+      n = room - 1 - sizeof(uint32_t);  // keep a cut string, not nothing
+      good = false;
+    }
+    uint32_t len = n;
+    *p++ = BIN_ARG_STR;
+    memcpy(p, &len, sizeof(len));
+    p += sizeof(len);
+    memcpy(p, s, n);
+    p += n;
+  }
+
+  void Arg(char* s) { Arg(static_cast<const char*>(s)); }
+
+  void Arg(const void* v) {
+    PutTagged(BIN_ARG_PTR,
+              static_cast<uint64_t>(reinterpret_cast<uintptr_t>(v)));
+  }
+
+  void Arg(std::nullptr_t) { Arg(static_cast<const void*>(nullptr)); }
+
+  void Args() {}
+
+  template <class T, class... Rest>
+  void Args(const T& first, const Rest&... rest) {
+    Arg(first);
+    Args(rest...);
+  }
+
+ private:
+  char* begin;
+  char* p;
+  char* end;
+  bool good = true;
+};
+
+// Render records to text, the same layout CMLogger writes in text mode.
+class BinDecoder {
+ public:
+  // Decode a whole segment. DEF records are collected first, so a LOG may
+  // appear before its DEF. Return number of rendered lines.
+  size_t Decode(const char* data, size_t len, std::string* out);
+
+  // render one LOG record, false if its DEF is unknown
+  bool Render(const char* rec, size_t len, std::string* out) const;
+
+  void AddDef(const char* rec, size_t len);
+
+  // length of the record at data, 0 if data starts a text line
+  static size_t RecordLen(const char* data, size_t len);
+
+ private:
+  struct Def {
+    unsigned format;
+    int line;
+    std::string file;
+    std::string func;
+    std::string fmt;
+    std::string pname;
+  };
+
+  struct ArgReader {
+    const char* p;
+    const char* end;
+
+    bool Next(uint8_t* tag, const char** val, uint32_t* n);
+  };
+
+  static void FormatBody(const std::string& fmt, ArgReader args,
+                         std::string* out);
+
+  std::map<std::pair<uint32_t, uint32_t>, Def> defs;  // (pid, id)
+};
+
+inline size_t BinDecoder::RecordLen(const char* data, size_t len) {
+  if (len < sizeof(BinHeader)) return 0;
+  BinHeader h;
+  memcpy(&h, data, sizeof(h));
+  if (h.magic != kBinMagic || h.len < sizeof(h) || h.len > len) return 0;
+  if (h.type != BIN_DEF && h.type != BIN_LOG) return 0;
+  return h.len;
+}
+
+inline void BinDecoder::AddDef(const char* rec, size_t len) {
+  if (len < sizeof(BinDef)) return;
+  BinDef d;
+  memcpy(&d, rec, sizeof(d));
+
+  const char* str[4];
+  const char* p = rec + sizeof(d);
+  const char* end = rec + len;
+  for (int i = 0; i < 4; ++i) {
+    const char* z = static_cast<const char*>(memchr(p, '\0', end - p));
+    if (!z) return;
+    str[i] = p;
+    p = z + 1;
+  }
+
+  Def& def = defs[std::make_pair(d.pid, d.id)];
+  const char* base = strrchr(str[0], '/');
+  def.format = d.format;
+  def.line = d.line;
+  def.file = base ? base + 1 : str[0];
+  def.func = str[1];
+  def.fmt = str[2];
+  def.pname = str[3];
+}
+
+inline bool BinDecoder::ArgReader::Next(uint8_t* tag, const char** val,
+                                        uint32_t* n) {
+  if (p >= end) return false;
+  *tag = *p++;
+  switch (*tag) {
+    case BIN_ARG_INT:
+    case BIN_ARG_UINT:
+    case BIN_ARG_DOUBLE:
+    case BIN_ARG_PTR:
+      *n = 8;
+      break;
+    case BIN_ARG_STR:
+      if (end - p < 4) return false;
+      memcpy(n, p, 4);
+      p += 4;
+      break;
+    default:
+      return false;
+  }
+  if (static_cast<size_t>(end - p) < *n) return false;
+  *val = p;
+  p += *n;
+  return true;
+}
+
+template <class T>
+inline void AppendFormat(std::string* out, const std::string& spec, T v) {
+  char buf[256];
+  int n = snprintf(buf, sizeof(buf), spec.c_str(), v);
+  if (n < 0) return;
+  if (n < static_cast<int>(sizeof(buf))) {
+    out->append(buf, n);
+    return;
+  }
+  size_t old = out->size();
+  out->resize(old + n + 1);
+  snprintf(&(*out)[old], n + 1, spec.c_str(), v);
+  out->resize(old + n);
+}
+
+// printf subset that matters for log lines, length modifiers are replaced as
+// arguments were widened to 64 bits at the call site
+inline void BinDecoder::FormatBody(const std::string& fmt, ArgReader args,
+                                   std::string* out) {
+  uint8_t tag = 0;
+  const char* val = nullptr;
+  uint32_t n = 0;
+
+  auto nextInt = [&](int64_t* v) {
+    if (!args.Next(&tag, &val, &n) || n != 8 || tag == BIN_ARG_DOUBLE) {
+      return false;
+    }
+    memcpy(v, val, 8);
+    return true;
+  };
+
+  const char* p = fmt.c_str();
+  while (*p) {
+    if (*p != '%') {
+      out->push_back(*p++);
+      continue;
+    }
+    if (p[1] == '%') {
+      out->push_back('%');
+      p += 2;
+      continue;
+    }
+
+    const char* start = p++;
+    std::string spec = "%";
+    while (*p && strchr("-+ #0'", *p)) spec.push_back(*p++);
+
+    int64_t star;
+    if (*p == '*') {
+      ++p;
+      spec += nextInt(&star) ? std::to_string(star) : "";
+    }
+    while (*p >= '0' && *p <= '9') spec.push_back(*p++);
+
+    if (*p == '.') {
+      spec.push_back(*p++);
+      if (*p == '*') {
+        ++p;
+        spec += nextInt(&star) ? std::to_string(star) : "0";
+      }
+      while (*p >= '0' && *p <= '9') spec.push_back(*p++);
+    }
+
+    int width = 0;  // bytes of hh, h, or 0 for full
+    if (*p == 'h') {
+      width = 2;
+      if (*++p == 'h') {
+        width = 1;
+        ++p;
+      }
+    }
+    while (*p && strchr("lLqjzt", *p)) ++p;
+
+    char conv = *p;
+    if (!conv) {
+      out->append(start);
+      break;
+    }
+    ++p;
+
+    if (conv == 'n') continue;
+    if (!args.Next(&tag, &val, &n)) {
+      out->append("<?>");
+      continue;
+    }
+
+    int64_t i64 = 0;
+    double dbl = 0;
+    if (n == 8) {
+      memcpy(&i64, val, 8);
+      memcpy(&dbl, val, 8);
+    }
+    if (tag == BIN_ARG_DOUBLE) i64 = static_cast<int64_t>(dbl);
+
+    switch (conv) {
+      case 'd':
+      case 'i':
+        if (width == 1) i64 = static_cast<signed char>(i64);
+        if (width == 2) i64 = static_cast<short>(i64);
+        AppendFormat(out, spec + "lld", static_cast<long long>(i64));
+        break;
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X': {
+        uint64_t u64 = i64;
+        if (width == 1) u64 = static_cast<unsigned char>(u64);
+        if (width == 2) u64 = static_cast<unsigned short>(u64);
+        AppendFormat(out, spec + "ll" + conv,
+                     static_cast<unsigned long long>(u64));
+        break;
+      }
+      case 'c':
+        AppendFormat(out, spec + "c", static_cast<int>(i64));
+        break;
+      case 'e':
+      case 'E':
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+        if (tag != BIN_ARG_DOUBLE) dbl = static_cast<double>(i64);
+        AppendFormat(out, spec + conv, dbl);
+        break;
+      case 's':
+        if (tag == BIN_ARG_STR) {
+          AppendFormat(out, spec + "s", std::string(val, n).c_str());
+        } else {
+          out->append("<?>");
+        }
+        break;
+      case 'p':
+        AppendFormat(out, spec + "p",
+                     reinterpret_cast<void*>(static_cast<uintptr_t>(i64)));
+        break;
+      default:
+        out->append(start, p - start);
+        break;
+    }
+  }
+}
+
+inline bool BinDecoder::Render(const char* rec, size_t len,
+                               std::string* out) const {
+  if (len < sizeof(BinLog)) return false;
+  BinLog r;
+  memcpy(&r, rec, sizeof(r));
+
+  auto it = defs.find(std::make_pair(r.pid, r.id));
+  if (it == defs.end()) return false;
+  const Def& def = it->second;
+
+  // a long func or file is cut, n stays inside buf
+  char buf[1024];
+  int n = 0;
+  auto put = [&](int m) {
+    if (m > 0) n += m;
+    if (n >= static_cast<int>(sizeof(buf))) n = sizeof(buf) - 1;
+  };
+  // keep in step with CMLogger::Log
+  if (def.format & 1) {  // MLOG_F_PNAME
+    put(snprintf(buf + n, sizeof(buf) - n, "%s ", def.pname.c_str()));
+  }
+  if (def.format & 2) {  // MLOG_F_LEVEL
+    put(snprintf(buf + n, sizeof(buf) - n, "%d ", r.h.level));
+  }
+  if (def.format & 4) {  // MLOG_F_TIME
+    time_t sec = r.ns / 1000000000;
+    int nsec = r.ns % 1000000000;
+    struct tm t;
+    localtime_r(&sec, &t);
+    int ms = nsec / 1000000;
+    int us = nsec / 1000 - ms * 1000;
+    put(snprintf(buf + n, sizeof(buf) - n,
+                 "%4d-%02d-%02d %02d:%02d:%02d.%03d%03d ", t.tm_year + 1900,
+                 t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, ms,
+                 us));
+  }
+  if (def.format & 8) {  // MLOG_F_PID
+    put(snprintf(buf + n, sizeof(buf) - n, "%u ", r.pid));
+  }
+  if (def.format & 16) {  // MLOG_F_TID
+    put(snprintf(buf + n, sizeof(buf) - n, "%u ", r.tid));
+  }
+  if (def.format & 32) {  // MLOG_F_FILELINE
+    put(snprintf(buf + n, sizeof(buf) - n, "%s:%d ", def.file.c_str(),
+                 def.line));
+  }
+  if (def.format & 64) {  // MLOG_F_FUNC
+    put(snprintf(buf + n, sizeof(buf) - n, "%s ", def.func.c_str()));
+  }
+  out->append(buf, n);
+
+  ArgReader args = {rec + sizeof(r), rec + len};
+  FormatBody(def.fmt, args, out);
+  out->push_back('\n');
+  return true;
+}
+
+inline size_t BinDecoder::Decode(const char* data, size_t len,
+                                 std::string* out) {
+  for (size_t off = 0; off < len;) {
+    size_t n = RecordLen(data + off, len - off);
+    if (n == 0) {
+      const char* nl =
+          static_cast<const char*>(memchr(data + off, '\n', len - off));
+      off = nl ? nl - data + 1 : len;
+      continue;
+    }
+    if (data[off + 2] == BIN_DEF) AddDef(data + off, n);
+    off += n;
+  }
+
+  size_t lines = 0;
+  for (size_t off = 0; off < len;) {
+    size_t n = RecordLen(data + off, len - off);
+    if (n == 0) {
+      // text line, e.g. written by MLOG on the same logger
+      const char* nl =
+          static_cast<const char*>(memchr(data + off, '\n', len - off));
+      size_t end = nl ? nl - data + 1 : len;
+      out->append(data + off, end - off);
+      off = end;
+      ++lines;
+      continue;
+    }
+    if (data[off + 2] == BIN_LOG) {
+      if (Render(data + off, n, out)) {
+        ++lines;
+      } else {
+        out->append("<unknown format id>\n");
+      }
+    }
+    off += n;
+  }
+
+  return lines;
+}
+
+}  // namespace mlog
+
+}  // namespace tylib
+
+#endif  // TYLIB_LOG_BINARY_LOG_H_
@@ -0,0 +1,400 @@
+// Per-thread overwrite rings keeping the latest verbose lines in memory.
+// Used by CMLogger in MLOG_M_FLIGHT mode, see log.h. Lines reach the file
+// only when dumped: on an error line, on DumpFlight() or on a fatal signal.
+// A thread gets an alternate signal stack with its first ring, so a stack
+// overflow still dumps.
+
+#ifndef TYLIB_LOG_FLIGHT_RECORDER_H_
+#define TYLIB_LOG_FLIGHT_RECORDER_H_
+
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace tylib {
+
+struct MLogFlightConf {
+  int file_level = 2;  // MLOG_LV_NORMAL, lines above it go to the ring
+  size_t ring_size = 64 * 1024;  // bytes per thread, rounded up to 2^n
+  unsigned dump_lines = 0;       // last lines dumped per thread, 0 for all
+  bool dump_on_error = true;     // an MLOG_LV_ERROR line dumps first
+  bool dump_all_threads = false;  // on error, else only the calling thread
+  bool on_signal = true;  // SIGSEGV SIGBUS SIGFPE SIGILL SIGABRT dump all
+};
+
+namespace mlog {
+
+// Single writer ring that overwrites its oldest records. A record is
+// len, data, len; the trailing len lets a reader walk back from head.
+// Readers on other threads check after copying that the writer did not
+// overwrite what they read.
+class FlightRing {
+ public:
+  static const uint32_t kMaxData = 8 * 1024;  // a line buffer of CMLogger
+
+  explicit FlightRing(size_t capacity) {
+    size_t n = 1;
+    while (n < capacity || n < 4 * (kMaxData + 8)) n <<= 1;
+    mask = n - 1;
+    data.reset(new char[n]);
+  }
+
+  size_t Capacity() const { return mask + 1; }
+
+  // owner thread only
+  void Put(const char* buf, uint32_t len) {
+    if (len > kMaxData) len = kMaxData;
+    uint64_t h = head.load(std::memory_order_relaxed);
+    CopyIn(h, &len, 4);
+    CopyIn(h + 4, buf, len);
+    CopyIn(h + 4 + len, &len, 4);
+    head.store(h + len + 8, std::memory_order_release);
+  }
+
+  // Hand the last maxLines records (0 for all) not dumped before to out.
+  // owner is true when the writer is the caller, nothing can be overwritten.
+  template <class Out>
+  unsigned Dump(unsigned maxLines, bool owner, Out&& out);
+
+ public:
+  std::atomic<bool> orphan{false};
+  std::atomic<pid_t> tid{0};
+
+ private:
+  void CopyIn(uint64_t pos, const void* buf, size_t len) {
+    size_t p = pos & mask;
+    size_t first = std::min(len, Capacity() - p);
+    memcpy(data.get() + p, buf, first);
+    memcpy(data.get(), static_cast<const char*>(buf) + first, len - first);
+  }
+
+  void CopyOut(uint64_t pos, void* buf, size_t len) const {
+    size_t p = pos & mask;
+    size_t first = std::min(len, Capacity() - p);
+    memcpy(buf, data.get() + p, first);
+    memcpy(static_cast<char*>(buf) + first, data.get(), len - first);
+  }
+
+  // bytes from pos on are still what the writer put there
+  bool Intact(uint64_t pos, bool owner) const {
+    uint64_t slack = owner ? 0 : kMaxData + 8;  // a Put in progress
+    uint64_t h = head.load(std::memory_order_acquire) + slack;
+    return h <= Capacity() || pos >= h - Capacity();
+  }
+
+  size_t mask;
+  std::unique_ptr<char[]> data;
+  std::atomic<uint64_t> head{0};
+  std::atomic<uint64_t> mark{0};  // head at the last dump
+};
+
+template <class Out>
+unsigned FlightRing::Dump(unsigned maxLines, bool owner, Out&& out) {
+  const uint64_t end = head.load(std::memory_order_acquire);
+  uint64_t low = mark.load(std::memory_order_relaxed);
+  if (end > Capacity() && end - Capacity() > low) low = end - Capacity();
+
+  // back from head to the first record to dump
+  uint64_t pos = end;
+  unsigned n = 0;
+  while (pos - low >= 8 && (maxLines == 0 || n < maxLines)) {
+    uint32_t len;
+    CopyOut(pos - 4, &len, 4);
+    if (len > kMaxData || pos - low < len + 8ULL) break;
+    if (!Intact(pos - len - 8, owner)) break;
+    pos -= len + 8;
+    ++n;
+  }
+
+  char rec[kMaxData];
+  unsigned done = 0;
+  while (pos < end) {
+    uint32_t len;
+    CopyOut(pos, &len, 4);
+    if (len > kMaxData) break;
+    CopyOut(pos + 4, rec, len);
+    if (!Intact(pos, owner)) break;
+    out(rec, len);
+    pos += len + 8;
+    ++done;
+  }
+
+  uint64_t m = mark.load(std::memory_order_relaxed);
+  while (m < end && !mark.compare_exchange_weak(m, end)) {
+  }
+  return done;
+}
+
+class FlightRecorder {
+ public:
+  // sink writes dumped lines. crashSink is called from the signal handler
+  // and must be async-signal-safe, e.g. a write(2) and nothing else.
+  using Sink = std::function<int(const char* buf, int len)>;
+
+  FlightRecorder(const MLogFlightConf& conf, Sink sink, Sink crashSink);
+  ~FlightRecorder();
+
+  const MLogFlightConf& Conf() const { return conf; }
+
+  // the memcpy into the calling thread's ring
+  void Record(const char* buf, int len) {
+    FlightRing* r = LocalRing();
+    if (r) r->Put(buf, len);
+  }
+
+  // calling thread or all threads, oldest line first
+  void Dump(bool allThreads);
+
+ private:
+  static const int kMaxRings = 1024;
+  static const int kMaxRecorders = 16;
+  static const size_t kAltStackSize = 64 * 1024;  // DumpRing needs ~25KB
+
+  // alternate signal stack of a thread, unless it had one of its own
+  struct AltStack {
+    std::unique_ptr<char[]> stack;
+
+    ~AltStack() {
+      stack_t ss;
+      if (stack && sigaltstack(nullptr, &ss) == 0 &&
+          ss.ss_sp == stack.get()) {
+        ss.ss_flags = SS_DISABLE;
+        sigaltstack(&ss, nullptr);
+      }
+    }
+  };
+
+  static void InstallAltStack();
+
+  // rings of current thread, one per live recorder
+  struct ThreadRings {
+    std::vector<std::pair<unsigned long, std::shared_ptr<FlightRing>>> rings;
+
+    ~ThreadRings() {
+      for (auto& r : rings) r.second->orphan.store(true);
+    }
+  };
+
+  static ThreadRings& LocalRings() {
+    static thread_local ThreadRings local;
+    return local;
+  }
+
+  static unsigned long NextId() {
+    static std::atomic<unsigned long> id{0};
+    return ++id;
+  }
+
+  static std::atomic<FlightRecorder*>* Recorders() {
+    static std::atomic<FlightRecorder*> recorders[kMaxRecorders];
+    return recorders;
+  }
+
+  static struct sigaction* OldActions() {
+    static struct sigaction old[NSIG];
+    return old;
+  }
+
+  static void InstallSignals();
+  static void OnSignal(int sig);
+
+  FlightRing* LocalRing();
+
+  // ring of calling thread if it has one
+  FlightRing* OwnRing() {
+    for (auto& r : LocalRings().rings) {
+      if (r.first == id) return r.second.get();
+    }
+    return nullptr;
+  }
+
+  void DumpRing(FlightRing* r, bool owner, const Sink& out);
+
+  const unsigned long id;
+  const MLogFlightConf conf;
+  Sink sink;
+  Sink crashSink;
+
+  std::mutex lock;  // protect rings, serialize Dump
+  std::vector<std::shared_ptr<FlightRing>> rings;
+
+  // same rings for the signal handler, never reallocated
+  std::atomic<FlightRing*> slots[kMaxRings];
+  std::atomic<int> slotCount{0};
+};
+
+inline FlightRecorder::FlightRecorder(const MLogFlightConf& _conf, Sink _sink,
+                                      Sink _crashSink)
+    : id(NextId()),
+      conf(_conf),
+      sink(std::move(_sink)),
+      crashSink(std::move(_crashSink)) {
+  for (auto& s : slots) s.store(nullptr, std::memory_order_relaxed);
+  if (!conf.on_signal) return;
+
+  InstallSignals();
+  std::atomic<FlightRecorder*>* recorders = Recorders();
+  for (int i = 0; i < kMaxRecorders; ++i) {
+    FlightRecorder* expected = nullptr;
+    if (recorders[i].compare_exchange_strong(expected, this)) break;
+  }
+}
+
+inline FlightRecorder::~FlightRecorder() {
+  std::atomic<FlightRecorder*>* recorders = Recorders();
+  for (int i = 0; i < kMaxRecorders; ++i) {
+    FlightRecorder* expected = this;
+    recorders[i].compare_exchange_strong(expected, nullptr);
+  }
+}
+
+inline FlightRing* FlightRecorder::LocalRing() {
+  FlightRing* own = OwnRing();
+  if (own) return own;
+
+  // a ring of an exited thread is reused, its lines stay until overwritten
+  std::shared_ptr<FlightRing> r;
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto& o : rings) {
+    bool orphan = true;
+    if (o->orphan.compare_exchange_strong(orphan, false)) {
+      r = o;
+      break;
+    }
+  }
+  if (!r) {
+    int n = slotCount.load(std::memory_order_relaxed);
+    if (n == kMaxRings) return nullptr;
+    r = std::make_shared<FlightRing>(conf.ring_size);
+    rings.push_back(r);
+    slots[n].store(r.get(), std::memory_order_release);
+    slotCount.store(n + 1, std::memory_order_release);
+  }
+  r->tid.store(syscall(SYS_gettid), std::memory_order_relaxed);
+  LocalRings().rings.emplace_back(id, r);
+  if (conf.on_signal) InstallAltStack();
+  return r.get();
+}
+
+inline void FlightRecorder::InstallAltStack() {
+  static thread_local AltStack alt;
+  stack_t ss;
+  if (alt.stack || sigaltstack(nullptr, &ss) != 0 ||
+      !(ss.ss_flags & SS_DISABLE)) {
+    return;
+  }
+  alt.stack.reset(new char[kAltStackSize]);
+  ss.ss_sp = alt.stack.get();
+  ss.ss_size = kAltStackSize;
+  ss.ss_flags = 0;
+  if (sigaltstack(&ss, nullptr) != 0) alt.stack.reset();
+}
+
+// signal safe: no allocation, no lock, no stdio
+inline void FlightRecorder::DumpRing(FlightRing* r, bool owner,
+                                     const Sink& out) {
+  char buf[16 * 1024];
+  size_t n = 0;
+  auto flush = [&]() {
+    if (n > 0) out(buf, n);
+    n = 0;
+  };
+  auto append = [&](const char* s, size_t len) {
+    if (n + len > sizeof(buf)) flush();
+    memcpy(buf + n, s, len);
+    n += len;
+  };
+
+  const char begin[] = "---- flight recorder, tid ";
+  append(begin, sizeof(begin) - 1);
+  char num[16];
+  int i = sizeof(num);
+  num[--i] = '\n';
+  unsigned long tid = r->tid.load(std::memory_order_relaxed);
+  do {
+    num[--i] = '0' + tid % 10;
+    tid /= 10;
+  } while (tid);
+  append(num + i, sizeof(num) - i);
+
+  unsigned lines = r->Dump(conf.dump_lines, owner, append);
+
+  const char end[] = "---- flight recorder end\n";
+  if (lines > 0) {
+    append(end, sizeof(end) - 1);
+    flush();
+  }
+}
+
+inline void FlightRecorder::Dump(bool allThreads) {
+  FlightRing* own = OwnRing();
+  std::lock_guard<std::mutex> guard(lock);
+  if (!allThreads) {
+    if (own) DumpRing(own, true, sink);
+    return;
+  }
+
+  for (auto& r : rings) DumpRing(r.get(), r.get() == own, sink);
+}
+
+inline void FlightRecorder::InstallSignals() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnSignal;
+    sa.sa_flags = SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+      sigaction(sig, &sa, &OldActions()[sig]);
+    }
+  });
+}
+
+inline void FlightRecorder::OnSignal(int sig) {
+  // One dump even if several threads crash. The others wait for it, their
+  // re-raise would end the process mid-dump. A fault in the dump itself
+  // goes on to the old action.
+  static std::atomic<int> dumping{0};  // 0 none, 1 dumping, 2 done
+  static std::atomic<pid_t> dumper{0};
+  const pid_t self = syscall(SYS_gettid);
+  int none = 0;
+  if (dumping.compare_exchange_strong(none, 1)) {
+    dumper.store(self);
+    std::atomic<FlightRecorder*>* recorders = Recorders();
+    for (int i = 0; i < kMaxRecorders; ++i) {
+      FlightRecorder* f = recorders[i].load();
+      if (!f) continue;
+      int n = f->slotCount.load(std::memory_order_acquire);
+      for (int j = 0; j < n; ++j) {
+        f->DumpRing(f->slots[j].load(std::memory_order_acquire), false,
+                    f->crashSink);
+      }
+    }
+    dumping.store(2);
+  } else if (dumper.load() != self) {
+    struct timespec pause = {0, 1000 * 1000};
+    while (dumping.load() != 2) nanosleep(&pause, nullptr);
+  }
+
+  // previous handler or default action once this handler returns
+  sigaction(sig, &OldActions()[sig], nullptr);
+  raise(sig);
+}
+
+}  // namespace mlog
+
+}  // namespace tylib
+
+#endif  // TYLIB_LOG_FLIGHT_RECORDER_H_
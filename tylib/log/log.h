@@ -5,20 +5,41 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
-#include <sys/ipc.h>
+#include <pthread.h>
+#include <sys/file.h>
 #include <sys/mman.h>
-#include <sys/sem.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "tylib/log/async_writer.h"
+#include "tylib/log/binary_log.h"
+#include "tylib/log/flight_recorder.h"
+#include "tylib/log/log_index.h"
+#include "tylib/log/log_shard.h"
+#include "tylib/log/log_site.h"
+#include "tylib/log/rate_limit.h"
+#include "tylib/log/uring_writer.h"
+#include "tylib/string/any_append.h"
+#include "tylib/time/clock.h"
 
 namespace tylib {
 
@@ -52,6 +73,30 @@ enum MLOG_FMT {
   MLOG_F_ALL = 0xFFFFFFFF
 };
 
+// how lines reach the file, set once by Init
+enum MLOG_MODE {
+  MLOG_M_SYNC = 0,   // write(2) on caller thread
+  MLOG_M_ASYNC = 1,  // per-thread ring, background thread writev(2)
+  MLOG_M_MMAP = 2,   // pre-sized segment mmap'd, lines memcpy'd, no syscall
+  MLOG_M_BINARY = 4,  // MLOG_BIN writes binary records, see mlog_decode
+  MLOG_M_FLIGHT = 8,  // verbose lines kept in memory, written on error
+  MLOG_M_INDEX = 16,  // time index <segment>.idx, see mlog_query
+  MLOG_M_URING = 32,  // writes submitted to io_uring, write(2) if no kernel
+                      // support. Meant for MLOG_M_ASYNC batches, ignored
+                      // with MLOG_M_MMAP
+  MLOG_M_SHARD = 64,  // a file per thread, lines tagged, see mlog_merge.
+                      // Ignored with MLOG_M_MMAP. No ASYNC, URING or INDEX
+                      // on it: a shard is in the order of its thread. No
+                      // BINARY, records have no tag, MLOG_BIN writes text.
+                      // No FLIGHT, a dump writes lines older than its shard
+};
+
+// line layout of MLOG_KV
+enum MLOG_KV_FMT {
+  MLOG_KV_LOGFMT = 0,  // prefix as MLOG, then msg="..." key=value ...
+  MLOG_KV_JSON = 1,    // one JSON object per line, prefix fields as members
+};
+
 enum MLOG_LEVEL {
   MLOG_LV_ERROR = 1,
   MLOG_LV_NORMAL = 2,
@@ -63,6 +108,28 @@ namespace mlog {
 
 static inline pid_t gettid(void) { return syscall(__NR_gettid); }
 
+struct ThreadIds {
+  pid_t pid;
+  pid_t tid;
+};
+
+inline void ResetLocalIds();
+
+// pid and tid of calling thread without a syscall per call
+inline const ThreadIds& LocalIds() {
+  static thread_local ThreadIds ids = {0, 0};
+  if (unlikely(ids.tid == 0)) {
+    static int atfork = pthread_atfork(nullptr, nullptr, ResetLocalIds);
+    (void)atfork;
+    ids.pid = getpid();
+    ids.tid = gettid();
+  }
+  return ids;
+}
+
+// forking thread is the only thread of child
+inline void ResetLocalIds() { const_cast<ThreadIds&>(LocalIds()).tid = 0; }
+
 static inline const char* getpname(void) {
   static char pname[1024] = {0};
   if (pname[0] == 0) {
@@ -87,42 +154,6 @@ static inline const char* getpname(void) {
   return pname;
 }
 
-static inline int sem_lock(int semid) {
-  struct sembuf op_down = {0, -1, SEM_UNDO};
-  return semop(semid, &op_down, 1);
-}
-
-static inline int sem_unlock(int semid) {
-  struct sembuf op_up = {0, 1, SEM_UNDO};
-  return semop(semid, &op_up, 1);
-}
-
-inline int sem_init_count(key_t semkey, int count) {
-  int semid;
-
-  if ((semid = semget(semkey, 0, 0)) == -1) {
-    if ((semid = semget(semkey, 1,
-                        IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR | S_IRGRP |
-                            S_IWGRP | S_IROTH | S_IWOTH)) != -1) {
-      struct sembuf sbuf;
-      sbuf.sem_num = 0;
-      sbuf.sem_op = count;
-      sbuf.sem_flg = 0;
-      if (semop(semid, &sbuf, 1) == -1) {
-        return -1;
-      }
-    } else if (errno == EEXIST) {
-      if ((semid = semget(semkey, 0, 0)) == -1) {
-        return -1;
-      }
-    } else {
-      return -1;
-    }
-  }
-
-  return semid;
-}
-
 class CMLogger {
  public:
   CMLogger();
@@ -130,28 +161,181 @@ class CMLogger {
 
  public:
   int Init(int _mylevel, unsigned _format, const char* _dir,
-           const char* _prefix, unsigned long _size);
+           const char* _prefix, unsigned long _size,
+           unsigned _mode = MLOG_M_SYNC);
+
+  // call before Init, only used in MLOG_M_ASYNC mode
+  void SetAsyncConf(const MLogAsyncConf& conf) { asyncConf = conf; }
+
+  // call before Init, only used in MLOG_M_FLIGHT mode
+  void SetFlightConf(const MLogFlightConf& conf) { flightConf = conf; }
+
+  // call before Init, only used in MLOG_M_INDEX mode
+  void SetIndexConf(const MLogIndexConf& conf) { indexConf = conf; }
+
+  // write lines kept by MLOG_M_FLIGHT of calling thread or all threads
+  void DumpFlight(bool allThreads = false) {
+    if (flight) flight->Dump(allThreads);
+  }
+
+  // block until buffered lines are written, no-op in sync mode
+  void Flush() {
+    if (async) async->Flush();
+    if (uring) uring->Drain();
+  }
+
+  // lines lost by MLOG_FULL_DROP since Init
+  unsigned long Dropped() const { return async ? async->Dropped() : 0; }
+
+  // bytes MLOG_M_URING failed to write since Init, each loss is also
+  // noted by a line in the log
+  unsigned long Lost() const { return uring ? uring->Lost() : 0; }
 
   int Log(int level, const char* file, int line, const char* func,
           const char* fmt, ...) __attribute__((format(printf, 6, 7)));
 
+  // MLOG, level is checked by the macro with Pass
+  int Log(const LogSite* site, int level, const char* fmt, ...)
+      __attribute__((format(printf, 4, 5)));
+
+  // MLOG_KV, kv is key, value, key, value... keys are const char*, values
+  // are rendered by AnyAppend straight into the line
+  template <class... Args>
+  int LogKV(const LogSite* site, int level, const char* msg,
+            const Args&... kv);
+
+  // MLOG_KV_LOGFMT or MLOG_KV_JSON
+  void SetKvFormat(unsigned kvFmt) { kvFormat = kvFmt; }
+
+  // clock of the timestamps, TIER_PRECISE by default. TIER_TSC keeps us
+  // for less, TIER_CACHED stamps the lines of a loop turn alike.
+  void SetClockTier(Clock::Tier tier) { clockTier = tier; }
+
+  // MLOG_BIN, level and site are checked by the macro
+  template <class... Args>
+  int LogBin(int level, BinSite* site, const Args&... args);
+
   int Level() { return mylevel; }
 
+  // logger level or the control rule of the site
+  bool Pass(LogSite* site, int level) {
+    return SitePass(site, level, mylevel);
+  }
+
+  bool Binary() const { return mode & MLOG_M_BINARY; }
+
  private:
   struct mmap_struct {
     long ts;              // 4 bytes in 32-bit mode, 8 bytes in 64-bit mode
     unsigned long bytes;  // 4 bytes in 32-bit mode, 8 bytes in 64-bit mode
-  };  // 8 bytes in 32-bit mode, 16 bytes in 64-bit mode
+    unsigned long gen;    // +1 on each rotation, starts from 1
+
+    // process-shared robust mutex, guards rotation. Uncontended lock is one
+    // CAS, unlock wakes one waiter, a crashed holder is seen as EOWNERDEAD.
+    pthread_mutex_t lock;
 
-  std::string MakeName(long ts);
+    // MLOG_M_MMAP only, generation << 48 | bytes reserved in the segment,
+    // bytes above counts what is copied in
+    unsigned long long reserve;
+    long gents[4];  // ts of segment of generation g is gents[g & 3]
+  };
+
+  // mapping of one MLOG_M_MMAP segment, slot is reused 4 generations later
+  struct Segment {
+    std::atomic<unsigned> gen{~0U};
+    char* base = nullptr;
+  };
+
+  static const int kGenShift = 48;
+  static const uint32_t kBinSites = 4096;  // MLOG_BIN sites with an epoch
+  static const unsigned long long kOffMask = (1ULL << kGenShift) - 1;
+
+  std::string MakeName(long ts, bool link = true);
 
   void Clean();
 
+  int InitHeader(bool fresh);
+
+  void Lock();
+
+  void Unlock() {
+    pthread_mutex_unlock(const_cast<pthread_mutex_t*>(&mm->lock));
+  }
+
+  void CheckRotate();
+
   int Log(const char* buf, int len);
 
+  // line of level to the flight ring or to Log
+  int Route(int level, const char* buf, int len);
+
+  int Write(const iovec* iov, int cnt);
+
+  int UringWrite(const iovec* iov, int cnt);
+
+  // rotate when the segment is full, MLOG_M_SHARD does no more
+  void CheckSize();
+
+  static unsigned long NextShardId() {
+    static std::atomic<unsigned long> id{0};
+    return ++id;
+  }
+
+  Shard* LocalShard();
+
+  int ShardWrite(const iovec* iov, int cnt);
+
+  // shard tag of a new line at buf, nothing if not MLOG_M_SHARD
+  int Tag(char* buf, int len) {
+    if (!(mode & MLOG_M_SHARD)) return 0;
+    return ShardTag(buf, len, ++shardSeq, clockTier);
+  }
+
+  unsigned CurrentGen() const {
+    return __atomic_load_n(&mm->reserve, __ATOMIC_ACQUIRE) >> kGenShift;
+  }
+
+  char* MapSegment(unsigned gen);
+
+  void RotateSegment(unsigned gen, unsigned long end);
+
+  int MmapWrite(const iovec* iov, int cnt);
+
+  void TruncateSegment();
+
+  // index entry for a write at off of segment gen named by ts
+  void Index(unsigned long gen, long ts, unsigned long off);
+
+  int VLog(int level, const char* file, int line, const char* func,
+           const char* fmt, va_list args);
+
+  // fields of format in order, made by Init for Prefix
+  enum PrefixField {
+    PF_PNAME,
+    PF_LEVEL,
+    PF_TIME,
+    PF_PID,
+    PF_TID,
+    PF_FILELINE,
+    PF_FUNC,
+  };
+
+  void CompilePrefix();
+
+  int Prefix(char* buf, int len, int level, const char* file, int line,
+             const char* func);
+
+  void JsonPrefix(FixedBuffer* out, int level, const char* file, int line,
+                  const char* func);
+
  private:
   int mylevel;
   unsigned format;
+  unsigned char plan[8];  // PrefixField
+  int planLen;
+  std::string pnameText;  // "pname "
+  unsigned kvFormat;
+  Clock::Tier clockTier;
   std::string dir;
   std::string prefix;
 
@@ -160,41 +344,119 @@ class CMLogger {
 
  private:
   int lkfd;
-  int semid;
   volatile mmap_struct* mm;
 
  private:
-  long myts;  // 4 bytes in 32-bit mode, 8 bytes in 64-bit mode
+  unsigned long mygen;  // mm->gen of segment fd is open on
+  long myts;            // name of that segment
+  std::mutex fdLock;    // threads of this process reopening fd
   int fd;
   int init;
+
+ private:
+  unsigned mode;
+  MLogAsyncConf asyncConf;
+  std::unique_ptr<AsyncWriter> async;
+  MLogFlightConf flightConf;
+  std::unique_ptr<FlightRecorder> flight;
+  std::unique_ptr<uint64_t[]> binEpochs;  // BinEpoch of DEF by site id
+
+  std::mutex segLock;  // protect segs remap
+  Segment segs[4];
+
+ private:
+  std::string ctlPath;  // .mlog.<prefix>.ctl, rules of sites
+  MLogCtl* ctl;
+  std::atomic<unsigned long> ctlGen;
+
+ private:
+  MLogIndexConf indexConf;
+  std::mutex idxLock;  // protect idxFd
+  int idxFd;
+  std::atomic<unsigned long> idxGen;  // segment of idxFd
+  std::atomic<long> idxSec;           // of this process' last entry
+  std::atomic<unsigned long> idxOff;
+
+ private:
+  std::shared_ptr<UringWriter> uring;
+
+ private:
+  unsigned long shardId;  // of this Init, keys the shards of threads
+  std::atomic<unsigned long long> shardSeq;
+  std::mutex shardLock;  // protect shards
+  std::vector<std::weak_ptr<Shard>> shards;
 };
 
 inline CMLogger::CMLogger()
     : mylevel(0),
       format(0),
+      planLen(0),
+      kvFormat(MLOG_KV_LOGFMT),
+      clockTier(Clock::TIER_PRECISE),
       size(0),
       lkfd(-1),
-      semid(-1),
       mm(0),
+      mygen(0),
       myts(0),
       fd(-1),
-      init(0) {}
+      init(0),
+      mode(MLOG_M_SYNC),
+      ctl(nullptr),
+      ctlGen(0),
+      idxFd(-1),
+      idxGen(~0UL),
+      idxSec(0),
+      idxOff(0),
+      shardId(0),
+      shardSeq(0) {}
 
 inline CMLogger::~CMLogger() { Clean(); }
 
 inline void CMLogger::Clean() {
+  // flush-on-shutdown, flusher still needs fd and mm
+  flight.reset();
+  async.reset();
+  uring.reset();  // waits for writes in flight
+
+  if ((mode & MLOG_M_MMAP) && mm && mm != MAP_FAILED) {
+    TruncateSegment();
+  }
+  for (Segment& seg : segs) {
+    if (seg.base) munmap(seg.base, size);
+    seg.base = nullptr;
+    seg.gen = ~0U;
+  }
+
   if (fd >= 0) {
     close(fd);
+    fd = -1;
   }
+  {
+    std::lock_guard<std::mutex> guard(shardLock);
+    for (auto& w : shards) {
+      if (auto s = w.lock()) s->Close();
+    }
+    shards.clear();
+  }
+  if (idxFd >= 0) {
+    close(idxFd);
+    idxFd = -1;
+  }
+  idxGen = ~0UL;
   if (lkfd >= 0) {
     close(lkfd);
+    lkfd = -1;
   }
   if (mm && mm != MAP_FAILED) {
     munmap(const_cast<mmap_struct*>(mm), sizeof(mmap_struct));
   }
+  mm = 0;
+
+  if (ctl) munmap(ctl, sizeof(MLogCtl));
+  ctl = nullptr;
 }
 
-inline std::string CMLogger::MakeName(long ts) {
+inline std::string CMLogger::MakeName(long ts, bool link) {
   struct tm t;
   time_t tt = ts;
   localtime_r(&tt, &t);
@@ -203,6 +465,8 @@ inline std::string CMLogger::MakeName(long ts) {
            prefix.c_str(), t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour,
            t.tm_min, t.tm_sec);
 
+  if (!link) return tmp;
+
   const char* softlinkTarget = tmp + dir.size() + 1;
 
   char softlink[1024];
@@ -217,7 +481,8 @@ inline std::string CMLogger::MakeName(long ts) {
 }
 
 inline int CMLogger::Init(int _mylevel, unsigned _format, const char* _dir,
-                          const char* _prefix, unsigned long _size) {
+                          const char* _prefix, unsigned long _size,
+                          unsigned _mode) {
   if (init) return 0;
 
   int ret = 0;
@@ -244,128 +509,501 @@ inline int CMLogger::Init(int _mylevel, unsigned _format, const char* _dir,
     return -1;
   }
 
-  key_t semkey = ftok(lkfile.c_str(), 81);
-  if ((semid = sem_init_count(semkey, 1)) == -1) {
+  // header is created under flock, after that only mm->lock is used
+  if (flock(lkfd, LOCK_EX) != 0) {
     Clean();
     return -2;
   }
 
-  sem_lock(semid);
+  bool fresh = false;
   if (fstat(lkfd, &sb) != 0)
     ret = -3;
   else if (sb.st_size != sizeof(mmap_struct)) {
-    if (sb.st_size && ftruncate(lkfd, 0) != 0)
+    if (ftruncate(lkfd, 0) != 0 || ftruncate(lkfd, sizeof(mmap_struct)) != 0)
       ret = -4;
-    else {
-      mmap_struct md = {time(nullptr), 0};
-      if (write(lkfd, &md, sizeof(mmap_struct)) != sizeof(mmap_struct))
-        ret = -5;
-    }
+    else
+      fresh = true;
+  }
+
+  if (ret == 0) ret = InitHeader(fresh);
+
+  // every MLOG_M_MMAP process holds it shared, the last one to close can get
+  // it exclusive and truncate the segment, see TruncateSegment
+  mode = _mode;
+  if (mode & MLOG_M_MMAP) mode &= ~MLOG_M_SHARD;
+  if (mode & MLOG_M_SHARD) {
+    mode &= ~(MLOG_M_ASYNC | MLOG_M_URING | MLOG_M_INDEX | MLOG_M_BINARY |
+              MLOG_M_FLIGHT);
+  }
+  if (flock(lkfd, (mode & MLOG_M_MMAP) ? LOCK_SH : LOCK_UN) != 0 && !ret) {
+    ret = -7;
   }
-  sem_unlock(semid);
 
   if (ret) {
     Clean();
     return ret;
   }
 
+  mygen = 0;
+  fd = -1;
+  shardId = NextShardId();
+  CompilePrefix();
+  init = 1;
+
+  // optional, without it sites just follow mylevel
+  RaiseMaxLevel(mylevel);
+  ctlPath = lkfile + ".ctl";
+  ctl = MapControl(ctlPath.c_str());
+  if (ctl) CheckControl(ctlPath.c_str(), ctl, &ctlGen);
+
+  if ((mode & MLOG_M_URING) && !(mode & MLOG_M_MMAP)) {
+    uring = std::make_shared<UringWriter>();
+    if (!uring->Init()) uring.reset();
+  }
+
+  if (mode & MLOG_M_BINARY) binEpochs.reset(new uint64_t[kBinSites]());
+
+  if (mode & MLOG_M_ASYNC) {
+    async.reset(new AsyncWriter(
+        asyncConf, [this](const iovec* iov, int cnt) {
+          return Write(iov, cnt);
+        }));
+  }
+
+  // The crash sink runs in the signal handler, a write(2) to fd and no
+  // more: fd is opened here and only dup2'd over later. MMAP has no such
+  // fd, its dumps on a signal go to stderr.
+  if (mode & MLOG_M_FLIGHT) {
+    if (!(mode & MLOG_M_MMAP)) CheckRotate();
+    flight.reset(new FlightRecorder(
+        flightConf, [this](const char* buf, int len) { return Log(buf, len); },
+        [this](const char* buf, int len) {
+          return static_cast<int>(write(fd >= 0 ? fd : 2, buf, len));
+        }));
+  }
+
+  return 0;
+}
+
+inline int CMLogger::InitHeader(bool fresh) {
   mm = static_cast<mmap_struct*>(mmap(
       0, sizeof(mmap_struct), PROT_READ | PROT_WRITE, MAP_SHARED, lkfd, 0));
-  if (mm == MAP_FAILED) {
-    Clean();
-    return -6;
+  if (mm == MAP_FAILED) return -6;
+
+  // gen is set last, 0 means creator died before header was complete
+  if (!fresh && mm->gen != 0) return 0;
+
+  long now = time(nullptr);
+  mm->ts = now;
+  mm->bytes = 0;
+  mm->reserve = 0;
+  mm->gents[0] = now;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  int ret = pthread_mutex_init(const_cast<pthread_mutex_t*>(&mm->lock), &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (ret != 0) return -5;
+
+  __sync_synchronize();
+  mm->gen = 1;
+  return 0;
+}
+
+// Holder died: kernel hands the lock over. Whatever it left half done is
+// redone by the double check after Lock().
+inline void CMLogger::Lock() {
+  pthread_mutex_t* m = const_cast<pthread_mutex_t*>(&mm->lock);
+  if (pthread_mutex_lock(m) == EOWNERDEAD) pthread_mutex_consistent(m);
+}
+
+static const int kTimeLen = 26;  // YYYY-MM-DD HH:MM:SS.mmmuuu
+
+// now in local time, kTimeLen chars at buf. The calendar part is made by
+// localtime_r once a second per thread, the rest is written by hand.
+inline void FormatNow(char* buf, Clock::Tier tier = Clock::TIER_PRECISE) {
+  struct Cache {
+    time_t sec = -1;
+    char text[64];  // YYYY-MM-DD HH:MM:SS.
+  };
+  static thread_local Cache cache;
+
+  const int64_t ns = Clock::RealtimeNs(tier);
+  const time_t sec = ns / 1000000000;
+  if (unlikely(sec != cache.sec)) {
+    struct tm t;
+    localtime_r(&sec, &t);
+    snprintf(cache.text, sizeof(cache.text), "%4d-%02d-%02d %02d:%02d:%02d.",
+             t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min,
+             t.tm_sec);
+    cache.sec = sec;
   }
 
-  myts = 0;
-  fd = -1;
-  init = 1;
-  return 0;
+  memcpy(buf, cache.text, 20);
+  unsigned us = ns % 1000000000 / 1000;
+  for (int i = kTimeLen - 1; i >= 20; --i) {
+    buf[i] = '0' + us % 10;
+    us /= 10;
+  }
 }
 
-inline int CMLogger::Log(int level, const char* file, int line,
-                         const char* func, const char* fmt, ...) {
-  if (level > mylevel) return 0;
+inline int FormatTime(char* buf, int len,
+                      Clock::Tier tier = Clock::TIER_PRECISE) {
+  if (len <= kTimeLen) return snprintf(buf, len, "%s", "");
+  FormatNow(buf, tier);
+  buf[kTimeLen] = 0;
+  return kTimeLen;
+}
 
-  char buf[8 * 1024];
-  int n = 0;
+inline void AppendInt(FixedBuffer* out, long v) {
+  char num[24];
+  auto r = std::to_chars(num, num + sizeof(num), v);
+  out->Append(num, r.ptr - num);
+}
+
+inline void CMLogger::CompilePrefix() {
+  planLen = 0;
+  pnameText.clear();
+  if (format & MLOG_F_PNAME) {
+    pnameText = std::string(getpname()) + " ";
+    plan[planLen++] = PF_PNAME;
+  }
+  if (format & MLOG_F_LEVEL) plan[planLen++] = PF_LEVEL;
+  if (format & MLOG_F_TIME) plan[planLen++] = PF_TIME;
+  if (format & MLOG_F_PID) plan[planLen++] = PF_PID;
+  if (format & MLOG_F_TID) plan[planLen++] = PF_TID;
+  if (format & MLOG_F_FILELINE) plan[planLen++] = PF_FILELINE;
+  if (format & MLOG_F_FUNC) plan[planLen++] = PF_FUNC;
+}
+
+// fields of plan, each followed by a space, no snprintf or syscall
+inline int CMLogger::Prefix(char* buf, int len, int level, const char* file,
+                            int line, const char* func) {
+  FixedBuffer out(buf, len - 1);
+  out.Resize(Tag(buf, len));
+
+  for (int i = 0; i < planLen; ++i) {
+    switch (plan[i]) {
+      case PF_PNAME:
+        out.Append(pnameText);
+        continue;
+      case PF_LEVEL:
+        AppendInt(&out, level);
+        break;
+      case PF_TIME:
+        if (out.Room() < static_cast<size_t>(kTimeLen)) break;
+        FormatNow(out.Cursor(), clockTier);
+        out.Resize(out.Size() + kTimeLen);
+        break;
+      case PF_PID:
+        AppendInt(&out, LocalIds().pid);
+        break;
+      case PF_TID:
+        AppendInt(&out, LocalIds().tid);
+        break;
+      case PF_FILELINE:
+        out.Append(file);
+        out.Put(':');
+        AppendInt(&out, line);
+        break;
+      case PF_FUNC:
+        out.Append(func);
+        break;
+    }
+    out.Put(' ');
+  }
+  return out.Size();
+}
 
+// same fields as Prefix, each a member of the line object
+inline void CMLogger::JsonPrefix(FixedBuffer* out, int level, const char* file,
+                                 int line, const char* func) {
   if (format & MLOG_F_PNAME) {
-    n += snprintf(buf + n, sizeof(buf) - n, "%s ", getpname());
+    out->Append("\"pname\":");
+    AnyAppendJsonString(out, getpname(), strlen(getpname()));
+    out->Put(',');
   }
 
   if (format & MLOG_F_LEVEL) {
-    n += snprintf(buf + n, sizeof(buf) - n, "%d ", level);
+    out->Append("\"level\":");
+    AnyAppend(out, level);
+    out->Put(',');
   }
 
   if (format & MLOG_F_TIME) {
-    struct timespec tspec;
-    clock_gettime(CLOCK_REALTIME, &tspec);
-
-    struct tm t;
-    localtime_r(&tspec.tv_sec, &t);
-    int ms = tspec.tv_nsec / 1000000;
-    int us = tspec.tv_nsec / 1000 - ms * 1000;
-    n += snprintf(buf + n, sizeof(buf) - n,
-                  "%4d-%02d-%02d %02d:%02d:%02d.%03d%03d ", t.tm_year + 1900,
-                  t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, ms,
-                  us);
+    char t[64];
+    out->Append("\"time\":");
+    AnyAppendJsonString(out, t, FormatTime(t, sizeof(t), clockTier));
+    out->Put(',');
   }
 
   if (format & MLOG_F_PID) {
-    n += snprintf(buf + n, sizeof(buf) - n, "%d ", getpid());
+    out->Append("\"pid\":");
+    AnyAppend(out, LocalIds().pid);
+    out->Put(',');
   }
 
   if (format & MLOG_F_TID) {
-    n += snprintf(buf + n, sizeof(buf) - n, "%d ", gettid());
+    out->Append("\"tid\":");
+    AnyAppend(out, LocalIds().tid);
+    out->Put(',');
   }
 
   if (format & MLOG_F_FILELINE) {
-    n += snprintf(buf + n, sizeof(buf) - n, "%s:%d ", file, line);
+    out->Append("\"file\":");
+    AnyAppendJsonString(out, file, strlen(file));
+    out->Append(",\"line\":");
+    AnyAppend(out, line);
+    out->Put(',');
   }
 
   if (format & MLOG_F_FUNC) {
-    n += snprintf(buf + n, sizeof(buf) - n, "%s ", func);
+    out->Append("\"func\":");
+    AnyAppendJsonString(out, func, strlen(func));
+    out->Put(',');
   }
+}
+
+inline int CMLogger::Log(int level, const char* file, int line,
+                         const char* func, const char* fmt, ...) {
+  if (level > mylevel) return 0;
 
   va_list args;
   va_start(args, fmt);
+  int ret = VLog(level, file, line, func, fmt, args);
+  va_end(args);
+  return ret;
+}
+
+inline int CMLogger::Log(const LogSite* site, int level, const char* fmt,
+                         ...) {
+  va_list args;
+  va_start(args, fmt);
+  int ret = VLog(level, site->file, site->line, site->func, fmt, args);
+  va_end(args);
+  return ret;
+}
+
+inline int CMLogger::VLog(int level, const char* file, int line,
+                          const char* func, const char* fmt, va_list args) {
+  char buf[8 * 1024];
+  int n = Prefix(buf, sizeof(buf), level, file, line, func);
+
   n += vsnprintf(buf + n, sizeof(buf) - n, fmt, args);
   if (n >= static_cast<int>(sizeof(buf))) {
     n = sizeof(buf) - 1;
   }
-  va_end(args);
 
   buf[n++] = '\n';
-  return Log(buf, n);
+  return Route(level, buf, n);
 }
 
-inline int CMLogger::Log(const char* buf, int len) {
+// bare JSON in a JSON line: numbers, bools as AnyToString prints them (1/0)
+// and JSON values. Anything else is made a string.
+template <class V>
+struct KvJsonValue {
+  enum {
+    value = std::is_arithmetic<V>::value && !std::is_same<V, char>::value &&
+            !std::is_same<V, signed char>::value &&
+            !std::is_same<V, unsigned char>::value
+  };
+};
+
+#ifdef JSONCPP
+template <>
+struct KvJsonValue<Json::Value> {
+  enum { value = 1 };
+};
+#endif
+
+#ifdef RAPIDJSON
+template <class E, class A>
+struct KvJsonValue<rapidjson::GenericValue<E, A> > {
+  enum { value = 1 };
+};
+
+template <class E, class A, class S>
+struct KvJsonValue<rapidjson::GenericDocument<E, A, S> > {
+  enum { value = 1 };
+};
+#endif
+
+template <class V>
+typename std::enable_if<std::is_floating_point<V>::value, bool>::type
+KvJsonBare(const V& v) {
+  return std::isfinite(v);  // nan and inf are no JSON numbers
+}
+
+template <class V>
+typename std::enable_if<!std::is_floating_point<V>::value, bool>::type
+KvJsonBare(const V&) {
+  return KvJsonValue<V>::value;
+}
+
+template <class V>
+void AppendKV(FixedBuffer* out, bool json, const char* key, const V& v) {
+  if (json) {
+    AnyAppendJsonString(out, key, strlen(key));
+    out->Put(':');
+  } else {
+    out->Append(key);
+    out->Put('=');
+  }
+
+  size_t start = out->Size();
+  AnyAppend(out, v);
+  if (!json || !KvJsonBare(v)) QuoteSince(out, start, json);
+}
+
+inline void AppendKVs(FixedBuffer*, bool) {}
+
+template <class K, class V, class... Args>
+void AppendKVs(FixedBuffer* out, bool json, const K& key, const V& v,
+               const Args&... kv) {
+  out->Put(json ? ',' : ' ');
+  AppendKV(out, json, key, v);
+  AppendKVs(out, json, kv...);
+}
+
+template <class... Args>
+inline int CMLogger::LogKV(const LogSite* site, int level, const char* msg,
+                           const Args&... kv) {
+  static_assert(sizeof...(Args) % 2 == 0, "MLOG_KV takes key, value pairs");
+
+  char buf[8 * 1024];
+  const bool json = kvFormat == MLOG_KV_JSON;
+  // 2 bytes kept for closing '}' and '\n', a cut line is still one object
+  FixedBuffer out(buf, sizeof(buf) - 2);
+  if (json) {
+    out.Resize(Tag(buf, sizeof(buf) - 2));
+    out.Put('{');
+    JsonPrefix(&out, level, site->file, site->line, site->func);
+  } else {
+    out.Resize(Prefix(buf, sizeof(buf) - 2, level, site->file, site->line,
+                      site->func));
+  }
+
+  AppendKV(&out, json, "msg", msg);
+  AppendKVs(&out, json, kv...);
+
+  int n = out.Size();
+  if (json) buf[n++] = '}';
+  buf[n++] = '\n';
+  return Route(level, buf, n);
+}
+
+template <class... Args>
+inline int CMLogger::LogBin(int level, BinSite* site, const Args&... args) {
   if (unlikely(!init)) return -1;
 
-  if (unlikely(myts != mm->ts)) {
-    sem_lock(semid);
-    if (myts != mm->ts) {
-      myts = mm->ts;
-      int nfd = open(MakeName(myts).c_str(),
-                     O_CREAT | O_RDWR | O_APPEND | O_LARGEFILE, 0666);
-      if (nfd < 0)
-        ;
-      else if (fd < 0)
-        fd = nfd;
-      else {
-        dup2(nfd, fd);
-        close(nfd);
-      }
-    }
-    sem_unlock(semid);
+  char buf[8 * 1024];
+  BinWriter w(buf, sizeof(buf));
+  const ThreadIds& ids = LocalIds();
+  uint32_t id = BinSiteId(site);
+
+  // DEF goes to each segment before the first LOG of the site in it, and
+  // again from a forked child. Each logger keeps its own epochs, a site may
+  // log through several. A record kept by the flight ring carries its own
+  // DEF, it may never be dumped, so do sites past kBinSites.
+  uint64_t epoch = BinEpoch(ids.pid, mm->gen);
+  uint64_t* mark = binEpochs && id < kBinSites ? &binEpochs[id] : nullptr;
+  const bool kept = flight && level > flightConf.file_level;
+  if (unlikely(kept || !mark ||
+               __atomic_load_n(mark, __ATOMIC_RELAXED) != epoch)) {
+    if (!kept && mark) __atomic_store_n(mark, epoch, __ATOMIC_RELAXED);
+    BinDef d;
+    d.h.magic = kBinMagic;
+    d.h.type = BIN_DEF;
+    d.h.level = 0;
+    d.pid = ids.pid;
+    d.id = id;
+    d.format = format;
+    d.line = site->line;
+    char* at = w.Reserve(sizeof(d));
+    w.PutStr(site->file);
+    w.PutStr(site->func);
+    w.PutStr(site->fmt);
+    w.PutStr(getpname());
+    if (!w.ok()) return -1;
+    d.h.len = w.Size();
+    memcpy(at, &d, sizeof(d));
   }
 
+  size_t start = w.Size();
+  char* at = w.Reserve(sizeof(BinLog));
+  if (!at) return -1;
+
+  BinLog r;
+  r.h.magic = kBinMagic;
+  r.h.type = BIN_LOG;
+  r.h.level = level;
+  r.pid = ids.pid;
+  r.tid = ids.tid;
+  r.id = id;
+  r.reserved = 0;
+  r.ns = Clock::RealtimeNs(clockTier);
+  w.Args(args...);  // a cut argument still leaves a valid record
+  r.h.len = w.Size() - start;
+  memcpy(at, &r, sizeof(r));
+
+  return Route(level, w.Data(), w.Size());
+}
+
+inline int CMLogger::Route(int level, const char* buf, int len) {
+  if (likely(!flight)) return Log(buf, len);
+
+  if (level > flightConf.file_level) {
+    flight->Record(buf, len);
+    return len;
+  }
+
+  // context before the error line
+  if (level <= MLOG_LV_ERROR && flightConf.dump_on_error) {
+    flight->Dump(flightConf.dump_all_threads);
+  }
+  return Log(buf, len);
+}
+
+inline int CMLogger::Log(const char* buf, int len) {
+  if (unlikely(!init)) return -1;
+
+  if (ctl) CheckControl(ctlPath.c_str(), ctl, &ctlGen);
+
+  if (async) return async->Push(buf, len);
+
+  iovec iov;
+  iov.iov_base = const_cast<char*>(buf);
+  iov.iov_len = len;
+  return Write(&iov, 1);
+}
+
+inline void CMLogger::CheckSize() {
   if (unlikely(mm->bytes >= size))  // Double Checked Locking
   {
-    sem_lock(semid);
+    Lock();
     // Maybe fd is old file, but check bytes is small (new file).
     if (mm->bytes >= size) {
-      myts = time(nullptr);
+      mm->ts = time(nullptr);
+      mm->bytes = 0;  // Other processes may hold old file, but check bytes is
+                      // small (new file).
+      __sync_add_and_fetch(&mm->gen, 1);
+    }
+    Unlock();
+  }
+}
+
+inline void CMLogger::CheckRotate() {
+  CheckSize();
+
+  // Each process reopens on its own, no shared lock, so a rotation doesn't
+  // make every writer queue on it.
+  if (unlikely(mygen != mm->gen)) {
+    std::lock_guard<std::mutex> guard(fdLock);
+    unsigned long gen = mm->gen;
+    if (mygen != gen) {
+      myts = mm->ts;
       int nfd = open(MakeName(myts).c_str(),
                      O_CREAT | O_RDWR | O_APPEND | O_LARGEFILE, 0666);
       if (nfd < 0) {
@@ -378,37 +1016,372 @@ inline int CMLogger::Log(const char* buf, int len) {
                         // to old file.
         close(nfd);
       }
-
-      mm->ts = myts;
-      mm->bytes = 0;  // Other processes may hold old file, but check bytes is
-                      // small (new file).
+      mygen = gen;
     }
-    sem_unlock(semid);
   }
+}
+
+// a batch of whole lines, O_APPEND writev keeps it contiguous in file
+inline int CMLogger::Write(const iovec* iov, int cnt) {
+  if (mode & MLOG_M_MMAP) return MmapWrite(iov, cnt);
+  if (mode & MLOG_M_SHARD) return ShardWrite(iov, cnt);
+
+  CheckRotate();
+
+  // all writes counted in bytes are before this one in the file
+  unsigned long off = mm->bytes;
 
   int n;
-  while ((n = write(fd, buf, len)) < 0 && errno == EINTR);
+  if (uring) {
+    n = UringWrite(iov, cnt);
+  } else if (cnt == 1) {
+    while ((n = write(fd, iov->iov_base, iov->iov_len)) < 0 && errno == EINTR);
+  } else {
+    while ((n = writev(fd, iov, cnt)) < 0 && errno == EINTR);
+  }
   if (n > 0) (void)__sync_add_and_fetch(&mm->bytes, n);
+  if (n > 0 && (mode & MLOG_M_INDEX)) Index(mygen, myts, off);
 
   return n;
 }
 
+// shard of calling thread for this logger, made on its first line
+inline Shard* CMLogger::LocalShard() {
+  struct ThreadShards {
+    std::vector<std::pair<unsigned long, std::shared_ptr<Shard>>> shards;
+  };
+  static thread_local ThreadShards local;
+
+  for (auto& s : local.shards) {
+    if (s.first == shardId) return s.second.get();
+  }
+
+  // shards of cleaned loggers are closed, drop them
+  auto& v = local.shards;
+  v.erase(std::remove_if(v.begin(), v.end(),
+                         [](const std::pair<unsigned long,
+                                            std::shared_ptr<Shard>>& s) {
+                           return s.second->fd.load() < 0;
+                         }),
+          v.end());
+
+  auto s = std::make_shared<Shard>();
+  {
+    std::lock_guard<std::mutex> guard(shardLock);
+    shards.erase(std::remove_if(shards.begin(), shards.end(),
+                                [](const std::weak_ptr<Shard>& w) {
+                                  return w.expired();
+                                }),
+                 shards.end());
+    shards.push_back(s);
+  }
+  v.emplace_back(shardId, s);
+  return s.get();
+}
+
+// Only the calling thread writes its shard, threads share nothing but the
+// byte count that drives rotation.
+inline int CMLogger::ShardWrite(const iovec* iov, int cnt) {
+  CheckSize();
+
+  Shard* s = LocalShard();
+  unsigned long gen = mm->gen;
+  pid_t tid = LocalIds().tid;
+  if (unlikely(s->gen != gen || s->tid != tid)) {
+    std::string name = MakeName(mm->ts, false);
+    name.insert(name.size() - 4, "." + std::to_string(tid));
+    int nfd = open(name.c_str(), O_CREAT | O_WRONLY | O_APPEND | O_LARGEFILE,
+                   0666);
+    if (nfd < 0) return -1;
+    int old = s->fd.exchange(nfd);
+    if (old >= 0) close(old);
+    s->gen = gen;
+    s->tid = tid;
+  }
+
+  int f = s->fd.load(std::memory_order_relaxed);
+  int n;
+  while ((n = writev(f, iov, cnt)) < 0 && errno == EINTR);
+  if (n > 0) (void)__sync_add_and_fetch(&mm->bytes, n);
+  return n;
+}
+
+// The registered file is what fd was open on when registered, a dup2 of a
+// later rotation leaves it and writes in flight on the old segment. It is
+// moved to the new one with the first write after the rotation.
+inline int CMLogger::UringWrite(const iovec* iov, int cnt) {
+  int done = uring->Write(fd, mygen, iov, cnt);
+  int n = 0;
+  for (int i = 0; i < done; ++i) n += iov[i].iov_len;
+  if (done < cnt) {
+    // too long for a buffer or no ring, what was submitted is written
+    int m;
+    while ((m = writev(fd, iov + done, cnt - done)) < 0 && errno == EINTR);
+    if (m < 0 && n == 0) return m;
+    if (m > 0) n += m;
+  }
+
+  // Lost bytes of earlier writes are taken off this one's count, so
+  // rotation follows what is in the file.
+  int err = 0;
+  unsigned long lost = uring->TakeLost(&err);
+  if (lost > 0) {
+    n = lost < static_cast<unsigned long>(n) ? n - lost : 0;
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf),
+                       "mlog: io_uring write failed, lost %lu bytes: %s\n",
+                       lost, strerror(err));
+    int m = write(fd, buf, len);
+    if (m > 0) n += m;
+  }
+  return n;
+}
+
+inline void CMLogger::Index(unsigned long gen, long ts, unsigned long off) {
+  long now = time(nullptr);
+  if (likely(idxGen.load(std::memory_order_relaxed) == gen &&
+             idxSec.load(std::memory_order_relaxed) == now &&
+             off - idxOff.load(std::memory_order_relaxed) < indexConf.step)) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(idxLock);
+  if (idxGen.load(std::memory_order_relaxed) != gen) {
+    if (idxFd >= 0) close(idxFd);
+    idxFd = open((MakeName(ts, false) + ".idx").c_str(),
+                 O_CREAT | O_WRONLY | O_APPEND | O_LARGEFILE, 0666);
+    idxGen.store(gen, std::memory_order_relaxed);
+  } else if (idxSec.load(std::memory_order_relaxed) == now &&
+             off - idxOff.load(std::memory_order_relaxed) < indexConf.step) {
+    return;
+  }
+
+  // one write(2), entries of processes never interleave
+  MLogIndexEntry e;
+  e.sec = now;
+  e.offset = off;
+  if (idxFd >= 0) (void)write(idxFd, &e, sizeof(e));
+  idxSec.store(now, std::memory_order_relaxed);
+  idxOff.store(off, std::memory_order_relaxed);
+}
+
+// Map segment of generation gen, which must be current or recent. Threads of
+// this process share the mapping, it's unmapped when slot is reused.
+inline char* CMLogger::MapSegment(unsigned gen) {
+  Segment& seg = segs[gen & 3];
+  if (likely(seg.gen.load(std::memory_order_acquire) == gen)) return seg.base;
+
+  std::lock_guard<std::mutex> guard(segLock);
+  if (seg.gen.load(std::memory_order_relaxed) == gen) return seg.base;
+
+  bool current = CurrentGen() == gen;
+  int sfd = open(MakeName(mm->gents[gen & 3], current).c_str(),
+                 O_CREAT | O_RDWR | O_LARGEFILE, 0666);
+  if (sfd < 0) return nullptr;
+
+  // first segment, or current one truncated by the last close. Under lock
+  // so it never grows a segment RotateSegment has already cut.
+  struct stat sb;
+  if (fstat(sfd, &sb) == 0 && static_cast<unsigned long>(sb.st_size) < size) {
+    Lock();
+    if (CurrentGen() == gen && fstat(sfd, &sb) == 0 &&
+        static_cast<unsigned long>(sb.st_size) < size) {
+      (void)ftruncate(sfd, size);
+    }
+    Unlock();
+  }
+
+  void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0);
+  close(sfd);
+  if (p == MAP_FAILED) return nullptr;
+
+  seg.gen.store(~0U, std::memory_order_relaxed);
+  if (seg.base) munmap(seg.base, size);
+  seg.base = static_cast<char*>(p);
+  seg.gen.store(gen, std::memory_order_release);
+  return seg.base;
+}
+
+// Called by the only writer whose reservation crosses size, end is where
+// valid data of segment gen stops.
+inline void CMLogger::RotateSegment(unsigned gen, unsigned long end) {
+  // Wait writers still copying into this segment, so none is left behind
+  // when its slot in segs and gents is reused. Give up on a dead writer.
+  time_t deadline = time(nullptr) + 2;
+  while (mm->bytes < end && time(nullptr) < deadline) sched_yield();
+
+  Lock();
+  if (CurrentGen() == gen) {
+    long oldts = mm->gents[gen & 3];
+    long ts = time(nullptr);
+    if (ts <= oldts) ts = oldts + 1;  // name must differ from old segment
+
+    unsigned next = (gen + 1) & 0xFFFF;
+    mm->gents[next & 3] = ts;
+    int nfd = open(MakeName(ts).c_str(), O_CREAT | O_RDWR | O_LARGEFILE, 0666);
+    if (nfd >= 0) {
+      (void)ftruncate(nfd, size);
+      close(nfd);
+    }
+
+    mm->ts = ts;
+    mm->bytes = 0;
+    __sync_add_and_fetch(&mm->gen, 1);
+    __atomic_store_n(&mm->reserve,
+                     static_cast<unsigned long long>(next) << kGenShift,
+                     __ATOMIC_SEQ_CST);
+
+    (void)truncate(MakeName(oldts, false).c_str(), end);
+  }
+  Unlock();
+}
+
+// Reserve with one fetch-add on shared header, then copy. A batch lands in
+// one segment, so a line never spans two files.
+inline int CMLogger::MmapWrite(const iovec* iov, int cnt) {
+  unsigned long len = 0;
+  for (int i = 0; i < cnt; ++i) len += iov[i].iov_len;
+
+  if (unlikely(len > size)) {
+    if (cnt > 1) {
+      int n = 0;
+      for (int i = 0; i < cnt; ++i) {
+        int r = MmapWrite(iov + i, 1);
+        if (r > 0) n += r;
+      }
+      return n;
+    }
+    len = size;  // cut too long line
+  }
+
+  for (;;) {
+    unsigned long long r = __sync_fetch_and_add(&mm->reserve, len);
+    unsigned gen = r >> kGenShift;
+    unsigned long off = r & kOffMask;
+
+    if (likely(off + len <= size)) {
+      char* base = MapSegment(gen);
+      if (likely(base != nullptr)) {
+        char* dst = base + off;
+        unsigned long left = len;
+        for (int i = 0; i < cnt && left > 0; ++i) {
+          unsigned long n = iov[i].iov_len < left ? iov[i].iov_len : left;
+          memcpy(dst, iov[i].iov_base, n);
+          dst += n;
+          left -= n;
+        }
+      }
+
+      // bytes counts committed data, RotateSegment waits on it
+      __sync_add_and_fetch(&mm->bytes, len);
+      if (mode & MLOG_M_INDEX) Index(gen, mm->gents[gen & 3], off);
+      return base ? static_cast<int>(len) : -1;
+    }
+
+    if (off <= size) {
+      RotateSegment(gen, off);
+    } else {
+      // crosser is rotating
+      while (CurrentGen() == gen) sched_yield();
+    }
+  }
+}
+
+// Drop the unused tail of current segment if no other writer is attached, so
+// tools don't see trailing zeros. A later writer grows it back in MapSegment.
+inline void CMLogger::TruncateSegment() {
+  if (lkfd < 0 || flock(lkfd, LOCK_EX | LOCK_NB) != 0) return;
+
+  Lock();
+  unsigned long long r = __atomic_load_n(&mm->reserve, __ATOMIC_ACQUIRE);
+  unsigned long end = r & kOffMask;
+  if (end > size) end = size;
+  (void)truncate(MakeName(mm->gents[(r >> kGenShift) & 3], false).c_str(), end);
+  Unlock();
+}
+
 }  // namespace mlog
 
 inline int MLOG_INIT(mlog::CMLogger* logger, int level, unsigned format,
-                     const char* dir, const char* prefix, unsigned long size) {
+                     const char* dir, const char* prefix, unsigned long size,
+                     unsigned mode = MLOG_M_SYNC) {
   mlog::getpname();
-  return logger->Init(level, format, dir, prefix, size);
+  return logger->Init(level, format, dir, prefix, size, mode);
 }
 
 #define __FILENAME__ \
   (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 
-#define MLOG(logger, level, fmt, y...)                                       \
-  do {                                                                       \
-    if (level > logger->Level()) break;                                      \
-    logger->Log(level, STRIP_FILENAME(__FILENAME__), __LINE__, __FUNCTION__, \
-                fmt, ##y);                                                   \
+// Site check shared by the macros, breaks out of their do while. A site the
+// logger level and the control rules turn off costs one load and a branch.
+#define MLOG_SITE_CHECK(logger, level)         \
+  MLOG_SITE(_mlog_site, level);                \
+  if (!MLOG_SITE_ON(_mlog_site, level) ||      \
+      !logger->Pass(&_mlog_site, level))       \
+  break
+
+#define MLOG(logger, level, fmt, y...)              \
+  do {                                              \
+    MLOG_SITE_CHECK(logger, level);                 \
+    logger->Log(&_mlog_site, level, fmt, ##y);      \
+  } while (0)
+
+// Rate limited MLOG, allow calls one of tylib::mlog::Rate* on _mlog_rate.
+// The emitted line carries how many lines of the site were skipped before it.
+#define MLOG_RATE_LIMITED(logger, level, allow, fmt, y...)                  \
+  do {                                                                      \
+    MLOG_SITE_CHECK(logger, level);                                         \
+    static tylib::mlog::RateSite _mlog_rate;                                \
+    uint64_t _mlog_skipped = 0;                                             \
+    if (!(allow)) break;                                                    \
+    if (_mlog_skipped) {                                                    \
+      logger->Log(&_mlog_site, level, fmt " (suppressed %llu lines)", ##y,  \
+                  static_cast<unsigned long long>(_mlog_skipped));          \
+    } else {                                                                \
+      logger->Log(&_mlog_site, level, fmt, ##y);                            \
+    }                                                                       \
+  } while (0)
+
+// 1st, (n+1)th, (2n+1)th... call of the site, every call if n <= 1
+#define MLOG_EVERY_N(logger, level, n, fmt, y...)                          \
+  MLOG_RATE_LIMITED(                                                       \
+      logger, level,                                                       \
+      tylib::mlog::RateEveryN(&_mlog_rate, n, &_mlog_skipped), fmt, ##y)
+
+// at most one line per ms milliseconds
+#define MLOG_EVERY_MS(logger, level, ms, fmt, y...)                        \
+  MLOG_RATE_LIMITED(                                                       \
+      logger, level,                                                       \
+      tylib::mlog::RateEveryMs(&_mlog_rate, ms, &_mlog_skipped), fmt, ##y)
+
+// per_second lines on average, up to burst at once
+#define MLOG_TOKEN_BUCKET(logger, level, per_second, burst, fmt, y...)     \
+  MLOG_RATE_LIMITED(logger, level,                                         \
+                    tylib::mlog::RateTokenBucket(&_mlog_rate, per_second,  \
+                                                 burst, &_mlog_skipped),   \
+                    fmt, ##y)
+
+// Binary record on a MLOG_M_BINARY logger, text line otherwise. fmt must be a
+// string literal, arguments are checked by the format attribute of Log.
+#define MLOG_BIN(logger, level, fmt, y...)                                  \
+  do {                                                                      \
+    MLOG_SITE_CHECK(logger, level);                                         \
+    if (!logger->Binary()) {                                                \
+      logger->Log(&_mlog_site, level, fmt, ##y);                            \
+      break;                                                                \
+    }                                                                       \
+    static tylib::mlog::BinSite _mlog_bin = {fmt, __FILE__, __LINE__,       \
+                                             __FUNCTION__, 0};              \
+    logger->LogBin(level, &_mlog_bin, ##y);                                 \
+  } while (0)
+
+// Structured line, e.g. MLOG_KV(logger, level, "login", "uid", uid, "req", req)
+// writes msg=login uid=1 req="{a, b}" (MLOG_KV_LOGFMT) or a JSON object
+// (MLOG_KV_JSON). Values follow AnyToString, no temporary string per value.
+#define MLOG_KV(logger, level, msg, y...)             \
+  do {                                                \
+    MLOG_SITE_CHECK(logger, level);                   \
+    logger->LogKV(&_mlog_site, level, msg, ##y);      \
   } while (0)
 
 #define MLOG_ERROR(logger, fmt, y...) \
@@ -420,6 +1393,15 @@ inline int MLOG_INIT(mlog::CMLogger* logger, int level, unsigned format,
 #define MLOG_TRACE(logger, fmt, y...) \
   MLOG(logger, tylib::MLOG_LV_TRACE, fmt, ##y)
 
+#define MLOG_BIN_ERROR(logger, fmt, y...) \
+  MLOG_BIN(logger, tylib::MLOG_LV_ERROR, fmt, ##y)
+#define MLOG_BIN_NORMAL(logger, fmt, y...) \
+  MLOG_BIN(logger, tylib::MLOG_LV_NORMAL, fmt, ##y)
+#define MLOG_BIN_DEBUG(logger, fmt, y...) \
+  MLOG_BIN(logger, tylib::MLOG_LV_DEBUG, fmt, ##y)
+#define MLOG_BIN_TRACE(logger, fmt, y...) \
+  MLOG_BIN(logger, tylib::MLOG_LV_TRACE, fmt, ##y)
+
 inline mlog::CMLogger* mlog_default_logger() {
   static mlog::CMLogger inst;
   return &inst;
@@ -0,0 +1,296 @@
+// Throughput and per-call latency of CMLogger.
+//
+// usage: log_bench [-m sync,async,mmap,binary,uring,shard] [-p 1,4] [-t 1,8]
+//                  [-f none,all] [-s 64,512] [-r 0,65536] [-n lines]
+//                  [-d dir]
+//
+// Every combination of the lists is run. -p forks writer processes sharing
+// the same .mlog.<prefix> header, -t is threads per process, -f is MLOG_FMT
+// (none, time, all or a number), -s message bytes, -r rotation size (0 is
+// the 1GB default, a small one makes a rotation storm), -n lines per thread.
+
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tylib/log/log.h"
+#include "tylib/string/string_split.h"
+
+namespace {
+
+// log-linear latency histogram, 16 sub buckets per power of 2
+struct Histogram {
+  static const int kSub = 4;
+  static const int kBuckets = 64 << kSub;
+
+  uint64_t count[kBuckets];
+  uint64_t total;
+  uint64_t max;
+
+  static int Index(uint64_t ns) {
+    if (ns < (1U << kSub)) return ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (msb - kSub)) & ((1 << kSub) - 1);
+    return ((msb - kSub + 1) << kSub) | sub;
+  }
+
+  // upper bound of a bucket
+  static uint64_t Value(int index) {
+    if (index < (1 << kSub)) return index;
+    int msb = (index >> kSub) + kSub - 1;
+    uint64_t sub = index & ((1 << kSub) - 1);
+    return ((sub | (1U << kSub)) + 1) << (msb - kSub);
+  }
+
+  void Add(uint64_t ns) {
+    ++count[Index(ns)];
+    ++total;
+    if (ns > max) max = ns;
+  }
+
+  void Merge(const Histogram& o) {
+    for (int i = 0; i < kBuckets; ++i) count[i] += o.count[i];
+    total += o.total;
+    if (o.max > max) max = o.max;
+  }
+
+  uint64_t Percentile(double p) const {
+    uint64_t want = total * p;
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += count[i];
+      if (seen > want) return Value(i);
+    }
+    return max;
+  }
+};
+
+// one per writer thread, in memory shared with forked processes
+struct Result {
+  Histogram hist;
+  uint64_t lines;
+  uint64_t ns;
+};
+
+struct Config {
+  std::string mode;
+  int procs;
+  int threads;
+  unsigned format;
+  int msgSize;
+  unsigned long rotate;
+};
+
+uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+unsigned ModeOf(const std::string& mode) {
+  if (mode == "async") return tylib::MLOG_M_ASYNC;
+  if (mode == "mmap") return tylib::MLOG_M_MMAP;
+  if (mode == "binary") return tylib::MLOG_M_BINARY;
+  if (mode == "uring") return tylib::MLOG_M_ASYNC | tylib::MLOG_M_URING;
+  if (mode == "shard") return tylib::MLOG_M_SHARD;
+  return tylib::MLOG_M_SYNC;
+}
+
+unsigned FormatOf(const std::string& f) {
+  if (f == "none") return tylib::MLOG_F_NONE;
+  if (f == "time") return tylib::MLOG_F_TIME;
+  if (f == "all") return tylib::MLOG_F_ALL;
+  return strtoul(f.c_str(), nullptr, 0);
+}
+
+void Writer(tylib::mlog::CMLogger* logger, const Config& c, int lines,
+            Result* r) {
+  std::string msg(c.msgSize, 'x');
+  const char* s = msg.c_str();
+  const bool binary = c.mode == "binary";
+
+  uint64_t begin = NowNs();
+  uint64_t last = begin;
+  for (int i = 0; i < lines; ++i) {
+    if (binary) {
+      MLOG_BIN_NORMAL(logger, "bench %d %s", i, s);
+    } else {
+      MLOG_NORMAL(logger, "bench %d %s", i, s);
+    }
+    uint64_t now = NowNs();
+    r->hist.Add(now - last);
+    last = now;
+  }
+  r->lines = lines;
+  r->ns = last - begin;
+}
+
+void RemoveLogs(const std::string& dir) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) return;
+  while (dirent* e = readdir(d)) {
+    if (strncmp(e->d_name, "bench", 5) == 0 ||
+        strncmp(e->d_name, ".mlog.bench", 11) == 0) {
+      unlink((dir + "/" + e->d_name).c_str());
+    }
+  }
+  closedir(d);
+}
+
+void Run(const Config& c, int lines, const std::string& dir) {
+  RemoveLogs(dir);
+
+  size_t bytes = sizeof(Result) * c.procs * c.threads;
+  void* p = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                 -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  Result* results = static_cast<Result*>(p);
+
+  uint64_t begin = NowNs();
+  std::vector<pid_t> children;
+  for (int i = 0; i < c.procs; ++i) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(1);
+    }
+    if (pid > 0) {
+      children.push_back(pid);
+      continue;
+    }
+
+    {
+      tylib::mlog::CMLogger logger;
+      tylib::MLogAsyncConf conf;
+      conf.policy = tylib::MLOG_FULL_BLOCK;
+      logger.SetAsyncConf(conf);
+      if (tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL, c.format,
+                           dir.c_str(), "bench", c.rotate, ModeOf(c.mode))) {
+        _exit(1);
+      }
+
+      std::vector<std::thread> threads;
+      for (int t = 0; t < c.threads; ++t) {
+        threads.emplace_back(Writer, &logger, c, lines,
+                             results + i * c.threads + t);
+      }
+      for (auto& t : threads) t.join();
+    }  // async lines are flushed here, counted in lines/s
+    _exit(0);
+  }
+  for (pid_t pid : children) waitpid(pid, nullptr, 0);
+  uint64_t wall = NowNs() - begin;
+
+  Histogram* all = new Histogram();
+  uint64_t total = 0;
+  for (int i = 0; i < c.procs * c.threads; ++i) {
+    all->Merge(results[i].hist);
+    total += results[i].lines;
+  }
+
+  char fmt[16];
+  snprintf(fmt, sizeof(fmt), "0x%x", c.format);
+  printf("%-7s %5d %7d %10s %5d %10lu %12.0f %8llu %8llu %8llu %10llu\n",
+         c.mode.c_str(), c.procs, c.threads, fmt, c.msgSize, c.rotate,
+         total * 1e9 / wall,
+         static_cast<unsigned long long>(all->Percentile(0.5)),
+         static_cast<unsigned long long>(all->Percentile(0.99)),
+         static_cast<unsigned long long>(all->Percentile(0.999)),
+         static_cast<unsigned long long>(all->max));
+  fflush(stdout);
+
+  delete all;
+  munmap(p, bytes);
+}
+
+std::vector<std::string> List(const char* arg) {
+  return tylib::StringSplit(arg, ",");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::vector<std::string> modes = {"sync", "async", "mmap", "binary"};
+  std::vector<std::string> procs = {"1", "4"};
+  std::vector<std::string> threads = {"1", "8"};
+  std::vector<std::string> formats = {"none", "all"};
+  std::vector<std::string> sizes = {"64", "512"};
+  std::vector<std::string> rotates = {"0", "65536"};
+  int lines = 100000;
+  std::string dir = "/tmp/mlog_bench";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:p:t:f:s:r:n:d:h")) != -1) {
+    switch (opt) {
+      case 'm':
+        modes = List(optarg);
+        break;
+      case 'p':
+        procs = List(optarg);
+        break;
+      case 't':
+        threads = List(optarg);
+        break;
+      case 'f':
+        formats = List(optarg);
+        break;
+      case 's':
+        sizes = List(optarg);
+        break;
+      case 'r':
+        rotates = List(optarg);
+        break;
+      case 'n':
+        lines = atoi(optarg);
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-m modes] [-p procs] [-t threads] [-f formats] "
+                "[-s msg sizes] [-r rotate sizes] [-n lines] [-d dir]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  mkdir(dir.c_str(), 0755);
+  printf("%-7s %5s %7s %10s %5s %10s %12s %8s %8s %8s %10s\n", "mode", "procs",
+         "threads", "format", "msg", "rotate", "lines/s", "p50(ns)",
+         "p99(ns)", "p999(ns)", "max(ns)");
+
+  for (const auto& m : modes)
+    for (const auto& p : procs)
+      for (const auto& t : threads)
+        for (const auto& f : formats)
+          for (const auto& s : sizes)
+            for (const auto& r : rotates) {
+              Config c;
+              c.mode = m;
+              c.procs = atoi(p.c_str());
+              c.threads = atoi(t.c_str());
+              c.format = FormatOf(f);
+              c.msgSize = atoi(s.c_str());
+              c.rotate = strtoul(r.c_str(), nullptr, 0);
+              Run(c, lines, dir);
+            }
+
+  RemoveLogs(dir);
+  return 0;
+}
@@ -0,0 +1,112 @@
+// Sidecar index of a log segment, written by CMLogger in MLOG_M_INDEX mode
+// to <segment>.idx and read by mlog_query.
+//
+// Each process appends an entry on its first write in every second and at
+// least every MLogIndexConf.step bytes. The offset is never past the line it
+// stands for, so reading from the smallest offset of the entries at or after
+// a second finds every line of that second. Entries of different processes
+// may be a little out of order, kIndexSkew seconds are allowed for it.
+
+#ifndef TYLIB_LOG_LOG_INDEX_H_
+#define TYLIB_LOG_LOG_INDEX_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace tylib {
+
+struct MLogIndexConf {
+  unsigned long step = 1024 * 1024;  // bytes between entries, at most
+};
+
+namespace mlog {
+
+struct MLogIndexEntry {
+  int64_t sec;  // time(2) of the write
+  uint64_t offset;
+};
+
+static const int64_t kIndexSkew = 2;
+
+// Bytes [*begin, *end) of a segment of size bytes hold every line of
+// seconds [from, to]. entries in file order.
+inline void IndexRange(const MLogIndexEntry* e, size_t n, int64_t from,
+                       int64_t to, uint64_t size, uint64_t* begin,
+                       uint64_t* end) {
+  *begin = 0;
+  *end = size;
+  if (n == 0) return;
+
+  auto lowerBound = [&](int64_t sec) {
+    return std::lower_bound(e, e + n, sec,
+                            [](const MLogIndexEntry& a, int64_t s) {
+                              return a.sec < s;
+                            }) -
+           e;
+  };
+
+  size_t i = lowerBound(from - kIndexSkew);
+  *begin = size;
+  bool found = false;
+  for (; i < n && e[i].sec <= from + kIndexSkew; ++i) {
+    if (e[i].sec >= from) {
+      *begin = std::min<uint64_t>(*begin, e[i].offset);
+      found = true;
+    }
+  }
+  if (!found && i < n) *begin = e[i].offset;
+
+  size_t j = lowerBound(to + kIndexSkew + 1);
+  if (j < n) *end = e[j].offset;
+  if (*end > size) *end = size;
+  if (*begin > *end) *begin = *end;
+}
+
+// "YYYY-MM-DD HH:MM:SS" at s, as MLOG_F_TIME writes it in local time
+inline bool ParseTime(const char* s, size_t len, int64_t* sec) {
+  static const char kShape[] = "dddd-dd-dd dd:dd:dd";
+  const size_t n = sizeof(kShape) - 1;
+  if (len < n) return false;
+  for (size_t i = 0; i < n; ++i) {
+    if (kShape[i] == 'd' ? !isdigit(static_cast<unsigned char>(s[i]))
+                         : s[i] != kShape[i]) {
+      return false;
+    }
+  }
+
+  struct tm t;
+  memset(&t, 0, sizeof(t));
+  t.tm_year = atoi(s) - 1900;
+  t.tm_mon = atoi(s + 5) - 1;
+  t.tm_mday = atoi(s + 8);
+  t.tm_hour = atoi(s + 11);
+  t.tm_min = atoi(s + 14);
+  t.tm_sec = atoi(s + 17);
+  t.tm_isdst = -1;
+  *sec = mktime(&t);
+  return true;
+}
+
+// time of a text line, searched in its prefix
+inline bool LineTime(const char* line, size_t len, int64_t* sec) {
+  size_t limit = std::min<size_t>(len, 1100);  // pname is up to 1KB
+  for (size_t i = 0; i + 19 <= limit; ++i) {
+    if (line[i] == '\n') break;
+    if (isdigit(static_cast<unsigned char>(line[i])) &&
+        ParseTime(line + i, limit - i, sec)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace mlog
+
+}  // namespace tylib
+
+#endif  // TYLIB_LOG_LOG_INDEX_H_
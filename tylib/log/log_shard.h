@@ -0,0 +1,139 @@
+// Shards of MLOG_M_SHARD, see log.h. Each thread writes its own file of
+// the segment, <prefix>_<YYYYMMDD_HHMMSS>.<tid>.log, and each text line
+// starts with a tag "<ns> <seq> ": CLOCK_REALTIME in ns and a sequence of
+// the logger. ShardMerger streams the shards back as one stream ordered by
+// tag, see mlog_merge. It relies on each shard being in tag order, so lines
+// are written on the thread that tags them, never by the ASYNC flusher.
+
+#ifndef TYLIB_LOG_LOG_SHARD_H_
+#define TYLIB_LOG_LOG_SHARD_H_
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "tylib/time/clock.h"
+
+namespace tylib {
+
+namespace mlog {
+
+// fd of a thread's shard, closed by whichever of thread or logger ends first
+struct Shard {
+  std::atomic<int> fd{-1};
+  unsigned long gen = 0;  // mm->gen of the file fd is open on
+  pid_t tid = 0;          // a forked child opens its own
+
+  void Close() {
+    int f = fd.exchange(-1);
+    if (f >= 0) close(f);
+  }
+
+  ~Shard() { Close(); }
+};
+
+// "<ns> <seq> " at buf, returns its length
+inline int ShardTag(char* buf, int len, unsigned long long seq,
+                    Clock::Tier tier = Clock::TIER_PRECISE) {
+  unsigned long long ns = Clock::RealtimeNs(tier);
+  int n = snprintf(buf, len, "%llu %llu ", ns, seq);
+  return n < len ? n : len - 1;
+}
+
+// length of the tag of a line, 0 if it has none
+inline size_t ParseShardTag(const char* line, size_t len, uint64_t* ns,
+                            uint64_t* seq) {
+  uint64_t v[2];
+  size_t i = 0;
+  for (int k = 0; k < 2; ++k) {
+    size_t start = i;
+    v[k] = 0;
+    for (; i < len && line[i] >= '0' && line[i] <= '9'; ++i) {
+      v[k] = v[k] * 10 + (line[i] - '0');
+    }
+    if (i == start || i == len || line[i] != ' ') return 0;
+    ++i;
+  }
+  *ns = v[0];
+  *seq = v[1];
+  return i;
+}
+
+// k-way merge of shard files by (ns, seq), one line of each file in memory.
+// A line without a tag keeps the key of the line before it in its file.
+class ShardMerger {
+ public:
+  explicit ShardMerger(const std::vector<std::string>& paths) {
+    for (const std::string& p : paths) {
+      std::unique_ptr<Reader> r(new Reader);
+      r->in = fopen(p.c_str(), "r");
+      if (!r->in) continue;
+      readers.push_back(std::move(r));
+      if (readers.back()->Next()) heap.push(readers.back().get());
+    }
+  }
+
+  ~ShardMerger() {
+    for (auto& r : readers) {
+      free(r->line);
+      fclose(r->in);
+    }
+  }
+
+  ShardMerger(const ShardMerger&) = delete;
+  ShardMerger& operator=(const ShardMerger&) = delete;
+
+  // next line in order with its '\n', tag cut unless keepTag
+  bool Next(std::string* line, bool keepTag = false) {
+    if (heap.empty()) return false;
+    Reader* r = heap.top();
+    heap.pop();
+    size_t skip = keepTag ? 0 : r->tagLen;
+    line->assign(r->line + skip, r->len - skip);
+    if (r->Next()) heap.push(r);
+    return true;
+  }
+
+ private:
+  struct Reader {
+    FILE* in = nullptr;
+    char* line = nullptr;
+    size_t cap = 0;
+    size_t len = 0;
+    size_t tagLen = 0;
+    uint64_t ns = 0;
+    uint64_t seq = 0;
+
+    bool Next() {
+      ssize_t n = getline(&line, &cap, in);
+      if (n <= 0) return false;
+      len = n;
+      tagLen = ParseShardTag(line, len, &ns, &seq);
+      return true;
+    }
+  };
+
+  struct Later {
+    bool operator()(const Reader* a, const Reader* b) const {
+      return a->ns != b->ns ? a->ns > b->ns : a->seq > b->seq;
+    }
+  };
+
+  std::vector<std::unique_ptr<Reader>> readers;
+  std::priority_queue<Reader*, std::vector<Reader*>, Later> heap;
+};
+
+}  // namespace mlog
+
+}  // namespace tylib
+
+#endif  // TYLIB_LOG_LOG_SHARD_H_
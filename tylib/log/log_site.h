@@ -0,0 +1,202 @@
+// Call sites of MLOG macros. Each expansion has a constant initialized
+// LogSite, linked into the site list on its first pass. Rules of a control
+// file switch single sites at runtime, see mlog_ctl.
+
+#ifndef TYLIB_LOG_LOG_SITE_H_
+#define TYLIB_LOG_LOG_SITE_H_
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+namespace tylib {
+
+namespace mlog {
+
+// basename at compile time
+constexpr const char* BaseName(const char* path) {
+  const char* base = path;
+  for (const char* p = path; *p; ++p) {
+    if (*p == '/') base = p + 1;
+  }
+  return base;
+}
+
+static const unsigned char kSiteUnseen = 0xFF;
+static const signed char kNoRule = -1;
+
+struct LogSite {
+  const char* file;  // basename
+  const char* func;
+  int line;
+  int level;  // as written at the site, 0 if not a constant
+
+  // highest level that may pass the site, checked first by the macros.
+  // kSiteUnseen lets the first line through to register the site.
+  unsigned char on;
+
+  // level set by a control rule, kNoRule to follow the logger level
+  signed char rule;
+
+  LogSite* next;
+};
+
+// One rule: pattern is a file basename, "file:line", a function name or "*".
+// level 0 turns the matched sites off.
+struct MLogRule {
+  char pattern[120];
+  int level;
+  int unused;
+};
+
+static const int kMaxRules = 64;
+
+// .mlog.<prefix>.ctl, mapped by every process of the prefix. mlog_ctl edits
+// the rules under flock and bumps gen, loggers see it on their next line.
+struct MLogCtl {
+  unsigned long gen;
+  unsigned count;
+  unsigned unused;
+  MLogRule rules[kMaxRules];
+};
+
+inline bool RuleMatch(const MLogRule& r, const LogSite& s) {
+  const char* colon = strrchr(r.pattern, ':');
+  if (colon) {
+    return static_cast<size_t>(colon - r.pattern) == strlen(s.file) &&
+           strncmp(r.pattern, s.file, colon - r.pattern) == 0 &&
+           atoi(colon + 1) == s.line;
+  }
+  return strcmp(r.pattern, "*") == 0 || strcmp(r.pattern, s.file) == 0 ||
+         strcmp(r.pattern, s.func) == 0;
+}
+
+// process wide, guarded by lock
+struct SiteRegistry {
+  std::mutex lock;
+  LogSite* head = nullptr;
+  int maxLevel = 0;  // highest level of any logger, sites above it are off
+  unsigned count = 0;
+  MLogRule rules[kMaxRules];
+
+  static SiteRegistry& Get() {
+    static SiteRegistry inst;
+    return inst;
+  }
+
+  // with lock held
+  void Resolve(LogSite* s) {
+    signed char rule = kNoRule;
+    for (unsigned i = 0; i < count; ++i) {
+      if (RuleMatch(rules[i], *s)) rule = rules[i].level;  // last one wins
+    }
+    __atomic_store_n(&s->rule, rule, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->on, rule == kNoRule ? maxLevel : rule,
+                     __ATOMIC_RELAXED);
+  }
+};
+
+inline void RegisterSite(LogSite* site) {
+  SiteRegistry& r = SiteRegistry::Get();
+  std::lock_guard<std::mutex> guard(r.lock);
+  if (__atomic_load_n(&site->on, __ATOMIC_RELAXED) != kSiteUnseen) return;
+  site->next = r.head;
+  r.head = site;
+  r.Resolve(site);
+}
+
+// level of a line that got past on
+inline bool SitePass(LogSite* site, int level, int loggerLevel) {
+  if (__builtin_expect(
+          __atomic_load_n(&site->on, __ATOMIC_RELAXED) == kSiteUnseen, 0)) {
+    RegisterSite(site);
+  }
+  signed char rule = __atomic_load_n(&site->rule, __ATOMIC_RELAXED);
+  return level <= (rule == kNoRule ? loggerLevel : rule);
+}
+
+// replace the rules, every seen site is resolved again
+inline void ApplyRules(const MLogRule* rules, unsigned count) {
+  SiteRegistry& r = SiteRegistry::Get();
+  std::lock_guard<std::mutex> guard(r.lock);
+  r.count = count < kMaxRules ? count : kMaxRules;
+  memcpy(r.rules, rules, r.count * sizeof(MLogRule));
+  for (unsigned i = 0; i < r.count; ++i) {
+    r.rules[i].pattern[sizeof(r.rules[i].pattern) - 1] = 0;
+  }
+  for (LogSite* s = r.head; s; s = s->next) r.Resolve(s);
+}
+
+// sites follow a logger with a higher level
+inline void RaiseMaxLevel(int level) {
+  SiteRegistry& r = SiteRegistry::Get();
+  std::lock_guard<std::mutex> guard(r.lock);
+  if (level <= r.maxLevel) return;
+  r.maxLevel = level;
+  for (LogSite* s = r.head; s; s = s->next) r.Resolve(s);
+}
+
+// open or create the control file, returns the mapping or null
+inline MLogCtl* MapControl(const char* path) {
+  int fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) return nullptr;
+
+  struct stat sb;
+  void* p = MAP_FAILED;
+  if (fstat(fd, &sb) == 0 &&
+      (sb.st_size == sizeof(MLogCtl) || ftruncate(fd, sizeof(MLogCtl)) == 0)) {
+    p = mmap(0, sizeof(MLogCtl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  return p == MAP_FAILED ? nullptr : static_cast<MLogCtl*>(p);
+}
+
+// apply the rules if gen moved from seen, they are read under flock
+inline void CheckControl(const char* path, const MLogCtl* ctl,
+                         std::atomic<unsigned long>* seen) {
+  unsigned long gen = __atomic_load_n(&ctl->gen, __ATOMIC_ACQUIRE);
+  if (gen == seen->load(std::memory_order_relaxed)) return;
+
+  MLogRule rules[kMaxRules];
+  unsigned count = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return;
+  if (flock(fd, LOCK_SH) == 0) {
+    gen = __atomic_load_n(&ctl->gen, __ATOMIC_ACQUIRE);
+    count = ctl->count < kMaxRules ? ctl->count : kMaxRules;
+    memcpy(rules, ctl->rules, count * sizeof(MLogRule));
+    flock(fd, LOCK_UN);
+  }
+  close(fd);
+
+  ApplyRules(rules, count);
+  seen->store(gen, std::memory_order_relaxed);
+}
+
+}  // namespace mlog
+
+}  // namespace tylib
+
+// Static site of a MLOG expansion, no guard even if level is not a constant.
+// A line of a seen but disabled site costs the load of on and a branch.
+#define MLOG_SITE(name, level)                           \
+  static tylib::mlog::LogSite name = {                   \
+      tylib::mlog::BaseName(__FILE__),                   \
+      __FUNCTION__,                                      \
+      __LINE__,                                          \
+      __builtin_constant_p(level) ? (level) : 0,         \
+      tylib::mlog::kSiteUnseen,                          \
+      tylib::mlog::kNoRule,                              \
+      nullptr}
+
+#define MLOG_SITE_ON(site, level) \
+  (static_cast<int>(level) <= __atomic_load_n(&(site).on, __ATOMIC_RELAXED))
+
+#endif  // TYLIB_LOG_LOG_SITE_H_
@@ -0,0 +1,851 @@
+#include "tylib/log/log.h"
+
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+int RemoveEntry(const char* path, const struct stat*, int, FTW*) {
+  return remove(path);
+}
+
+// dirs made by MakeTempDir are removed when the test ends
+class MLog : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    for (auto& dir : dirs) {
+      nftw(dir.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+  }
+
+  std::string MakeTempDir() {
+    char tmpl[] = "/tmp/mlog_test_XXXXXX";
+    const char* dir = mkdtemp(tmpl);
+    if (!dir) return ".";
+    dirs.push_back(dir);
+    return dir;
+  }
+
+ private:
+  std::vector<std::string> dirs;
+};
+
+// lines of each segment in dir
+std::vector<std::vector<std::string>> ReadSegments(const std::string& dir) {
+  std::vector<std::vector<std::string>> segs;
+  DIR* d = opendir(dir.c_str());
+  if (!d) return segs;
+  while (dirent* e = readdir(d)) {
+    std::string name = e->d_name;
+    if (name.find('_') == std::string::npos ||
+        name.size() < 4 || name.substr(name.size() - 4) != ".log") {
+      continue;
+    }
+    std::ifstream in(dir + "/" + name);
+    std::string line;
+    segs.emplace_back();
+    while (std::getline(in, line)) segs.back().push_back(line);
+  }
+  closedir(d);
+  return segs;
+}
+
+// all lines of every segment in dir
+std::vector<std::string> ReadLines(const std::string& dir) {
+  std::vector<std::string> lines;
+  for (auto& seg : ReadSegments(dir)) {
+    lines.insert(lines.end(), seg.begin(), seg.end());
+  }
+  return lines;
+}
+
+TEST_F(MLog, Sync) {
+  std::string dir = MakeTempDir();
+  tylib::mlog::CMLogger logger;
+  ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                             tylib::MLOG_F_LEVEL, dir.c_str(), "sync", 0),
+            0);
+
+  MLOG_NORMAL((&logger), "hello %d", 1);
+  MLOG_DEBUG((&logger), "filtered %d", 2);
+
+  std::vector<std::string> lines = ReadLines(dir);
+  ASSERT_EQ(lines.size(), 1U);
+  EXPECT_EQ(lines[0], "2 hello 1");
+}
+
+TEST_F(MLog, PrefixFields) {
+  std::string dir = MakeTempDir();
+  tylib::mlog::CMLogger logger;
+  ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                             tylib::MLOG_F_ALL, dir.c_str(), "prefix", 0),
+            0);
+
+  int line = __LINE__ + 1;
+  MLOG_NORMAL((&logger), "hello");
+
+  std::vector<std::string> lines = ReadLines(dir);
+  ASSERT_EQ(lines.size(), 1U);
+  std::string expect = std::string(tylib::mlog::getpname()) +
+                       " 2 [0-9]{4}-[0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:"
+                       "[0-9]{2}\\.[0-9]{6} " +
+                       std::to_string(getpid()) + " " +
+                       std::to_string(tylib::mlog::gettid()) +
+                       " log_test\\.cc:" + std::to_string(line) +
+                       " TestBody hello";
+  EXPECT_TRUE(std::regex_match(lines[0], std::regex(expect))) << lines[0];
+}
+
+TEST_F(MLog, SyncRotateMultiProcess) {
+  std::string dir = MakeTempDir();
+  const int kProcs = 3;
+  const int kLines = 3000;
+
+  std::vector<pid_t> children;
+  for (int p = 0; p < kProcs; ++p) {
+    pid_t pid = fork();
+    if (pid != 0) {
+      children.push_back(pid);
+      continue;
+    }
+    tylib::mlog::CMLogger logger;
+    if (tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL, tylib::MLOG_F_NONE,
+                         dir.c_str(), "rotate", 16 * 1024) != 0) {
+      _exit(1);
+    }
+    for (int i = 0; i < kLines; ++i) MLOG_NORMAL((&logger), "p%d %d", p, i);
+    _exit(0);
+  }
+
+  for (pid_t pid : children) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    EXPECT_EQ(status, 0);
+  }
+  EXPECT_EQ(ReadLines(dir).size(), static_cast<size_t>(kProcs * kLines));
+}
+
+TEST_F(MLog, AsyncFork) {
+  std::string dir = MakeTempDir();
+  const int kProcs = 3;
+  const int kLines = 3000;  // more than a ring holds
+
+  std::unique_ptr<tylib::mlog::CMLogger> logger(new tylib::mlog::CMLogger);
+  tylib::MLogAsyncConf conf;
+  conf.policy = tylib::MLOG_FULL_BLOCK;
+  conf.ring_size = 4096;
+  logger->SetAsyncConf(conf);
+  ASSERT_EQ(tylib::MLOG_INIT(logger.get(), tylib::MLOG_LV_NORMAL,
+                             tylib::MLOG_F_NONE, dir.c_str(), "fork", 0,
+                             tylib::MLOG_M_ASYNC),
+            0);
+  MLOG_NORMAL(logger.get(), "parent before");
+
+  // no flusher in a child: BLOCK would spin, Stop() join a lost thread
+  std::vector<pid_t> children;
+  for (int p = 0; p < kProcs; ++p) {
+    pid_t pid = fork();
+    if (pid != 0) {
+      children.push_back(pid);
+      continue;
+    }
+    alarm(10);
+    for (int i = 0; i < kLines; ++i) {
+      MLOG_NORMAL(logger.get(), "p%d %d", p, i);
+    }
+    logger->Flush();
+    logger.reset();
+    _exit(0);
+  }
+
+  for (pid_t pid : children) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    EXPECT_EQ(status, 0);
+  }
+  MLOG_NORMAL(logger.get(), "parent after");
+  logger.reset();
+
+  // a line in the parent's ring at fork is written once
+  std::vector<std::string> lines = ReadLines(dir);
+  EXPECT_EQ(lines.size(), static_cast<size_t>(kProcs * kLines + 2));
+  EXPECT_EQ(std::count(lines.begin(), lines.end(), "parent before"), 1);
+}
+
+TEST_F(MLog, AsyncRingsOfStoppedWriters) {
+  using tylib::mlog::AsyncWriter;
+  std::thread([] {
+    // a thread logging through a writer after another keeps one ring
+    for (int i = 0; i < 10; ++i) {
+      AsyncWriter writer(tylib::MLogAsyncConf(),
+                         [](const iovec*, int) { return 0; });
+      writer.Push("line\n", 5);
+      EXPECT_EQ(AsyncWriter::LocalRingCount(), 1U);
+    }
+  }).join();
+}
+
+TEST_F(MLog, AsyncFlushOnShutdown) {
+  std::string dir = MakeTempDir();
+  const int kThreads = 4;
+  const int kLines = 10000;
+  {
+    tylib::mlog::CMLogger logger;
+    tylib::MLogAsyncConf conf;
+    conf.policy = tylib::MLOG_FULL_BLOCK;
+    conf.ring_size = 4096;
+    logger.SetAsyncConf(conf);
+    ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                               tylib::MLOG_F_NONE, dir.c_str(), "async", 0,
+                               tylib::MLOG_M_ASYNC),
+              0);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&logger, t] {
+        for (int i = 0; i < kLines; ++i) {
+          MLOG_NORMAL((&logger), "t%d %d", t, i);
+        }
+      });
+    }
+    for (auto& t : threads) t.join();
+    EXPECT_EQ(logger.Dropped(), 0UL);
+  }
+
+  std::vector<std::string> lines = ReadLines(dir);
+  EXPECT_EQ(lines.size(), static_cast<size_t>(kThreads * kLines));
+}
+
+TEST_F(MLog, AsyncFlush) {
+  std::string dir = MakeTempDir();
+  tylib::mlog::CMLogger logger;
+  ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                             tylib::MLOG_F_NONE, dir.c_str(), "flush", 0,
+                             tylib::MLOG_M_ASYNC),
+            0);
+
+  MLOG_NORMAL((&logger), "line %d", 1);
+  logger.Flush();
+  EXPECT_EQ(ReadLines(dir).size(), 1U);
+}
+
+TEST_F(MLog, MmapRotateAndTruncate) {
+  std::string dir = MakeTempDir();
+  const int kThreads = 4;
+  const int kLines = 5000;
+
+  pid_t child = fork();
+  {
+    tylib::mlog::CMLogger logger;
+    ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                               tylib::MLOG_F_NONE, dir.c_str(), "mmap",
+                               64 * 1024, tylib::MLOG_M_MMAP),
+              0);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&logger, t] {
+        for (int i = 0; i < kLines; ++i) {
+          MLOG_NORMAL((&logger), "t%d %d", t, i);
+        }
+      });
+    }
+    for (auto& t : threads) t.join();
+  }
+  if (child == 0) _exit(0);
+  waitpid(child, nullptr, 0);
+
+  std::vector<std::string> lines = ReadLines(dir);
+  EXPECT_EQ(lines.size(), static_cast<size_t>(2 * kThreads * kLines));
+  for (const std::string& line : lines) {
+    ASSERT_EQ(line.find('\0'), std::string::npos);
+    ASSERT_EQ(line[0], 't');
+  }
+}
+
+TEST_F(MLog, RateLimit) {
+  std::string dir = MakeTempDir();
+  tylib::mlog::CMLogger logger;
+  ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                             tylib::MLOG_F_NONE, dir.c_str(), "rate", 0),
+            0);
+
+  for (int i = 0; i < 25; ++i) {
+    MLOG_EVERY_N((&logger), tylib::MLOG_LV_ERROR, 10, "n %d", i);
+  }
+  for (int n = 0; n <= 1; ++n) {
+    for (int i = 0; i < 3; ++i) {
+      MLOG_EVERY_N((&logger), tylib::MLOG_LV_ERROR, n, "n%d %d", n, i);
+    }
+  }
+  for (int i = 0; i < 100; ++i) {
+    MLOG_EVERY_MS((&logger), tylib::MLOG_LV_ERROR, 60000, "ms %d", i);
+  }
+  for (int i = 0; i < 100; ++i) {
+    MLOG_TOKEN_BUCKET((&logger), tylib::MLOG_LV_ERROR, 0.01, 3, "tb %d", i);
+  }
+
+  std::vector<std::string> lines = ReadLines(dir);
+  std::vector<std::string> expect = {"n 0", "n 10 (suppressed 9 lines)",
+                                     "n 20 (suppressed 9 lines)", "n0 0",
+                                     "n0 1", "n0 2", "n1 0", "n1 1", "n1 2",
+                                     "ms 0", "tb 0", "tb 1", "tb 2"};
+  EXPECT_EQ(lines, expect);
+}
+
+std::string ReadFile(const std::string& path) {
+  std::ifstream in(path);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+TEST_F(MLog, BinaryDecode) {
+  std::string dir = MakeTempDir();
+  int binLine = 0;
+  int textLine = 0;
+  {
+    tylib::mlog::CMLogger logger;
+    ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                               tylib::MLOG_F_LEVEL | tylib::MLOG_F_FILELINE,
+                               dir.c_str(), "bin", 0, tylib::MLOG_M_BINARY),
+              0);
+
+    const char* name = "tom";
+    for (int i = 0; i < 2; ++i) {
+      binLine = __LINE__ + 1;
+      MLOG_BIN_NORMAL((&logger), "user=%s age=%5d score=%.2f id=%llx %c%%",
+                      name, 18 + i, 9.5, 0xabcULL, 'z');
+    }
+    MLOG_BIN_DEBUG((&logger), "filtered %d", 1);
+    textLine = __LINE__ + 1;
+    MLOG_NORMAL((&logger), "text %d", 3);
+  }
+
+  std::string data = ReadFile(dir + "/bin.log");
+  tylib::mlog::BinDecoder decoder;
+  std::string out;
+  EXPECT_EQ(decoder.Decode(data.data(), data.size(), &out), 3U);
+  std::string bin = "2 log_test.cc:" + std::to_string(binLine);
+  EXPECT_EQ(out, bin + " user=tom age=   18 score=9.50 id=abc z%\n" + bin +
+                     " user=tom age=   19 score=9.50 id=abc z%\n" +
+                     "2 log_test.cc:" + std::to_string(textLine) +
+                     " text 3\n");
+}
+
+void BinFrom(tylib::mlog::CMLogger* logger, const char* who) {
+  MLOG_BIN_NORMAL(logger, "from %s", who);
+}
+
+TEST_F(MLog, BinaryFork) {
+  std::string dir = MakeTempDir();
+  {
+    tylib::mlog::CMLogger logger;
+    ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                               tylib::MLOG_F_PID, dir.c_str(), "binfork", 0,
+                               tylib::MLOG_M_BINARY),
+              0);
+
+    // the site wrote its DEF in the parent before the fork
+    BinFrom(&logger, "parent");
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+      BinFrom(&logger, "child");
+      _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    EXPECT_EQ(status, 0);
+  }
+
+  std::string data = ReadFile(dir + "/binfork.log");
+  tylib::mlog::BinDecoder decoder;
+  std::string out;
+  EXPECT_EQ(decoder.Decode(data.data(), data.size(), &out), 2U);
+  EXPECT_EQ(out.find("<unknown format id>"), std::string::npos) << out;
+  EXPECT_NE(out.find(" from parent\n"), std::string::npos) << out;
+  EXPECT_NE(out.find(" from child\n"), std::string::npos) << out;
+}
+
+TEST_F(MLog, BinaryOneSiteTwoLoggers) {
+  std::string dir = MakeTempDir();
+  {
+    tylib::mlog::CMLogger a;
+    tylib::mlog::CMLogger b;
+    ASSERT_EQ(tylib::MLOG_INIT(&a, tylib::MLOG_LV_NORMAL, tylib::MLOG_F_NONE,
+                               dir.c_str(), "bina", 0, tylib::MLOG_M_BINARY),
+              0);
+    ASSERT_EQ(tylib::MLOG_INIT(&b, tylib::MLOG_LV_NORMAL, tylib::MLOG_F_NONE,
+                               dir.c_str(), "binb", 0, tylib::MLOG_M_BINARY),
+              0);
+    BinFrom(&a, "a");
+    BinFrom(&b, "b");
+    BinFrom(&a, "a");
+  }
+
+  // each file has the DEF of the site
+  for (const char* name : {"bina", "binb"}) {
+    std::string data = ReadFile(dir + "/" + name + ".log");
+    tylib::mlog::BinDecoder decoder;
+    std::string out;
+    decoder.Decode(data.data(), data.size(), &out);
+    EXPECT_EQ(out, name[3] == 'a' ? "from a\nfrom a\n" : "from b\n");
+  }
+}
+
+TEST_F(MLog, BinaryLongPrefix) {
+  using namespace tylib::mlog;
+  // func longer than the prefix buffer, after a pname
+  std::string func(3000, 'f');
+  char def[4096];
+  BinWriter w(def, sizeof(def));
+  BinDef d;
+  memset(&d, 0, sizeof(d));
+  d.h.magic = kBinMagic;
+  d.h.type = BIN_DEF;
+  d.pid = 1;
+  d.id = 1;
+  d.format = tylib::MLOG_F_PNAME | tylib::MLOG_F_FUNC;
+  w.Reserve(sizeof(d));
+  w.PutStr("a.cc");
+  w.PutStr(func.c_str());
+  w.PutStr("x=%d");
+  w.PutStr("pname");
+  ASSERT_TRUE(w.ok());
+  d.h.len = w.Size();
+  memcpy(def, &d, sizeof(d));
+
+  char rec[64];
+  BinWriter l(rec, sizeof(rec));
+  BinLog r;
+  memset(&r, 0, sizeof(r));
+  r.h.magic = kBinMagic;
+  r.h.type = BIN_LOG;
+  r.pid = 1;
+  r.id = 1;
+  l.Reserve(sizeof(r));
+  l.Args(7);
+  r.h.len = l.Size();
+  memcpy(rec, &r, sizeof(r));
+
+  BinDecoder decoder;
+  decoder.AddDef(def, d.h.len);
+  std::string out;
+  ASSERT_TRUE(decoder.Render(rec, r.h.len, &out));
+  EXPECT_EQ(out, "pname " + func.substr(0, 1023 - 6) + "x=7\n");
+}
+
+TEST_F(MLog, KeyValue) {
+  std::string dir = MakeTempDir();
+  tylib::mlog::CMLogger logger;
+  ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                             tylib::MLOG_F_LEVEL, dir.c_str(), "kv", 0),
+            0);
+
+  std::vector<int> req = {1, 2};
+  MLOG_KV((&logger), tylib::MLOG_LV_NORMAL, "login", "uid", 42, "req", req,
+          "name", std::string("a \"b\""));
+  logger.SetKvFormat(tylib::MLOG_KV_JSON);
+  MLOG_KV((&logger), tylib::MLOG_LV_NORMAL, "login ok", "uid", 42, "req", req,
+          "ratio", 0.5, "nan", std::nan(""));
+  MLOG_KV((&logger), tylib::MLOG_LV_DEBUG, "filtered");
+
+  std::vector<std::string> lines = ReadLines(dir);
+  ASSERT_EQ(lines.size(), 2U);
+  EXPECT_EQ(lines[0], "2 msg=login uid=42 req=\"[1, 2]\" name=\"a \\\"b\\\"\"");
+  EXPECT_EQ(lines[1],
+            "{\"level\":2,\"msg\":\"login ok\",\"uid\":42,\"req\":\"[1, 2]\","
+            "\"ratio\":0.5,\"nan\":\"nan\"}");
+}
+
+void Verbose(tylib::mlog::CMLogger* logger, int i) {
+  MLOG_TRACE(logger, "verbose %d", i);
+}
+
+TEST_F(MLog, SiteControl) {
+  std::string dir = MakeTempDir();
+  tylib::mlog::CMLogger logger;
+  ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                             tylib::MLOG_F_NONE, dir.c_str(), "site", 0),
+            0);
+  constexpr const char* base = tylib::mlog::BaseName("a/b/c.cc");
+  EXPECT_STREQ(base, "c.cc");
+
+  Verbose(&logger, 1);
+  int level = tylib::MLOG_LV_NORMAL;
+  MLOG((&logger), level, "runtime level %d", 1);
+
+  // as mlog_ctl does
+  tylib::mlog::MLogCtl* ctl =
+      tylib::mlog::MapControl((dir + "/.mlog.site.ctl").c_str());
+  ASSERT_TRUE(ctl != nullptr);
+  strcpy(ctl->rules[0].pattern, "Verbose");
+  ctl->rules[0].level = tylib::MLOG_LV_TRACE;
+  std::string off = "log_test.cc:" + std::to_string(__LINE__ + 7);
+  strcpy(ctl->rules[1].pattern, off.c_str());
+  ctl->rules[1].level = 0;
+  ctl->count = 2;
+  __atomic_add_fetch(&ctl->gen, 1, __ATOMIC_RELEASE);
+
+  MLOG_NORMAL((&logger), "rules seen %d", 1);
+  MLOG_NORMAL((&logger), "off %d", 1);
+  Verbose(&logger, 2);
+
+  ctl->count = 0;
+  __atomic_add_fetch(&ctl->gen, 1, __ATOMIC_RELEASE);
+  MLOG_NORMAL((&logger), "rules gone %d", 1);
+  Verbose(&logger, 3);
+  munmap(ctl, sizeof(*ctl));
+
+  std::vector<std::string> lines = ReadLines(dir);
+  std::vector<std::string> want = {"runtime level 1", "rules seen 1",
+                                   "verbose 2", "rules gone 1"};
+  EXPECT_EQ(lines, want);
+}
+
+TEST_F(MLog, FlightRecorder) {
+  std::string dir = MakeTempDir();
+  tylib::mlog::CMLogger logger;
+  tylib::MLogFlightConf conf;
+  conf.dump_lines = 3;
+  conf.on_signal = false;
+  logger.SetFlightConf(conf);
+  ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_TRACE,
+                             tylib::MLOG_F_NONE, dir.c_str(), "flight", 0,
+                             tylib::MLOG_M_FLIGHT),
+            0);
+
+  for (int i = 0; i < 5; ++i) MLOG_TRACE((&logger), "t %d", i);
+  MLOG_NORMAL((&logger), "n %d", 1);
+  MLOG_ERROR((&logger), "e %d", 1);
+  logger.DumpFlight();  // nothing new
+
+  std::thread([&logger]() { MLOG_DEBUG((&logger), "d %d", 1); }).join();
+  logger.DumpFlight(true);
+
+  std::vector<std::string> lines = ReadLines(dir);
+  ASSERT_EQ(lines.size(), 10U);
+  EXPECT_EQ(lines[0], "n 1");
+  EXPECT_EQ(lines[1].find("---- flight recorder, tid "), 0U);
+  EXPECT_EQ(lines[2], "t 2");
+  EXPECT_EQ(lines[3], "t 3");
+  EXPECT_EQ(lines[4], "t 4");
+  EXPECT_EQ(lines[5], "---- flight recorder end");
+  EXPECT_EQ(lines[6], "e 1");
+  EXPECT_NE(lines[7], lines[1]);
+  EXPECT_EQ(lines[8], "d 1");
+  EXPECT_EQ(lines[9], "---- flight recorder end");
+}
+
+TEST_F(MLog, FlightRecorderSignal) {
+  std::string dir = MakeTempDir();
+  pid_t pid = fork();
+  if (pid == 0) {
+    tylib::mlog::CMLogger logger;
+    if (tylib::MLOG_INIT(&logger, tylib::MLOG_LV_TRACE, tylib::MLOG_F_NONE,
+                         dir.c_str(), "crash", 0, tylib::MLOG_M_FLIGHT)) {
+      _exit(1);
+    }
+    MLOG_NORMAL((&logger), "n %d", 1);
+    MLOG_TRACE((&logger), "before crash %d", 1);
+    abort();
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  EXPECT_TRUE(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  std::vector<std::string> lines = ReadLines(dir);
+  ASSERT_EQ(lines.size(), 4U);
+  EXPECT_EQ(lines[2], "before crash 1");
+}
+
+int Recurse(int n) {
+  volatile char pad[1024];
+  pad[0] = n;
+  return n > 0 ? Recurse(n + 1) + pad[0] : 0;
+}
+
+TEST_F(MLog, FlightRecorderStackOverflow) {
+  std::string dir = MakeTempDir();
+  pid_t pid = fork();
+  if (pid == 0) {
+    tylib::mlog::CMLogger logger;
+    if (tylib::MLOG_INIT(&logger, tylib::MLOG_LV_TRACE, tylib::MLOG_F_NONE,
+                         dir.c_str(), "overflow", 0, tylib::MLOG_M_FLIGHT)) {
+      _exit(1);
+    }
+    MLOG_TRACE((&logger), "before overflow %d", 1);
+    _exit(Recurse(1));
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  EXPECT_TRUE(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  std::vector<std::string> lines = ReadLines(dir);
+  ASSERT_EQ(lines.size(), 3U);
+  EXPECT_EQ(lines[1], "before overflow 1");
+}
+
+TEST_F(MLog, FlightRecorderCrashingThreads) {
+  const int kThreads = 4;
+  std::string dir = MakeTempDir();
+  pid_t pid = fork();
+  if (pid == 0) {
+    tylib::mlog::CMLogger logger;
+    if (tylib::MLOG_INIT(&logger, tylib::MLOG_LV_TRACE, tylib::MLOG_F_NONE,
+                         dir.c_str(), "crashes", 0, tylib::MLOG_M_FLIGHT)) {
+      _exit(1);
+    }
+    // all crash at once, the first re-raise must wait for the whole dump
+    std::atomic<int> ready{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&logger, &ready, t] {
+        for (int i = 0; i < 200; ++i) MLOG_TRACE((&logger), "t%d %d", t, i);
+        ++ready;
+        while (ready < kThreads) {
+        }
+        raise(SIGSEGV);
+      });
+    }
+    for (auto& t : threads) t.join();
+    _exit(0);
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  EXPECT_TRUE(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  std::vector<std::string> lines = ReadLines(dir);
+  EXPECT_EQ(lines.size(), static_cast<size_t>(kThreads * (200 + 2)));
+  EXPECT_EQ(std::count(lines.begin(), lines.end(), "---- flight recorder end"),
+            kThreads);
+}
+
+TEST_F(MLog, IndexRange) {
+  const tylib::mlog::MLogIndexEntry e[] = {
+      {100, 0}, {101, 50}, {103, 40}, {102, 80}, {104, 120}, {110, 200}};
+  uint64_t begin;
+  uint64_t end;
+  // 103 of a slower process is before the line of 102
+  tylib::mlog::IndexRange(e, 6, 102, 103, 300, &begin, &end);
+  EXPECT_EQ(begin, 40U);
+  EXPECT_EQ(end, 200U);
+  tylib::mlog::IndexRange(e, 6, 111, 120, 300, &begin, &end);
+  EXPECT_EQ(begin, 300U);
+  EXPECT_EQ(end, 300U);
+  tylib::mlog::IndexRange(e, 0, 1, 2, 300, &begin, &end);
+  EXPECT_EQ(begin, 0U);
+  EXPECT_EQ(end, 300U);
+
+  int64_t sec = 0;
+  const char line[] = "app 2 2024-01-02 03:04:05.000001 hello\n";
+  ASSERT_TRUE(tylib::mlog::LineTime(line, sizeof(line) - 1, &sec));
+  struct tm t;
+  time_t tt = sec;
+  localtime_r(&tt, &t);
+  EXPECT_EQ(t.tm_hour * 3600 + t.tm_min * 60 + t.tm_sec, 3 * 3600 + 4 * 60 + 5);
+  EXPECT_FALSE(tylib::mlog::LineTime("no time\n", 8, &sec));
+}
+
+TEST_F(MLog, IndexWrite) {
+  for (unsigned mode : {tylib::MLOG_M_SYNC, tylib::MLOG_M_MMAP}) {
+    std::string dir = MakeTempDir();
+    {
+      tylib::mlog::CMLogger logger;
+      tylib::MLogIndexConf conf;
+      conf.step = 100;
+      logger.SetIndexConf(conf);
+      ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                                 tylib::MLOG_F_NONE, dir.c_str(), "idx", 0,
+                                 mode | tylib::MLOG_M_INDEX),
+                0);
+      for (int i = 0; i < 100; ++i) MLOG_NORMAL((&logger), "line %d", i);
+    }
+
+    char seg[1024];
+    ssize_t n = readlink((dir + "/idx.log").c_str(), seg, sizeof(seg) - 1);
+    ASSERT_GT(n, 0);
+    seg[n] = 0;
+    std::string data = ReadFile(dir + "/" + seg);
+    std::string idx = ReadFile(dir + "/" + seg + ".idx");
+    ASSERT_EQ(idx.size() % sizeof(tylib::mlog::MLogIndexEntry), 0U);
+    const tylib::mlog::MLogIndexEntry* e =
+        reinterpret_cast<const tylib::mlog::MLogIndexEntry*>(idx.data());
+    size_t cnt = idx.size() / sizeof(*e);
+    // ~800 bytes, an entry per 100
+    EXPECT_GE(cnt, 7U);
+    EXPECT_EQ(e[0].offset, 0U);
+    for (size_t i = 0; i < cnt; ++i) {
+      ASSERT_LT(e[i].offset, data.size());
+      EXPECT_TRUE(e[i].offset == 0 || data[e[i].offset - 1] == '\n');
+      EXPECT_LE(std::abs(e[i].sec - time(nullptr)), 5);
+    }
+  }
+}
+
+TEST_F(MLog, Uring) {
+  const int kThreads = 4;
+  const int kLines = 5000;
+  for (unsigned mode : {tylib::MLOG_M_SYNC, tylib::MLOG_M_ASYNC}) {
+    std::string dir = MakeTempDir();
+    {
+      tylib::mlog::CMLogger logger;
+      tylib::MLogAsyncConf conf;
+      conf.policy = tylib::MLOG_FULL_BLOCK;
+      logger.SetAsyncConf(conf);
+      // rotates every few batches, writes in flight across each dup2
+      ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_NORMAL,
+                                 tylib::MLOG_F_NONE, dir.c_str(), "uring",
+                                 64 * 1024, mode | tylib::MLOG_M_URING),
+                0);
+
+      std::vector<std::thread> threads;
+      for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&logger, t] {
+          for (int i = 0; i < kLines; ++i) {
+            MLOG_NORMAL((&logger), "t%d %d", t, i);
+          }
+        });
+      }
+      for (auto& t : threads) t.join();
+
+      MLOG_NORMAL((&logger), "last");
+      logger.Flush();
+      std::vector<std::string> lines = ReadLines(dir);
+      ASSERT_FALSE(lines.empty());
+      EXPECT_EQ(std::count(lines.begin(), lines.end(), "last"), 1);
+    }
+
+    // complete, and each thread's lines in order within a segment
+    size_t total = 0;
+    for (auto& seg : ReadSegments(dir)) {
+      std::vector<int> last(kThreads, -1);
+      for (auto& line : seg) {
+        int t = 0;
+        int i = 0;
+        if (sscanf(line.c_str(), "t%d %d", &t, &i) != 2) continue;
+        ASSERT_TRUE(t >= 0 && t < kThreads) << line;
+        EXPECT_GT(i, last[t]) << line;
+        last[t] = i;
+        ++total;
+      }
+    }
+    EXPECT_EQ(total, static_cast<size_t>(kThreads * kLines));
+  }
+}
+
+TEST_F(MLog, UringWriteError) {
+  auto uring = std::make_shared<tylib::mlog::UringWriter>();
+  if (!uring->Init()) GTEST_SKIP() << "no io_uring";
+
+  // the kernel and write(2) both fail on a read only fd
+  std::string dir = MakeTempDir();
+  std::string path = dir + "/ro.log";
+  close(open(path.c_str(), O_CREAT | O_WRONLY, 0666));
+  int fd = open(path.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+
+  char line[] = "a line\n";
+  iovec iov;
+  iov.iov_base = line;
+  iov.iov_len = sizeof(line) - 1;
+  ASSERT_EQ(uring->Write(fd, 1, &iov, 1), 1);
+  uring->Drain();
+
+  int err = 0;
+  EXPECT_EQ(uring->TakeLost(&err), sizeof(line) - 1);
+  EXPECT_EQ(err, EBADF);
+  EXPECT_EQ(uring->TakeLost(&err), 0UL);
+  EXPECT_EQ(uring->Lost(), sizeof(line) - 1);
+  close(fd);
+}
+
+TEST_F(MLog, Shard) {
+  const int kThreads = 4;
+  const int kLines = 2000;
+  // ASYNC would stamp lines on their threads and write them from the
+  // flusher's shard, out of order, BINARY would write untagged records and
+  // a FLIGHT dump older lines; they are ignored
+  const unsigned kModes[] = {tylib::MLOG_M_SYNC, tylib::MLOG_M_ASYNC,
+                             tylib::MLOG_M_BINARY | tylib::MLOG_M_FLIGHT};
+  for (unsigned mode : kModes) {
+    std::string dir = MakeTempDir();
+    {
+      tylib::mlog::CMLogger logger;
+      ASSERT_EQ(tylib::MLOG_INIT(&logger, tylib::MLOG_LV_DEBUG,
+                                 tylib::MLOG_F_NONE, dir.c_str(), "shard",
+                                 64 * 1024, mode | tylib::MLOG_M_SHARD),
+                0);
+      std::vector<std::thread> threads;
+      for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&logger, t] {
+          for (int i = 0; i < kLines; ++i) {
+            MLOG_NORMAL((&logger), "t%d %d", t, i);
+          }
+        });
+      }
+      for (auto& t : threads) t.join();
+      MLOG_DEBUG((&logger), "debug");
+      MLOG_BIN_NORMAL((&logger), "bin %d", 7);
+      MLOG_ERROR((&logger), "error");
+      logger.SetKvFormat(tylib::MLOG_KV_JSON);
+      MLOG_KV((&logger), tylib::MLOG_LV_NORMAL, "last");
+    }
+
+    // a file per thread
+    std::vector<std::string> paths;
+    DIR* d = opendir(dir.c_str());
+    ASSERT_TRUE(d != nullptr);
+    while (dirent* e = readdir(d)) {
+      std::string name = e->d_name;
+      if (name.compare(0, 6, "shard_") == 0) paths.push_back(dir + "/" + name);
+    }
+    closedir(d);
+    EXPECT_GE(paths.size(), static_cast<size_t>(kThreads + 1));
+
+    tylib::mlog::ShardMerger merger(paths);
+    std::string line;
+    uint64_t lastNs = 0;
+    std::vector<int> last(kThreads, -1);
+    size_t total = 0;
+    std::string rest;
+    while (merger.Next(&line, true)) {
+      uint64_t ns = 0;
+      uint64_t seq = 0;
+      size_t tag =
+          tylib::mlog::ParseShardTag(line.data(), line.size(), &ns, &seq);
+      ASSERT_GT(tag, 0U) << line;
+      EXPECT_GE(ns, lastNs);
+      lastNs = ns;
+
+      int t = 0;
+      int i = 0;
+      if (sscanf(line.c_str() + tag, "t%d %d", &t, &i) == 2) {
+        ASSERT_TRUE(t >= 0 && t < kThreads) << line;
+        EXPECT_GT(i, last[t]) << line;
+        last[t] = i;
+        ++total;
+      } else {
+        rest += line.substr(tag);
+      }
+    }
+    EXPECT_EQ(total, static_cast<size_t>(kThreads * kLines));
+    EXPECT_EQ(rest, "debug\nbin 7\nerror\n{\"msg\":\"last\"}\n");
+  }
+}
+
+}  // namespace
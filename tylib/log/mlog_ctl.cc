@@ -0,0 +1,92 @@
+// Switch MLOG call sites of live processes, rules are seen on their next line.
+// usage: mlog_ctl dir/.mlog.<prefix>.ctl                 list rules
+//        mlog_ctl dir/.mlog.<prefix>.ctl set PATTERN LEVEL
+//        mlog_ctl dir/.mlog.<prefix>.ctl del PATTERN
+//        mlog_ctl dir/.mlog.<prefix>.ctl clear
+// PATTERN is a file basename, file:line, a function name or *, the last
+// matching rule wins. LEVEL 1 to 4 lets lines up to it pass, 0 turns off.
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "tylib/log/log_site.h"
+
+namespace {
+
+int Usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s ctlfile [set PATTERN LEVEL | del PATTERN | clear]\n",
+          prog);
+  return 1;
+}
+
+int Find(const tylib::mlog::MLogCtl* ctl, const char* pattern) {
+  for (unsigned i = 0; i < ctl->count; ++i) {
+    if (strcmp(ctl->rules[i].pattern, pattern) == 0) return i;
+  }
+  return -1;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) return Usage(argv[0]);
+  const char* path = argv[1];
+  const char* cmd = argc > 2 ? argv[2] : "list";
+
+  tylib::mlog::MLogCtl* ctl = tylib::mlog::MapControl(path);
+  int fd = open(path, O_RDONLY);
+  if (!ctl || fd < 0 || flock(fd, LOCK_EX) != 0) {
+    perror(path);
+    return 1;
+  }
+  if (ctl->count > tylib::mlog::kMaxRules) ctl->count = 0;
+
+  int ret = 0;
+  if (strcmp(cmd, "list") == 0) {
+    for (unsigned i = 0; i < ctl->count; ++i) {
+      printf("%s %d\n", ctl->rules[i].pattern, ctl->rules[i].level);
+    }
+  } else if (strcmp(cmd, "set") == 0 && argc == 5) {
+    int level = atoi(argv[4]);
+    int i = Find(ctl, argv[3]);
+    if (strlen(argv[3]) >= sizeof(ctl->rules[0].pattern) || level < 0 ||
+        level > 100) {
+      fprintf(stderr, "bad pattern or level\n");
+      ret = 1;
+    } else if (i < 0 && ctl->count == tylib::mlog::kMaxRules) {
+      fprintf(stderr, "too many rules\n");
+      ret = 1;
+    } else {
+      if (i < 0) i = ctl->count++;
+      tylib::mlog::MLogRule& r = ctl->rules[i];
+      memset(&r, 0, sizeof(r));
+      strcpy(r.pattern, argv[3]);
+      r.level = level;
+    }
+  } else if (strcmp(cmd, "del") == 0 && argc == 4) {
+    int i = Find(ctl, argv[3]);
+    if (i >= 0) {
+      memmove(ctl->rules + i, ctl->rules + i + 1,
+              (ctl->count - i - 1) * sizeof(ctl->rules[0]));
+      --ctl->count;
+    }
+  } else if (strcmp(cmd, "clear") == 0) {
+    ctl->count = 0;
+  } else {
+    ret = Usage(argv[0]);
+  }
+
+  if (ret == 0 && strcmp(cmd, "list") != 0) {
+    __atomic_add_fetch(&ctl->gen, 1, __ATOMIC_RELEASE);
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+  munmap(ctl, sizeof(*ctl));
+  return ret;
+}
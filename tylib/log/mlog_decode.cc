@@ -0,0 +1,52 @@
+// Render MLOG_M_BINARY segments as text.
+// usage: mlog_decode prefix_20240101_000000.log [more segments in order]
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+
+#include "tylib/log/binary_log.h"
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s segment...\n", argv[0]);
+    return 1;
+  }
+
+  // keep DEFs across segments, a site's DEF may be in the previous one
+  tylib::mlog::BinDecoder decoder;
+  int ret = 0;
+  for (int i = 1; i < argc; ++i) {
+    int fd = open(argv[i], O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+      perror(argv[i]);
+      if (fd >= 0) close(fd);
+      ret = 1;
+      continue;
+    }
+    if (sb.st_size == 0) {
+      close(fd);
+      continue;
+    }
+
+    void* p = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      perror(argv[i]);
+      ret = 1;
+      continue;
+    }
+
+    std::string out;
+    decoder.Decode(static_cast<const char*>(p), sb.st_size, &out);
+    munmap(p, sb.st_size);
+    fwrite(out.data(), 1, out.size(), stdout);
+  }
+
+  return ret;
+}
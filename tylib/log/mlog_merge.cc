@@ -0,0 +1,68 @@
+// Print the MLOG_M_SHARD shards of a prefix as one stream in line order,
+// reading one line of each shard at a time.
+// usage: mlog_merge [-k] dir prefix [YYYYMMDD_HHMMSS]
+// With a start time only the shards of that segment are merged, else all.
+// -k keeps the "<ns> <seq> " tag of each line.
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "tylib/log/log_shard.h"
+
+namespace {
+
+// shards named prefix_YYYYMMDD_HHMMSS.<tid>.log, of segment stamp if given
+std::vector<std::string> Shards(const std::string& dir,
+                                const std::string& prefix,
+                                const std::string& stamp) {
+  std::vector<std::string> shards;
+  DIR* d = opendir(dir.c_str());
+  if (!d) return shards;
+  while (dirent* e = readdir(d)) {
+    std::string name = e->d_name;
+    const size_t n = prefix.size() + 16;  // _YYYYMMDD_HHMMSS
+    if (name.size() < n + 6 || name.compare(0, prefix.size(), prefix) != 0 ||
+        name[prefix.size()] != '_' || name[n] != '.' ||
+        name.compare(name.size() - 4, 4, ".log") != 0) {
+      continue;
+    }
+    if (!stamp.empty() && name.compare(prefix.size() + 1, 15, stamp) != 0) {
+      continue;
+    }
+    bool tid = true;
+    for (size_t i = n + 1; i < name.size() - 4; ++i) {
+      tid = tid && isdigit(static_cast<unsigned char>(name[i]));
+    }
+    if (tid) shards.push_back(dir + "/" + name);
+  }
+  closedir(d);
+  return shards;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool keepTag = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "k")) != -1) {
+    if (opt == 'k') keepTag = true;
+  }
+  if (argc - optind != 2 && argc - optind != 3) {
+    fprintf(stderr, "usage: %s [-k] dir prefix [YYYYMMDD_HHMMSS]\n",
+            argv[0]);
+    return 1;
+  }
+
+  std::string stamp = argc - optind == 3 ? argv[optind + 2] : "";
+  tylib::mlog::ShardMerger merger(
+      Shards(argv[optind], argv[optind + 1], stamp));
+  std::string line;
+  while (merger.Next(&line, keepTag)) fwrite(line.data(), 1, line.size(), stdout);
+  return 0;
+}
@@ -0,0 +1,152 @@
+// Print the lines of a time range from the segments of a prefix, seeking
+// with the MLOG_M_INDEX sidecar of each segment instead of scanning it.
+// usage: mlog_query dir prefix from to
+// from and to are "YYYY-MM-DD HH:MM:SS" in local time or epoch seconds,
+// both included. Lines carrying MLOG_F_TIME are filtered by it, others in
+// the seeked range are all printed.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tylib/log/log_index.h"
+
+namespace {
+
+using tylib::mlog::kIndexSkew;
+using tylib::mlog::MLogIndexEntry;
+
+bool ParseArg(const char* s, int64_t* sec) {
+  if (tylib::mlog::ParseTime(s, strlen(s), sec)) return true;
+  char* end = nullptr;
+  *sec = strtoll(s, &end, 10);
+  return end != s && *end == 0;
+}
+
+// read only mapping of a whole file, empty if missing
+struct Mapped {
+  const char* data = nullptr;
+  size_t size = 0;
+
+  explicit Mapped(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+      void* p = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data = static_cast<const char*>(p);
+        size = sb.st_size;
+      }
+    }
+    close(fd);
+  }
+
+  ~Mapped() {
+    if (data) munmap(const_cast<char*>(data), size);
+  }
+};
+
+// segments of prefix by start time, from names prefix_YYYYMMDD_HHMMSS.log
+std::vector<std::pair<int64_t, std::string>> Segments(const std::string& dir,
+                                                      const std::string& prefix) {
+  std::vector<std::pair<int64_t, std::string>> segs;
+  DIR* d = opendir(dir.c_str());
+  if (!d) return segs;
+  while (dirent* e = readdir(d)) {
+    std::string name = e->d_name;
+    const size_t n = prefix.size() + 20;  // _YYYYMMDD_HHMMSS.log
+    if (name.size() != n || name.compare(0, prefix.size(), prefix) != 0 ||
+        name[prefix.size()] != '_' || name.compare(n - 4, 4, ".log") != 0) {
+      continue;
+    }
+    const char* t = name.c_str() + prefix.size() + 1;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.4s-%.2s-%.2s %.2s:%.2s:%.2s", t, t + 4,
+             t + 6, t + 9, t + 11, t + 13);
+    int64_t sec;
+    if (tylib::mlog::ParseTime(buf, strlen(buf), &sec)) {
+      segs.emplace_back(sec, dir + "/" + name);
+    }
+  }
+  closedir(d);
+  std::sort(segs.begin(), segs.end());
+  return segs;
+}
+
+// first non zero byte from p on, a word at a time. The unused tail of an
+// MLOG_M_MMAP segment is zeros, often half of it; a writer that died
+// between reserve and copy leaves a hole of them before more lines.
+const char* SkipZeros(const char* p, const char* stop) {
+  while (p < stop && (reinterpret_cast<uintptr_t>(p) & 7)) {
+    if (*p) return p;
+    ++p;
+  }
+  while (stop - p >= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    if (w) break;
+    p += 8;
+  }
+  while (p < stop && *p == 0) ++p;
+  return p;
+}
+
+void Query(const std::string& path, int64_t from, int64_t to) {
+  Mapped log(path);
+  if (!log.data) return;
+  Mapped idx(path + ".idx");
+
+  uint64_t begin;
+  uint64_t end;
+  tylib::mlog::IndexRange(reinterpret_cast<const MLogIndexEntry*>(idx.data),
+                          idx.size / sizeof(MLogIndexEntry), from, to,
+                          log.size, &begin, &end);
+
+  const char* p = log.data + begin;
+  const char* stop = log.data + end;
+  while (p < stop) {
+    if (*p == 0) {
+      p = SkipZeros(p, stop);
+      continue;
+    }
+    const char* nl = static_cast<const char*>(memchr(p, '\n', stop - p));
+    const char* next = nl ? nl + 1 : stop;
+    int64_t sec;
+    if (!tylib::mlog::LineTime(p, next - p, &sec) ||
+        (sec >= from && sec <= to)) {
+      fwrite(p, 1, next - p, stdout);
+    }
+    p = next;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int64_t from;
+  int64_t to;
+  if (argc != 5 || !ParseArg(argv[3], &from) || !ParseArg(argv[4], &to)) {
+    fprintf(stderr, "usage: %s dir prefix from to\n", argv[0]);
+    return 1;
+  }
+
+  // a segment holds lines from its start to the next segment's start
+  std::vector<std::pair<int64_t, std::string>> segs = Segments(argv[1], argv[2]);
+  for (size_t i = 0; i < segs.size(); ++i) {
+    if (segs[i].first > to + kIndexSkew) break;
+    if (i + 1 < segs.size() && segs[i + 1].first < from - kIndexSkew) continue;
+    Query(segs[i].second, from, to);
+  }
+  return 0;
+}
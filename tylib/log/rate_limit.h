@@ -0,0 +1,84 @@
+// Lock-free per call site state of MLOG_EVERY_N, MLOG_EVERY_MS and
+// MLOG_TOKEN_BUCKET, see log.h. A skipped call costs a clock read (vDSO, not
+// a syscall) and one atomic op, nothing is formatted.
+
+#ifndef TYLIB_LOG_RATE_LIMIT_H_
+#define TYLIB_LOG_RATE_LIMIT_H_
+
+#include <time.h>
+
+#include <atomic>
+#include <cstdint>
+
+namespace tylib {
+
+namespace mlog {
+
+// zero initialized as a function local static, no guard
+struct RateSite {
+  std::atomic<uint64_t> count;       // EVERY_N calls
+  std::atomic<int64_t> next;         // EVERY_MS ns, TOKEN_BUCKET arrival ns
+  std::atomic<uint64_t> suppressed;  // since last emitted line
+};
+
+// ~4ms resolution, enough to pace log lines
+inline int64_t RateNowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// n of 0 or 1 logs every call
+inline bool RateEveryN(RateSite* site, uint64_t n, uint64_t* skipped) {
+  if (n <= 1) {
+    *skipped = 0;
+    return true;
+  }
+  uint64_t c = site->count.fetch_add(1, std::memory_order_relaxed);
+  if (c % n != 0) return false;
+  *skipped = c == 0 ? 0 : n - 1;
+  return true;
+}
+
+inline bool RateEveryMs(RateSite* site, int64_t ms, uint64_t* skipped) {
+  int64_t now = RateNowNs();
+  int64_t next = site->next.load(std::memory_order_relaxed);
+  if (now < next ||
+      !site->next.compare_exchange_strong(next, now + ms * 1000000,
+                                          std::memory_order_relaxed)) {
+    site->suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  *skipped = site->suppressed.exchange(0, std::memory_order_relaxed);
+  return true;
+}
+
+// GCRA form of token bucket: next is the theoretical arrival time of the
+// next line, a line passes if it is at most burst intervals early.
+inline bool RateTokenBucket(RateSite* site, double perSecond, int burst,
+                            uint64_t* skipped) {
+  if (perSecond < 0.001) perSecond = 0.001;
+  const int64_t interval = static_cast<int64_t>(1e9 / perSecond);
+  const int64_t tolerance = interval * (burst > 0 ? burst : 1);
+  int64_t now = RateNowNs();
+  int64_t tat = site->next.load(std::memory_order_relaxed);
+  for (;;) {
+    int64_t newTat = (tat > now ? tat : now) + interval;
+    if (newTat - now > tolerance) {
+      site->suppressed.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    if (site->next.compare_exchange_weak(tat, newTat,
+                                         std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  *skipped = site->suppressed.exchange(0, std::memory_order_relaxed);
+  return true;
+}
+
+}  // namespace mlog
+
+}  // namespace tylib
+
+#endif  // TYLIB_LOG_RATE_LIMIT_H_
@@ -0,0 +1,381 @@
+// io_uring submission of log writes, used by CMLogger in MLOG_M_URING mode,
+// see log.h. Raw syscalls on linux/io_uring.h, no liburing.
+//
+// Lines are copied into registered buffers and written with
+// IORING_OP_WRITE_FIXED on registered file 0. Completions are reaped when a
+// buffer is needed, never waited for unless all buffers are in flight.
+// Each write is IOSQE_IO_DRAIN, started once the ones before it completed,
+// so with O_APPEND the file order is the submission order. io-wq hashing by
+// inode does not hold for a fixed file, it is looked up after the punt.
+//
+// A short write is submitted again for the rest, so is a write failed with
+// EINTR, EAGAIN or ECANCELED, a few times. What is still left then, or after
+// any other error, is written by write(2); bytes that fails on too are
+// counted as lost, see TakeLost.
+//
+// The kernel cancels the pending writes of a thread when it exits, so a
+// thread drains the rings it submitted to on exit. A forked child leaves
+// the ring of its parent alone.
+
+#ifndef TYLIB_LOG_URING_WRITER_H_
+#define TYLIB_LOG_URING_WRITER_H_
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace tylib {
+
+namespace mlog {
+
+class UringWriter : public std::enable_shared_from_this<UringWriter> {
+ public:
+  static const unsigned kBuffers = 16;
+  static const size_t kBufSize = 64 * 1024;
+  static const unsigned kTries = 3;  // submissions of a buffer before write(2)
+
+  UringWriter() : id(NextId()), forks(Forks().load()) {}
+  ~UringWriter();
+
+  UringWriter(const UringWriter&) = delete;
+  UringWriter& operator=(const UringWriter&) = delete;
+
+  // false if the kernel has no usable io_uring, caller writes by itself
+  bool Init();
+
+  // Write to the file fd is open on, gen names that file. A new gen moves
+  // the registered file to fd, writes in flight finish on the old file.
+  // Whole iov are packed into buffers, a line is never split. Returns the
+  // count of iov submitted, the caller writes the rest itself, after the
+  // submitted ones.
+  int Write(int fd, unsigned long gen, const iovec* iov, int cnt);
+
+  // bytes lost since the last call and the errno of the last loss
+  unsigned long TakeLost(int* err) {
+    unsigned long n = lost.exchange(0);
+    if (n > 0) *err = lastErr.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  // bytes lost since Init
+  unsigned long Lost() const { return lostTotal.load(); }
+
+  // wait for every write in flight
+  void Drain() {
+    if (Forks().load(std::memory_order_relaxed) != forks) return;
+    std::lock_guard<std::mutex> guard(lock);
+    DrainLocked();
+  }
+
+ private:
+  // rings the current thread submitted to
+  struct ThreadRings {
+    std::vector<std::pair<unsigned long, std::weak_ptr<UringWriter>>> rings;
+
+    ~ThreadRings() {
+      for (auto& r : rings) {
+        if (auto w = r.second.lock()) w->Drain();
+      }
+    }
+  };
+
+  static ThreadRings& LocalRings() {
+    static thread_local ThreadRings local;
+    return local;
+  }
+
+  static unsigned long NextId() {
+    static std::atomic<unsigned long> id{0};
+    return ++id;
+  }
+
+  // forks done by the process, counted in the child
+  static std::atomic<unsigned>& Forks() {
+    static std::atomic<unsigned> forks{0};
+    static std::once_flag once;
+    std::call_once(once, []() {
+      pthread_atfork(nullptr, nullptr, []() { ++Forks(); });
+    });
+    return forks;
+  }
+
+  void Track() {
+    auto& rings = LocalRings().rings;
+    for (auto& r : rings) {
+      if (r.first == id) return;
+    }
+    rings.emplace_back(id, shared_from_this());
+  }
+
+  bool SetFile(int fd);
+
+  void DrainLocked() {
+    while (freeCount < kBuffers) Reap(true);
+  }
+
+  static int Setup(unsigned entries, io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+  }
+
+  static int Enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    int ret;
+    while ((ret = syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+                          nullptr, 0)) < 0 &&
+           errno == EINTR) {
+    }
+    return ret;
+  }
+
+  static int Register(int fd, unsigned op, void* arg, unsigned n) {
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+  }
+
+  // free buffers from completed writes, wait for one if asked
+  void Reap(bool wait);
+
+  // res of the write of buf, its buffer is freed once all of it is written
+  void Complete(unsigned buf, int res);
+
+  // what is left of buf, -1 if the kernel did not take it
+  int Submit(unsigned buf);
+
+  const unsigned long id;
+  const unsigned forks;  // Forks() when the ring was set up
+  std::mutex lock;       // one submitter, keeps the order of writes
+
+  int ringFd = -1;
+  void* sqMap = MAP_FAILED;
+  size_t sqMapLen = 0;
+  void* cqMap = MAP_FAILED;
+  size_t cqMapLen = 0;
+  io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+  size_t sqesLen = 0;
+
+  unsigned* sqTail = nullptr;
+  unsigned sqMask = 0;
+  unsigned* sqArray = nullptr;
+  unsigned* cqHead = nullptr;
+  unsigned* cqTail = nullptr;
+  unsigned cqMask = 0;
+  io_uring_cqe* cqes = nullptr;
+
+  char* bufs = static_cast<char*>(MAP_FAILED);
+  unsigned freeList[kBuffers];
+  unsigned freeCount = 0;
+  size_t bufLen[kBuffers];   // bytes copied in
+  size_t bufDone[kBuffers];  // bytes written so far
+  unsigned bufTries[kBuffers];
+  bool fileSet = false;
+  unsigned long fileGen = 0;
+  int fileFd = -1;  // what the registered file was taken from
+
+  std::atomic<unsigned long> lost{0};  // not taken yet
+  std::atomic<unsigned long> lostTotal{0};
+  std::atomic<int> lastErr{0};
+};
+
+inline UringWriter::~UringWriter() {
+  if (ringFd >= 0) {
+    if (Forks().load(std::memory_order_relaxed) == forks) DrainLocked();
+    close(ringFd);
+  }
+  if (sqes != MAP_FAILED) munmap(sqes, sqesLen);
+  if (cqMap != MAP_FAILED && cqMap != sqMap) munmap(cqMap, cqMapLen);
+  if (sqMap != MAP_FAILED) munmap(sqMap, sqMapLen);
+  if (bufs != MAP_FAILED) munmap(bufs, kBuffers * kBufSize);
+}
+
+inline bool UringWriter::Init() {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ringFd = Setup(kBuffers * 2, &p);
+  if (ringFd < 0) return false;
+
+  sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cqMapLen > sqMapLen) sqMapLen = cqMapLen;
+  }
+  sqMap = mmap(0, sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               ringFd, IORING_OFF_SQ_RING);
+  if (sqMap == MAP_FAILED) return false;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cqMap = sqMap;
+  } else {
+    cqMap = mmap(0, cqMapLen, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    if (cqMap == MAP_FAILED) return false;
+  }
+  sqesLen = p.sq_entries * sizeof(io_uring_sqe);
+  sqes = static_cast<io_uring_sqe*>(mmap(0, sqesLen, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, ringFd,
+                                         IORING_OFF_SQES));
+  if (sqes == MAP_FAILED) return false;
+
+  char* sq = static_cast<char*>(sqMap);
+  char* cq = static_cast<char*>(cqMap);
+  sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  sqMask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  cqMask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+  // pinned once, no page lookup per write
+  bufs = static_cast<char*>(mmap(0, kBuffers * kBufSize,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (bufs == MAP_FAILED) return false;
+  iovec iov[kBuffers];
+  for (unsigned i = 0; i < kBuffers; ++i) {
+    iov[i].iov_base = bufs + i * kBufSize;
+    iov[i].iov_len = kBufSize;
+    freeList[freeCount++] = i;
+  }
+  return Register(ringFd, IORING_REGISTER_BUFFERS, iov, kBuffers) == 0;
+}
+
+inline bool UringWriter::SetFile(int fd) {
+  if (!fileSet) {
+    fileSet = Register(ringFd, IORING_REGISTER_FILES, &fd, 1) == 0;
+    return fileSet;
+  }
+
+  io_uring_files_update up;
+  memset(&up, 0, sizeof(up));
+  up.offset = 0;
+  up.fds = reinterpret_cast<uintptr_t>(&fd);
+  return Register(ringFd, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1;
+}
+
+inline void UringWriter::Reap(bool wait) {
+  unsigned head = *cqHead;
+  if (wait && head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    Enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS);
+  }
+
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const io_uring_cqe& cqe = cqes[head & cqMask];
+    Complete(cqe.user_data, cqe.res);
+  }
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+inline void UringWriter::Complete(unsigned buf, int res) {
+  if (res > 0) bufDone[buf] += res;
+  size_t left = bufLen[buf] - bufDone[buf];
+  if (left == 0) {
+    freeList[freeCount++] = buf;
+    return;
+  }
+
+  // The rest goes after writes submitted since, a line may be split by
+  // them. Short writes of a file are rare, ENOSPC or a signal.
+  bool retry = res > 0 || res == -EINTR || res == -EAGAIN || res == -ECANCELED;
+  if (retry && ++bufTries[buf] < kTries && Submit(buf) == 0) return;
+
+  const char* p = bufs + buf * kBufSize + bufDone[buf];
+  int err = res < 0 ? -res : EIO;
+  while (left > 0) {
+    ssize_t n = write(fileFd, p, left);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      if (n < 0) err = errno;
+      break;
+    }
+    p += n;
+    left -= n;
+  }
+  if (left > 0) {
+    lastErr.store(err, std::memory_order_relaxed);
+    lost.fetch_add(left);
+    lostTotal.fetch_add(left);
+  }
+  freeList[freeCount++] = buf;
+}
+
+inline int UringWriter::Submit(unsigned buf) {
+  unsigned tail = *sqTail;
+  unsigned idx = tail & sqMask;
+  io_uring_sqe* sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_DRAIN;
+  sqe->fd = 0;  // registered file index
+  sqe->off = 0;  // ignored by O_APPEND
+  sqe->addr =
+      reinterpret_cast<uintptr_t>(bufs + buf * kBufSize + bufDone[buf]);
+  sqe->len = bufLen[buf] - bufDone[buf];
+  sqe->buf_index = buf;
+  sqe->user_data = buf;
+  sqArray[idx] = idx;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  if (Enter(ringFd, 1, 0, 0) != 1) {
+    // not consumed by the kernel, take it back
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    return -1;
+  }
+  return 0;
+}
+
+inline int UringWriter::Write(int fd, unsigned long gen, const iovec* iov,
+                               int cnt) {
+  if (Forks().load(std::memory_order_relaxed) != forks) return 0;
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (fileGen != gen) {
+    if (!SetFile(fd)) return 0;
+    fileGen = gen;
+  }
+  fileFd = fd;
+  Track();
+
+  int i = 0;
+  while (i < cnt) {
+    if (iov[i].iov_len > kBufSize) break;
+
+    Reap(false);
+    if (freeCount == 0) Reap(true);
+
+    unsigned buf = freeList[--freeCount];
+    char* dst = bufs + buf * kBufSize;
+    size_t len = 0;
+    int first = i;
+    for (; i < cnt && len + iov[i].iov_len <= kBufSize; ++i) {
+      memcpy(dst + len, iov[i].iov_base, iov[i].iov_len);
+      len += iov[i].iov_len;
+    }
+    bufLen[buf] = len;
+    bufDone[buf] = 0;
+    bufTries[buf] = 0;
+    if (Submit(buf) < 0) {
+      freeList[freeCount++] = buf;
+      i = first;
+      break;
+    }
+  }
+  if (i < cnt) DrainLocked();
+  return i;
+}
+
+}  // namespace mlog
+
+}  // namespace tylib
+
+#endif  // TYLIB_LOG_URING_WRITER_H_
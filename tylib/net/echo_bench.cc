@@ -0,0 +1,363 @@
+// Loopback echo through EventLoop against a hand-rolled loop.
+//
+// usage: echo_bench [-m epoll,timerfd,fixed] [-c 1,16] [-s 64] [-d seconds]
+//                   [-i ms]
+//
+// A server thread echoes, -c client threads keep one connection each in
+// ping-pong of -s bytes for -d seconds. fixed is the loop services write
+// by hand: epoll_wait with a -i ms timeout, then UpdateTimers(Time()).
+// Each connection has an idle timer pushed back on every message and the
+// server a 100ms stats timer, so the wheel is in use in all modes.
+//
+// Printed: round trips per second, server wakeups per second under load
+// and for a second with no clients, and RTT percentiles.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tylib/ip/ip.h"
+#include "tylib/net/event_loop.h"
+#include "tylib/string/string_split.h"
+
+namespace {
+
+const int kIdleMs = 30 * 1000;
+
+uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void NoDelay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+class IdleTimer : public Timer {
+ private:
+  bool _OnTimer() override { return false; }  // would close the conn
+};
+
+// the echo, shared by the loops; the loop calls OnAccept and OnRead
+class Server {
+ public:
+  Server(TimerManager* wheel, const Time* now) : m_wheel(wheel), m_now(now) {}
+
+  ~Server() {
+    for (auto& c : m_conns) {
+      if (c) close(c->fd);
+    }
+  }
+
+  // new fds, to be watched for EPOLLIN
+  std::vector<int> OnAccept(int listenFd) {
+    std::vector<int> fds;
+    int fd;
+    while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+      NoDelay(fd);
+      if (fd >= static_cast<int>(m_conns.size())) m_conns.resize(fd + 1);
+      m_conns[fd].reset(new Conn);
+      m_conns[fd]->fd = fd;
+      fds.push_back(fd);
+    }
+    return fds;
+  }
+
+  // false once the peer closed, the caller unwatches and calls Close
+  bool OnRead(int fd) {
+    Conn* c = m_conns[fd].get();
+    char buf[64 * 1024];
+    for (;;) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n == 0) return false;
+      if (n < 0) return errno == EAGAIN || errno == EINTR;
+
+      for (ssize_t off = 0; off < n;) {
+        ssize_t w = write(fd, buf + off, n - off);
+        if (w > 0) off += w;
+        if (w < 0 && errno != EAGAIN && errno != EINTR) return false;
+      }
+      Time idle = *m_now;
+      idle.AddDelay(kIdleMs);
+      m_wheel->ScheduleAt(&c->idle, idle);
+    }
+  }
+
+  void Close(int fd) {
+    m_wheel->KillTimer(&m_conns[fd]->idle);
+    close(fd);
+    m_conns[fd].reset();
+  }
+
+ private:
+  struct Conn {
+    int fd;
+    IdleTimer idle;
+  };
+
+  TimerManager* m_wheel;
+  const Time* m_now;
+  std::vector<std::unique_ptr<Conn>> m_conns;  // by fd
+};
+
+// listening on 127.0.0.1, an ephemeral port in *port
+int Listen(int* port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  sockaddr_in addr = tylib::ConstructSockAddr("127.0.0.1", 0);
+  socklen_t len = sizeof(addr);
+  if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), len) != 0 ||
+      listen(fd, 1024) != 0 ||
+      getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+    perror("listen");
+    exit(1);
+  }
+  std::string ip;
+  tylib::ParseIpPort(addr, ip, *port);
+  return fd;
+}
+
+// the server side of a mode, runs until stop
+class Loop {
+ public:
+  virtual ~Loop() {}
+  virtual void Run(int listenFd) = 0;
+  virtual void Stop() = 0;
+  virtual uint64_t Wakeups() const = 0;
+};
+
+class ReactorLoop : public Loop {
+ public:
+  explicit ReactorLoop(tylib::EventLoop::TimeoutMode mode) {
+    if (m_loop.Init(mode) != 0) {
+      perror("EventLoop::Init");
+      exit(1);
+    }
+  }
+
+  void Run(int listenFd) override {
+    Server server(m_loop.Timers(), &m_loop.Now());
+    m_loop.Timers()->Schedule(100, 100, -1, [] {});
+    m_loop.Add(listenFd, EPOLLIN, [&](uint32_t) {
+      for (int fd : server.OnAccept(listenFd)) {
+        m_loop.Add(fd, EPOLLIN, [&server, this, fd](uint32_t) {
+          if (!server.OnRead(fd)) {
+            m_loop.Remove(fd);
+            server.Close(fd);
+          }
+        });
+      }
+    });
+    m_loop.Run();
+    m_loop.Remove(listenFd);
+  }
+
+  void Stop() override { m_loop.Stop(); }
+  uint64_t Wakeups() const override { return m_loop.Wakeups(); }
+
+ private:
+  tylib::EventLoop m_loop;
+};
+
+// what each service writes by hand
+class FixedLoop : public Loop {
+ public:
+  explicit FixedLoop(int interval) : m_interval(interval) {}
+
+  void Run(int listenFd) override {
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    TimerManager wheel;
+    Time now;
+    Server server(&wheel, &now);
+    wheel.Schedule(100, 100, -1, [] {});
+    Watch(ep, listenFd);
+
+    epoll_event events[256];
+    while (!m_stop.load(std::memory_order_acquire)) {
+      int n = epoll_wait(ep, events, 256, m_interval);
+      m_wakeups.fetch_add(1, std::memory_order_relaxed);
+      now = Time();
+      for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == listenFd) {
+          for (int c : server.OnAccept(listenFd)) Watch(ep, c);
+        } else if (!server.OnRead(fd)) {
+          epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+          server.Close(fd);
+        }
+      }
+      wheel.UpdateTimers(now);
+    }
+    close(ep);
+  }
+
+  void Stop() override { m_stop.store(true); }
+  uint64_t Wakeups() const override { return m_wakeups.load(); }
+
+ private:
+  static void Watch(int ep, int fd) {
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  int m_interval;
+  std::atomic<bool> m_stop{false};
+  std::atomic<uint64_t> m_wakeups{0};
+};
+
+// ping-pong until deadline, RTT in ns to rtt
+void Client(int port, int size, uint64_t deadline, std::vector<uint32_t>* rtt) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = tylib::ConstructSockAddr("127.0.0.1", port);
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    perror("connect");
+    exit(1);
+  }
+  NoDelay(fd);
+
+  std::string msg(size, 'x');
+  std::vector<char> buf(size);
+  for (uint64_t begin = NowNs(); begin < deadline;) {
+    if (write(fd, msg.data(), size) != size) break;
+    int got = 0;
+    while (got < size) {
+      ssize_t n = read(fd, buf.data() + got, size - got);
+      if (n <= 0) break;
+      got += n;
+    }
+    if (got < size) break;
+    uint64_t end = NowNs();
+    rtt->push_back(end - begin);
+    begin = end;
+  }
+  close(fd);
+}
+
+uint64_t Percentile(std::vector<uint32_t>* v, double p) {
+  if (v->empty()) return 0;
+  size_t k = std::min(v->size() - 1, static_cast<size_t>(v->size() * p));
+  std::nth_element(v->begin(), v->begin() + k, v->end());
+  return (*v)[k];
+}
+
+void Run(const std::string& mode, int clients, int size, int seconds,
+         int interval) {
+  std::unique_ptr<Loop> loop;
+  if (mode == "epoll") {
+    loop.reset(new ReactorLoop(tylib::EventLoop::TIMEOUT_EPOLL));
+  } else if (mode == "timerfd") {
+    loop.reset(new ReactorLoop(tylib::EventLoop::TIMEOUT_TIMERFD));
+  } else if (mode == "fixed") {
+    loop.reset(new FixedLoop(interval));
+  } else {
+    fprintf(stderr, "unknown mode %s\n", mode.c_str());
+    return;
+  }
+
+  int port = 0;
+  int listenFd = Listen(&port);
+  std::thread server([&] { loop->Run(listenFd); });
+
+  std::vector<std::vector<uint32_t>> rtts(clients);
+  std::vector<std::thread> threads;
+  uint64_t w0 = loop->Wakeups();
+  uint64_t begin = NowNs();
+  uint64_t deadline = begin + seconds * 1000000000ULL;
+  for (int i = 0; i < clients; ++i) {
+    threads.emplace_back(Client, port, size, deadline, &rtts[i]);
+  }
+  for (auto& t : threads) t.join();
+  uint64_t busyNs = NowNs() - begin;
+  uint64_t busy = loop->Wakeups() - w0;
+
+  // closes are done after a moment, then nothing but timers
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  w0 = loop->Wakeups();
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  uint64_t idle = loop->Wakeups() - w0;
+
+  loop->Stop();
+  server.join();
+  close(listenFd);
+
+  std::vector<uint32_t> all;
+  for (auto& r : rtts) all.insert(all.end(), r.begin(), r.end());
+  printf("%-8s %7d %5d %12.0f %12.0f %10llu %8llu %8llu %8llu\n", mode.c_str(),
+         clients, size, all.size() * 1e9 / busyNs, busy * 1e9 / busyNs,
+         static_cast<unsigned long long>(idle),
+         static_cast<unsigned long long>(Percentile(&all, 0.5)),
+         static_cast<unsigned long long>(Percentile(&all, 0.99)),
+         static_cast<unsigned long long>(Percentile(&all, 0.999)));
+  fflush(stdout);
+}
+
+std::vector<std::string> List(const char* arg) {
+  return tylib::StringSplit(arg, ",");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::vector<std::string> modes = {"epoll", "timerfd", "fixed"};
+  std::vector<std::string> clients = {"1", "16"};
+  std::vector<std::string> sizes = {"64"};
+  int seconds = 2;
+  int interval = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:c:s:d:i:h")) != -1) {
+    switch (opt) {
+      case 'm':
+        modes = List(optarg);
+        break;
+      case 'c':
+        clients = List(optarg);
+        break;
+      case 's':
+        sizes = List(optarg);
+        break;
+      case 'd':
+        seconds = atoi(optarg);
+        break;
+      case 'i':
+        interval = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-m modes] [-c clients] [-s sizes] [-d seconds] "
+                "[-i fixed loop ms]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  printf("%-8s %7s %5s %12s %12s %10s %8s %8s %8s\n", "mode", "clients",
+         "msg", "rtt/s", "wakeups/s", "idle/s", "p50(ns)", "p99(ns)",
+         "p999(ns)");
+  for (const auto& m : modes)
+    for (const auto& c : clients)
+      for (const auto& s : sizes) {
+        Run(m, atoi(c.c_str()), atoi(s.c_str()), seconds, interval);
+      }
+  return 0;
+}
@@ -0,0 +1,249 @@
+// Reactor of one thread: epoll for fd readiness, a TimerManager whose next
+// expiry ends the wait, either as the epoll_wait timeout or by a timerfd,
+// and an eventfd that wakes it for Post from other threads.
+//
+//   tylib::EventLoop loop;
+//   if (loop.Init() != 0) ...
+//   loop.Add(fd, EPOLLIN, [&](uint32_t events) { ... });
+//   loop.Timers()->Schedule(100, 100, -1, [] { ... });
+//   loop.Run();
+//
+// Add, Modify, Remove and the wheel are for the loop thread, the one in
+// Run. Other threads Post to it, e.g. a Post that adds a timer: the Async
+// calls of the wheel do not wake the loop.
+
+#ifndef TYLIB_NET_EVENT_LOOP_H_
+#define TYLIB_NET_EVENT_LOOP_H_
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "tylib/time/mpsc_queue.h"
+#include "tylib/time/timer.h"
+
+namespace tylib {
+
+class EventLoop {
+ public:
+  typedef std::function<void(uint32_t events)> IoCallback;
+
+  // how a wait ends for the next timer
+  enum TimeoutMode {
+    TIMEOUT_EPOLL,    // epoll_wait timeout, in ms
+    TIMEOUT_TIMERFD,  // a timerfd armed at the tick, in us
+  };
+
+  EventLoop() {}
+
+  ~EventLoop() {
+    while (MpscNode* node = m_tasks.Pop()) delete static_cast<Task*>(node);
+    if (m_timerFd >= 0) close(m_timerFd);
+    if (m_eventFd >= 0) close(m_eventFd);
+    if (m_epfd >= 0) close(m_epfd);
+  }
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  // 0, or -1 with errno
+  int Init(TimeoutMode mode = TIMEOUT_EPOLL) {
+    m_mode = mode;
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0) return -1;
+
+    m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventFd < 0 || _Watch(m_eventFd) != 0) return -1;
+
+    if (mode == TIMEOUT_TIMERFD) {
+      m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (m_timerFd < 0 || _Watch(m_timerFd) != 0) return -1;
+    }
+    _Tick();
+    return 0;
+  }
+
+  // cb(events) on the loop thread while fd is ready, events are EPOLL*
+  int Add(int fd, uint32_t events, IoCallback cb) {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) != 0) return -1;
+
+    if (fd >= static_cast<int>(m_handlers.size())) m_handlers.resize(fd + 1);
+    m_handlers[fd] = std::make_shared<IoCallback>(std::move(cb));
+    return 0;
+  }
+
+  int Modify(int fd, uint32_t events) {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  // before close(fd); a callback may remove its own fd
+  int Remove(int fd) {
+    if (fd >= 0 && fd < static_cast<int>(m_handlers.size())) {
+      m_handlers[fd].reset();
+    }
+    return epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, nullptr);
+  }
+
+  // any thread, fn runs on the loop thread after the fd callbacks
+  void Post(std::function<void()> fn) {
+    Task* task = new Task;
+    task->fn = std::move(fn);
+    m_tasks.Push(task);
+    _Wake();
+  }
+
+  // until Stop, which any thread may call
+  void Run() {
+    while (!m_stop.load(std::memory_order_acquire)) RunOnce(-1);
+  }
+
+  void Stop() {
+    m_stop.store(true, std::memory_order_release);
+    _Wake();
+  }
+
+  // One wait, then its fd callbacks, posted tasks and due timers. Waits
+  // at most maxWait ms, -1 for the next event or timer. Returns the count
+  // of fd callbacks run, -1 if epoll_wait failed.
+  int RunOnce(int maxWait) {
+    _Tick();
+    int n = epoll_wait(m_epfd, m_events, kMaxEvents, _Timeout(maxWait));
+    m_wakeups.fetch_add(1, std::memory_order_relaxed);
+    _Tick();
+
+    int io = 0;
+    for (int i = 0; i < n; ++i) {
+      const int fd = m_events[i].data.fd;
+      if (fd == m_eventFd) {
+        _Drain(m_eventFd);
+        m_woken.store(false);  // before the tasks, a later Post writes
+      } else if (fd == m_timerFd) {
+        _Drain(m_timerFd);
+        m_armed = -1;  // one shot, disarmed
+      } else if (fd < static_cast<int>(m_handlers.size()) && m_handlers[fd]) {
+        // kept alive if the callback removes its fd
+        std::shared_ptr<IoCallback> cb = m_handlers[fd];
+        (*cb)(m_events[i].events);
+        ++io;
+      }
+    }
+
+    while (MpscNode* node = m_tasks.Pop()) {
+      Task* task = static_cast<Task*>(node);
+      task->fn();
+      delete task;
+    }
+    m_timers.UpdateTimers(m_now);
+    return n < 0 ? -1 : io;
+  }
+
+  // the loop's wheel, loop thread only
+  TimerManager* Timers() { return &m_timers; }
+
+  // time of the last wakeup, as is Clock::TIER_CACHED on the loop thread
+  const Time& Now() const { return m_now; }
+
+  // returns of epoll_wait, from any thread
+  uint64_t Wakeups() const {
+    return m_wakeups.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static const int kMaxEvents = 256;
+
+  struct Task : MpscNode {
+    std::function<void()> fn;
+  };
+
+  // one clock reading for the turn, for m_now and TIER_CACHED
+  void _Tick() {
+    Clock::Update();
+    m_now.ComputeNow(Clock::TIER_CACHED);
+  }
+
+  int _Watch(int fd) {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  static void _Drain(int fd) {
+    uint64_t n;
+    while (read(fd, &n, sizeof(n)) == sizeof(n)) {
+    }
+  }
+
+  void _Wake() {
+    if (m_woken.exchange(true)) return;
+    uint64_t one = 1;
+    while (write(m_eventFd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+  }
+
+  // epoll_wait timeout for the next timer; in timerfd mode arms it instead
+  int _Timeout(int maxWait) {
+    const int64_t next = m_timers.NextExpiryUs();
+    if (m_mode == TIMEOUT_TIMERFD) {
+      if (next != m_armed) {
+        itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        if (next >= 0) {  // else all 0, disarmed
+          spec.it_value.tv_sec = next / 1000000;
+          spec.it_value.tv_nsec = next % 1000000 * 1000;
+        }
+        timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+        m_armed = next;
+      }
+      return maxWait;
+    }
+
+    if (next < 0) return maxWait;
+    int64_t wait = (next - m_now.MonotonicUs() + 999) / 1000;
+    if (wait < 0) wait = 0;
+    if (wait > INT_MAX) wait = INT_MAX;
+    return maxWait >= 0 && maxWait < wait ? maxWait : wait;
+  }
+
+  int m_epfd = -1;
+  int m_eventFd = -1;
+  int m_timerFd = -1;
+  TimeoutMode m_mode = TIMEOUT_EPOLL;
+  int64_t m_armed = -1;  // us the timerfd is armed at, -1 if not
+
+  std::atomic<bool> m_stop{false};
+  std::atomic<bool> m_woken{false};  // eventfd written, not yet read
+  std::atomic<uint64_t> m_wakeups{0};
+
+  // by fd. An fd closed and reused within one batch of events gets the
+  // rest of the events of the old one.
+  std::vector<std::shared_ptr<IoCallback>> m_handlers;
+  MpscQueue m_tasks;
+  TimerManager m_timers;
+  Time m_now;
+  epoll_event m_events[kMaxEvents];
+};
+
+}  // namespace tylib
+
+#endif  // TYLIB_NET_EVENT_LOOP_H_
@@ -0,0 +1,88 @@
+#include "tylib/net/event_loop.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+class EventLoopTest
+    : public ::testing::TestWithParam<tylib::EventLoop::TimeoutMode> {};
+
+TEST_P(EventLoopTest, FdAndTimer) {
+  tylib::EventLoop loop;
+  ASSERT_EQ(loop.Init(GetParam()), 0);
+
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  int reads = 0;
+  ASSERT_EQ(loop.Add(fds[0], EPOLLIN,
+                     [&](uint32_t events) {
+                       char c;
+                       EXPECT_TRUE(events & EPOLLIN);
+                       EXPECT_EQ(read(fds[0], &c, 1), 1);
+                       ++reads;
+                     }),
+            0);
+  ASSERT_EQ(write(fds[1], "x", 1), 1);
+  EXPECT_EQ(loop.RunOnce(-1), 1);
+  EXPECT_EQ(reads, 1);
+
+  // the wait ends for the timer, not before it
+  int fired = 0;
+  auto begin = std::chrono::steady_clock::now();
+  loop.Timers()->Schedule(20, 0, 1, [&fired] { ++fired; });
+  while (!fired) loop.RunOnce(-1);
+  EXPECT_GE(std::chrono::steady_clock::now() - begin,
+            std::chrono::milliseconds(19));
+  EXPECT_LE(loop.Wakeups(), 4U);
+
+  EXPECT_EQ(loop.Remove(fds[0]), 0);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_P(EventLoopTest, PostAndStopFromOtherThread) {
+  tylib::EventLoop loop;
+  ASSERT_EQ(loop.Init(GetParam()), 0);
+
+  int ran = 0;
+  std::thread other([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    loop.Post([&ran] { ++ran; });
+    loop.Post([&loop] { loop.Stop(); });
+  });
+  loop.Run();  // no fd, no timer: only the posts wake it
+  other.join();
+  EXPECT_EQ(ran, 1);
+}
+
+TEST_P(EventLoopTest, CallbackRemovesItself) {
+  tylib::EventLoop loop;
+  ASSERT_EQ(loop.Init(GetParam()), 0);
+
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  int calls = 0;
+  ASSERT_EQ(loop.Add(fds[0], EPOLLIN,
+                     [&](uint32_t) {
+                       ++calls;
+                       loop.Remove(fds[0]);
+                     }),
+            0);
+  ASSERT_EQ(write(fds[1], "x", 1), 1);
+  loop.RunOnce(-1);
+  EXPECT_EQ(loop.RunOnce(0), 0);
+  EXPECT_EQ(calls, 1);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+INSTANTIATE_TEST_SUITE_P(Modes, EventLoopTest,
+                         ::testing::Values(tylib::EventLoop::TIMEOUT_EPOLL,
+                                           tylib::EventLoop::TIMEOUT_TIMERFD));
+
+}  // namespace
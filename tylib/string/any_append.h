@@ -0,0 +1,340 @@
+// AnyAppend writes what AnyToString returns straight into a fixed buffer,
+// with the same dispatch rules, so no temporary std::string is built for
+// numbers, containers, pairs, rapidjson or jsoncpp values. Types giving only
+// ToString() or protobuf DebugString still make their own string.
+
+#ifndef TYLIB_STRING_ANY_APPEND_H_
+#define TYLIB_STRING_ANY_APPEND_H_
+
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "tylib/string/any_to_string.h"
+
+namespace tylib {
+
+// Append-only view of a caller's buffer, data beyond size is cut. Also a
+// rapidjson output stream.
+class FixedBuffer {
+ public:
+  typedef char Ch;
+
+  FixedBuffer(char* buf, size_t size) : begin(buf), p(buf), end(buf + size) {}
+
+  char* Data() const { return begin; }
+  size_t Size() const { return p - begin; }
+  size_t Room() const { return end - p; }
+  bool Full() const { return p == end; }
+
+  void Append(const char* s, size_t n) {
+    if (n > Room()) n = Room();
+    memcpy(p, s, n);
+    p += n;
+  }
+
+  void Append(const char* s) { Append(s, strlen(s)); }
+
+  void Append(const std::string& s) { Append(s.data(), s.size()); }
+
+  void Put(char c) {
+    if (p != end) *p++ = c;
+  }
+
+  void Flush() {}
+
+  // for in place rewrite of the tail, e.g. quoting
+  char* Cursor() const { return p; }
+  void Resize(size_t n) { p = begin + (n < size_t(end - begin) ? n : end - begin); }
+
+ private:
+  char* begin;
+  char* p;
+  char* end;
+};
+
+// std::ostream over a FixedBuffer for operator<< types, no heap
+class FixedStreamBuf : public std::streambuf {
+ public:
+  explicit FixedStreamBuf(FixedBuffer* out) : out(out) {
+    setp(out->Cursor(), out->Cursor() + out->Room());
+  }
+
+  ~FixedStreamBuf() override { out->Resize(out->Size() + (pptr() - pbase())); }
+
+ private:
+  FixedBuffer* out;
+};
+
+template <class T>
+void AnyAppend(FixedBuffer* out, const T& t);
+
+inline void AnyAppend(FixedBuffer* out, const std::string& s) {
+  out->Append(s);
+}
+
+inline void AnyAppend(FixedBuffer* out, const char* s) {
+  out->Append(s ? s : "(null)");
+}
+
+inline void AnyAppend(FixedBuffer* out, char* s) {
+  AnyAppend(out, static_cast<const char*>(s));
+}
+
+#ifdef JSONCPP
+inline void AnyAppendJsonString(FixedBuffer* out, const char* s, size_t n);
+
+// Compact JSON, members in key order, no trailing '\n'. Not byte for byte
+// Json::FastWriter: reals are %.17g, so 2.0 is "2" and NaN is "nan", and
+// strings keep UTF-8, only '"', '\\' and control chars are escaped.
+inline void AnyAppend(FixedBuffer* out, const Json::Value& jValue) {
+  char buf[64];
+  switch (jValue.type()) {
+    case Json::nullValue:
+      out->Append("null");
+      break;
+    case Json::intValue: {
+      auto r = std::to_chars(buf, buf + sizeof(buf), jValue.asLargestInt());
+      out->Append(buf, r.ptr - buf);
+      break;
+    }
+    case Json::uintValue: {
+      auto r = std::to_chars(buf, buf + sizeof(buf), jValue.asLargestUInt());
+      out->Append(buf, r.ptr - buf);
+      break;
+    }
+    case Json::realValue:
+      out->Append(buf, snprintf(buf, sizeof(buf), "%.17g", jValue.asDouble()));
+      break;
+    case Json::stringValue: {
+      const char* b = nullptr;
+      const char* e = nullptr;
+      jValue.getString(&b, &e);
+      AnyAppendJsonString(out, b, e - b);
+      break;
+    }
+    case Json::booleanValue:
+      out->Append(jValue.asBool() ? "true" : "false");
+      break;
+    case Json::arrayValue:
+      out->Put('[');
+      for (Json::ArrayIndex i = 0; i < jValue.size(); ++i) {
+        if (i) out->Put(',');
+        AnyAppend(out, jValue[i]);
+      }
+      out->Put(']');
+      break;
+    case Json::objectValue:
+      out->Put('{');
+      for (auto it = jValue.begin(); it != jValue.end(); ++it) {
+        if (it != jValue.begin()) out->Put(',');
+        const char* e = nullptr;
+        const char* b = it.memberName(&e);
+        AnyAppendJsonString(out, b, e - b);
+        out->Put(':');
+        AnyAppend(out, *it);
+      }
+      out->Put('}');
+      break;
+  }
+}
+#endif
+
+#ifdef RAPIDJSON
+template <class J>
+typename std::enable_if<std::is_base_of<::rapidjson::Value, J>::value>::type
+AnyAppendHelper(FixedBuffer* out, const J* jValue) {
+  // level stack of writer lives in this buffer, not on heap
+  char stack[1024];
+  rapidjson::MemoryPoolAllocator<> allocator(stack, sizeof(stack));
+  rapidjson::Writer<FixedBuffer, rapidjson::UTF8<>, rapidjson::UTF8<>,
+                    rapidjson::MemoryPoolAllocator<>>
+      writer(*out, &allocator);
+  jValue->Accept(writer);
+}
+#endif
+
+template <class T1, class T2>
+void AnyAppend(FixedBuffer* out, const std::pair<T1, T2>& p) {
+  out->Put('{');
+  AnyAppend(out, p.first);
+  out->Append(", ", 2);
+  AnyAppend(out, p.second);
+  out->Put('}');
+}
+
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+template <class T1, class T2>
+void AnyAppend(FixedBuffer* out, const google::protobuf::MapPair<T1, T2>& p) {
+  out->Put('{');
+  AnyAppend(out, p.first);
+  out->Append(", ", 2);
+  AnyAppend(out, p.second);
+  out->Put('}');
+}
+#endif
+
+#if GOOGLE_PROTOBUF_VERSION >= 2000000
+template <class Pb>
+typename std::enable_if<
+    std::is_base_of<::google::protobuf::Message, Pb>::value>::type
+AnyAppendHelper(FixedBuffer* out, const Pb* pb) {
+  out->Append(pb->Utf8DebugString());
+}
+#endif
+
+#ifdef TENCENT_JCE
+template <class Jce>
+typename std::enable_if<std::is_base_of<taf::JceStructBase, Jce>::value>::type
+AnyAppendHelper(FixedBuffer* out, const Jce* jce) {
+  FixedStreamBuf sb(out);
+  std::ostream os(&sb);
+  jce->display(os);
+}
+#endif
+
+template <typename T>
+typename std::enable_if<HasToString<T>::value>::type AnyAppendHelper(
+    FixedBuffer* out, const T* t) {
+  out->Append(t->ToString());
+}
+
+template <typename It>
+void AnyAppendForRange(FixedBuffer* out, It begin, It end) {
+  out->Put('[');
+  for (It it = begin; it != end && !out->Full(); ++it) {
+    if (it != begin) out->Append(", ", 2);
+    AnyAppend(out, *it);
+  }
+  out->Put(']');
+}
+
+template <typename C>
+typename std::enable_if<HasBegin<C>::value>::type AnyAppendHelper(
+    FixedBuffer* out, const C* c) {
+  AnyAppendForRange(out, c->begin(), c->end());
+}
+
+template <typename T, size_t N>
+void AnyAppend(FixedBuffer* out, T (&array)[N]) {
+  AnyAppendForRange(out, array, array + N);
+}
+
+// fast paths print what operator<< prints
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value &&
+                        !std::is_same<T, bool>::value &&
+                        !std::is_same<T, char>::value &&
+                        !std::is_same<T, signed char>::value &&
+                        !std::is_same<T, unsigned char>::value>::type
+AnyAppendHelper(FixedBuffer* out, const T* t) {
+  char buf[24];
+  auto r = std::to_chars(buf, buf + sizeof(buf), *t);
+  out->Append(buf, r.ptr - buf);
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+AnyAppendHelper(FixedBuffer* out, const T* t) {
+  char buf[32];
+  int n = snprintf(buf, sizeof(buf), "%g", static_cast<double>(*t));
+  out->Append(buf, n);
+}
+
+template <typename T, typename... Arguments>
+void AnyAppendHelper(FixedBuffer* out, const T* t, const Arguments&...) {
+  FixedStreamBuf sb(out);
+  std::ostream os(&sb);
+  os << *t;
+}
+
+template <class T>
+void AnyAppend(FixedBuffer* out, const T& t) {
+  AnyAppendHelper(out, &t);
+}
+
+// JSON escape of c into esc, returns its length
+inline size_t JsonEscape(unsigned char c, char* esc) {
+  static const char hex[] = "0123456789abcdef";
+  switch (c) {
+    case '"':
+    case '\\':
+      esc[0] = '\\';
+      esc[1] = c;
+      return 2;
+    case '\n':
+      esc[0] = '\\';
+      esc[1] = 'n';
+      return 2;
+    case '\r':
+      esc[0] = '\\';
+      esc[1] = 'r';
+      return 2;
+    case '\t':
+      esc[0] = '\\';
+      esc[1] = 't';
+      return 2;
+    default:
+      if (c < 0x20) {
+        memcpy(esc, "\\u00", 4);
+        esc[4] = hex[c >> 4];
+        esc[5] = hex[c & 15];
+        return 6;
+      }
+      esc[0] = c;
+      return 1;
+  }
+}
+
+inline void AnyAppendJsonString(FixedBuffer* out, const char* s, size_t n) {
+  char esc[6];
+  out->Put('"');
+  for (size_t i = 0; i < n; ++i) out->Append(esc, JsonEscape(s[i], esc));
+  out->Put('"');
+}
+
+// Quote and escape in place what was appended since start. Unless always,
+// only done if it is empty or has a space, control char, '=' or '"', as
+// logfmt needs. The tail is cut if the quoted text does not fit.
+inline void QuoteSince(FixedBuffer* out, size_t start, bool always) {
+  char* s = out->Data() + start;
+  size_t len = out->Size() - start;
+  bool need = always || len == 0;
+  for (size_t i = 0; i < len && !need; ++i) {
+    unsigned char c = s[i];
+    need = c <= ' ' || c == '=' || c == '"';
+  }
+  if (!need) return;
+
+  size_t cap = len + out->Room();
+  if (cap < 2) return;
+  char esc[6];
+  size_t total = 2;
+  size_t k = 0;
+  for (; k < len; ++k) {
+    size_t w = JsonEscape(s[k], esc);
+    if (total + w > cap) break;
+    total += w;
+  }
+
+  // backwards, the escaped text of s[i] ends after s[i] so nothing unread
+  // is overwritten
+  char* d = s + total;
+  *--d = '"';
+  for (size_t i = k; i-- > 0;) {
+    size_t w = JsonEscape(s[i], esc);
+    d -= w;
+    memcpy(d, esc, w);
+  }
+  *--d = '"';
+  out->Resize(start + total);
+}
+
+}  // namespace tylib
+
+#endif  // TYLIB_STRING_ANY_APPEND_H_
@@ -0,0 +1,122 @@
+#include "tylib/string/any_append.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+class Dress {
+ public:
+  std::string ToString() const { return "{uin=0, id=defaultId}"; }
+};
+
+template <class T>
+std::string Append(const T& t) {
+  char buf[256];
+  tylib::FixedBuffer out(buf, sizeof(buf));
+  tylib::AnyAppend(&out, t);
+  return std::string(out.Data(), out.Size());
+}
+
+// same text as AnyToString
+TEST(AnyAppend, SameAsAnyToString) {
+  std::vector<Dress> dress(2);
+  EXPECT_EQ(Append(dress), tylib::AnyToString(dress));
+  EXPECT_EQ(Append(-123), tylib::AnyToString(-123));
+  EXPECT_EQ(Append(18446744073709551615ULL),
+            tylib::AnyToString(18446744073709551615ULL));
+  EXPECT_EQ(Append(2.5), tylib::AnyToString(2.5));
+  EXPECT_EQ(Append(true), tylib::AnyToString(true));
+  EXPECT_EQ(Append('c'), tylib::AnyToString('c'));
+  EXPECT_EQ(Append(std::make_pair(3, std::string("hello"))),
+            tylib::AnyToString(std::make_pair(3, std::string("hello"))));
+
+  std::map<int, std::list<int>> m = {{1, {2, 3}}, {4, {}}};
+  EXPECT_EQ(Append(m), tylib::AnyToString(m));
+  int arr[] = {1, 2};
+  EXPECT_EQ(Append(arr), "[1, 2]");
+  EXPECT_EQ(Append("literal"), "literal");
+}
+
+TEST(AnyAppend, Truncate) {
+  char buf[8];
+  tylib::FixedBuffer out(buf, sizeof(buf));
+  tylib::AnyAppend(&out, std::vector<int>{100, 200, 300});
+  EXPECT_EQ(std::string(out.Data(), out.Size()), "[100, 20");
+}
+
+TEST(AnyAppend, QuoteSince) {
+  char buf[32];
+  tylib::FixedBuffer out(buf, sizeof(buf));
+  out.Append("a=");
+  tylib::AnyAppend(&out, "x \"y\"\n");
+  tylib::QuoteSince(&out, 2, false);
+  EXPECT_EQ(std::string(out.Data(), out.Size()), "a=\"x \\\"y\\\"\\n\"");
+
+  tylib::FixedBuffer bare(buf, sizeof(buf));
+  tylib::AnyAppend(&bare, 42);
+  tylib::QuoteSince(&bare, 0, false);
+  EXPECT_EQ(std::string(bare.Data(), bare.Size()), "42");
+
+  // no room for all of it, still closed
+  char small[6];
+  tylib::FixedBuffer cut(small, sizeof(small));
+  tylib::AnyAppend(&cut, "abcdef");
+  tylib::QuoteSince(&cut, 0, true);
+  EXPECT_EQ(std::string(cut.Data(), cut.Size()), "\"abcd\"");
+}
+
+#ifdef JSONCPP
+// the text differs from Json::FastWriter in reals and escaping, pinned here
+TEST(AnyAppend, JsonCPP) {
+  Json::Value obj;
+  obj["b"]["real"] = 2.0;
+  obj["b"]["tenth"] = 0.1;
+  obj["a"] = "q\"\\ \x01\t\xc3\xa9";
+  obj["c"].append(-1);
+  obj["c"].append(Json::UInt64(18446744073709551615ULL));
+  obj["c"].append(true);
+  obj["c"].append(Json::Value());
+  EXPECT_EQ(Append(obj),
+            "{\"a\":\"q\\\"\\\\ \\u0001\\t\xc3\xa9\","
+            "\"b\":{\"real\":2,\"tenth\":0.10000000000000001},"
+            "\"c\":[-1,18446744073709551615,true,null]}");
+}
+#endif
+
+#ifdef RAPIDJSON
+TEST(AnyAppend, RapidJson) {
+  rapidjson::Document doc;
+  doc.Parse(
+      "{\"a\":\"q\\\"\\\\ \\u0001\\t\xc3\xa9\","
+      "\"b\":{\"real\":2.0,\"tenth\":0.1},"
+      "\"c\":[-1,18446744073709551615,true,null]}");
+  ASSERT_FALSE(doc.HasParseError());
+  std::string text = tylib::AnyToString(doc);
+  EXPECT_EQ(Append(doc), text);
+
+  // cut where the buffer ends
+  char small[8];
+  tylib::FixedBuffer cut(small, sizeof(small));
+  tylib::AnyAppend(&cut, doc);
+  EXPECT_EQ(std::string(cut.Data(), cut.Size()), text.substr(0, 8));
+
+  // writer's level stack outgrows the 1KB on stack, the pool takes heap
+  const int kDepth = 100;
+  std::string deep = std::string(kDepth, '[') + "1" + std::string(kDepth, ']');
+  rapidjson::Document nested;
+  nested.Parse(deep.c_str());
+  ASSERT_FALSE(nested.HasParseError());
+  char buf[1024];
+  tylib::FixedBuffer out(buf, sizeof(buf));
+  tylib::AnyAppend(&out, nested);
+  EXPECT_EQ(std::string(out.Data(), out.Size()), deep);
+  EXPECT_EQ(tylib::AnyToString(nested), deep);
+}
+#endif
+
+}  // namespace
@@ -0,0 +1,187 @@
+// The clocks of the process, by tier of precision and cost:
+//
+//   TIER_PRECISE  clock_gettime by the vDSO, ns
+//   TIER_COARSE   CLOCK_*_COARSE, as of the last kernel tick (1-4ms)
+//   TIER_TSC      rdtsc scaled to CLOCK_MONOTONIC, ns; PRECISE where the
+//                 TSC is not invariant or on other than x86-64
+//   TIER_CACHED   the reading of the last Clock::Update of the thread,
+//                 e.g. once per turn of its event loop; PRECISE before
+//                 the first
+//
+//   int64_t ns = tylib::Clock::MonotonicNs(tylib::Clock::TIER_TSC);
+//
+// The TSC scale is measured once, the first TIER_TSC read sleeps 10ms
+// for it. Each thread anchors it to CLOCK_MONOTONIC again every second,
+// so the drift stays in us and a step of the wall clock shows within a
+// second. A thread's TIER_TSC reads never go back.
+
+#ifndef TYLIB_TIME_CLOCK_H_
+#define TYLIB_TIME_CLOCK_H_
+
+#include <time.h>
+
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace tylib {
+
+class Clock {
+ public:
+  enum Tier { TIER_PRECISE, TIER_COARSE, TIER_TSC, TIER_CACHED };
+
+  // ns from 1970
+  static int64_t RealtimeNs(Tier tier = TIER_PRECISE) {
+    int64_t wall, mono;
+    if (tier == TIER_COARSE) return _Read(CLOCK_REALTIME_COARSE);
+    if (tier == TIER_PRECISE || !_Now(tier, &wall, &mono)) {
+      return _Read(CLOCK_REALTIME);
+    }
+    return wall;
+  }
+
+  // ns of CLOCK_MONOTONIC
+  static int64_t MonotonicNs(Tier tier = TIER_PRECISE) {
+    int64_t wall, mono;
+    if (tier == TIER_COARSE) return _Read(CLOCK_MONOTONIC_COARSE);
+    if (tier == TIER_PRECISE || !_Now(tier, &wall, &mono)) {
+      return _Read(CLOCK_MONOTONIC);
+    }
+    return mono;
+  }
+
+  // both, of one reading where the tier allows it, e.g. for Time
+  static void Now(Tier tier, int64_t* wallNs, int64_t* monoNs) {
+    if (tier == TIER_COARSE) {
+      *wallNs = _Read(CLOCK_REALTIME_COARSE);
+      *monoNs = _Read(CLOCK_MONOTONIC_COARSE);
+    } else if (tier == TIER_PRECISE || !_Now(tier, wallNs, monoNs)) {
+      *wallNs = _Read(CLOCK_REALTIME);
+      *monoNs = _Read(CLOCK_MONOTONIC);
+    }
+  }
+
+  // a precise reading for TIER_CACHED of the calling thread
+  static void Update() {
+    Cache& cache = _Cache();
+    cache.wall = _Read(CLOCK_REALTIME);
+    cache.mono = _Read(CLOCK_MONOTONIC);
+    cache.valid = true;
+  }
+
+  // constant rate TSC, the same across cores and C-states
+  static bool InvariantTsc() {
+#if defined(__x86_64__)
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+      return false;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1U << 8);
+#else
+    return false;
+#endif
+  }
+
+  // ns per 2^32 TSC ticks, 0 if TIER_TSC falls back to TIER_PRECISE
+  static uint64_t TscScale() {
+    static const uint64_t scale = _Calibrate();
+    return scale;
+  }
+
+ private:
+  struct Cache {
+    int64_t wall = 0;
+    int64_t mono = 0;
+    bool valid = false;
+  };
+
+  // TSC to CLOCK_MONOTONIC of a thread
+  struct Anchor {
+    uint64_t tsc = 0;
+    int64_t mono = 0;
+    int64_t offset = 0;  // wall minus mono
+    int64_t last = 0;    // mono last returned
+    bool valid = false;
+  };
+
+  static const int64_t kAnchorNs = 1000 * 1000 * 1000;
+
+  static int64_t _Read(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  static Cache& _Cache() {
+    static thread_local Cache cache;
+    return cache;
+  }
+
+  // false if the tier is PRECISE for now
+  static bool _Now(Tier tier, int64_t* wallNs, int64_t* monoNs) {
+    if (tier == TIER_CACHED) {
+      const Cache& cache = _Cache();
+      if (!cache.valid) return false;
+      *wallNs = cache.wall;
+      *monoNs = cache.mono;
+      return true;
+    }
+
+#if defined(__x86_64__)
+    const uint64_t scale = TscScale();
+    if (scale == 0) return false;
+
+    static thread_local Anchor anchor;
+    const uint64_t tsc = __rdtsc();
+    int64_t mono = anchor.mono + _Scale(tsc - anchor.tsc, scale);
+    if (!anchor.valid || tsc < anchor.tsc || mono - anchor.mono > kAnchorNs) {
+      anchor.tsc = __rdtsc();
+      anchor.mono = _Read(CLOCK_MONOTONIC);
+      anchor.offset = _Read(CLOCK_REALTIME) - anchor.mono;
+      anchor.valid = true;
+      mono = anchor.mono;
+    }
+    if (mono < anchor.last) mono = anchor.last;
+    anchor.last = mono;
+    *monoNs = mono;
+    *wallNs = mono + anchor.offset;
+    return true;
+#else
+    (void)wallNs;
+    (void)monoNs;
+    return false;
+#endif
+  }
+
+  static int64_t _Scale(uint64_t ticks, uint64_t scale) {
+    return static_cast<int64_t>(
+        (static_cast<unsigned __int128>(ticks) * scale) >> 32);
+  }
+
+  static uint64_t _Calibrate() {
+#if defined(__x86_64__)
+    if (!InvariantTsc()) return 0;
+
+    // a clock read and a TSC read on either side of a sleep
+    int64_t mono0 = _Read(CLOCK_MONOTONIC);
+    uint64_t tsc0 = __rdtsc();
+    struct timespec pause = {0, 10 * 1000 * 1000};
+    nanosleep(&pause, nullptr);
+    int64_t mono1 = _Read(CLOCK_MONOTONIC);
+    uint64_t tsc1 = __rdtsc();
+    if (tsc1 <= tsc0 || mono1 <= mono0) return 0;
+    return static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(mono1 - mono0) << 32) / (tsc1 - tsc0));
+#else
+    return 0;
+#endif
+  }
+};
+
+}  // namespace tylib
+
+#endif  // TYLIB_TIME_CLOCK_H_
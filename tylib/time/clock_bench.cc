@@ -0,0 +1,177 @@
+// Cost and resolution of the clock reads, by tier and by the ways the
+// code read the clock before tylib::Clock.
+//
+// usage: clock_bench [-n reads] [-t threads]
+//
+// Each read is timed as a loop of n reads on -t threads at once, ns per
+// read is of one thread. step is the smallest non zero change between two
+// reads in a row, how fine the clock is. TSC scale and whether the TSC is
+// invariant are printed first; without it the TSC tier is the precise one.
+
+#include <getopt.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "tylib/log/log.h"
+#include "tylib/time/clock.h"
+#include "tylib/time/timer.h"
+
+namespace {
+
+using tylib::Clock;
+
+struct Read {
+  const char* name;
+  int64_t (*fn)();  // a clock value, in its own unit
+};
+
+uint64_t NowNs() { return Clock::MonotonicNs(); }
+
+// the us of a log line stamp, YYYY-MM-DD HH:MM:SS.uuuuuu
+int64_t StampUs(const char* buf) {
+  int64_t us = 0;
+  for (int i = 20; i < tylib::mlog::kTimeLen; ++i) us = us * 10 + buf[i] - '0';
+  return us;
+}
+
+// ns per read of one thread, the smallest step it saw
+void Measure(const Read& read, int n, double* nsPerRead, int64_t* step) {
+  int64_t last = read.fn();
+  int64_t minStep = 0;
+  int64_t sink = 0;
+  uint64_t begin = NowNs();
+  for (int i = 0; i < n; ++i) {
+    int64_t v = read.fn();
+    int64_t d = v - last;
+    if (d > 0 && (minStep == 0 || d < minStep)) minStep = d;
+    last = v;
+    sink += v;
+  }
+  *nsPerRead = static_cast<double>(NowNs() - begin) / n;
+  *step = minStep;
+  if (sink == 42) printf(" ");
+}
+
+void Run(const Read& read, int n, int threads) {
+  std::vector<double> ns(threads);
+  std::vector<int64_t> steps(threads);
+  std::vector<std::thread> workers;
+  std::atomic<int> ready{0};
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      Clock::Update();  // as a loop turn would
+      ++ready;
+      while (ready < threads) {
+      }
+      Measure(read, n, &ns[t], &steps[t]);
+    });
+  }
+  for (auto& w : workers) w.join();
+
+  double sum = 0;
+  int64_t step = 0;
+  for (int t = 0; t < threads; ++t) {
+    sum += ns[t];
+    if (steps[t] > 0 && (step == 0 || steps[t] < step)) step = steps[t];
+  }
+  printf("%-26s %8.1f %12lld\n", read.name, sum / threads,
+         static_cast<long long>(step));
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int n = 10 * 1000 * 1000;
+  int threads = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        n = atoi(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n reads] [-t threads]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  printf("invariant tsc %s, %.4f ns per tick\n",
+         Clock::InvariantTsc() ? "yes" : "no",
+         Clock::TscScale() / 4294967296.0);
+
+  const std::vector<Read> reads = {
+      // before
+      {"gettimeofday us",
+       [] {
+         struct timeval tv;
+         gettimeofday(&tv, nullptr);
+         return static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+       }},
+      {"system_clock ms (old)",
+       [] {
+         return static_cast<int64_t>(
+             std::chrono::duration_cast<std::chrono::milliseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count());
+       }},
+      // the tiers
+      {"realtime precise ns", [] { return Clock::RealtimeNs(); }},
+      {"monotonic precise ns", [] { return Clock::MonotonicNs(); }},
+      {"realtime coarse ns",
+       [] { return Clock::RealtimeNs(Clock::TIER_COARSE); }},
+      {"monotonic coarse ns",
+       [] { return Clock::MonotonicNs(Clock::TIER_COARSE); }},
+      {"realtime tsc ns", [] { return Clock::RealtimeNs(Clock::TIER_TSC); }},
+      {"monotonic tsc ns",
+       [] { return Clock::MonotonicNs(Clock::TIER_TSC); }},
+      {"monotonic cached ns",
+       [] { return Clock::MonotonicNs(Clock::TIER_CACHED); }},
+      // built on them
+      {"g_now_ms", [] { return static_cast<int64_t>(g_now_ms); }},
+      {"Time precise us",
+       [] {
+         Time t;
+         return t.MonotonicUs();
+       }},
+      {"Time tsc us",
+       [] {
+         static thread_local Time t;
+         t.ComputeNow(Clock::TIER_TSC);
+         return t.MonotonicUs();
+       }},
+      {"Time cached us",
+       [] {
+         static thread_local Time t;
+         t.ComputeNow(Clock::TIER_CACHED);
+         return t.MonotonicUs();
+       }},
+      {"log stamp precise",
+       [] {
+         char buf[tylib::mlog::kTimeLen];
+         tylib::mlog::FormatNow(buf);
+         return StampUs(buf);
+       }},
+      {"log stamp tsc",
+       [] {
+         char buf[tylib::mlog::kTimeLen];
+         tylib::mlog::FormatNow(buf, Clock::TIER_TSC);
+         return StampUs(buf);
+       }},
+  };
+
+  printf("%-26s %8s %12s\n", "read", "ns/read", "step");
+  for (const Read& read : reads) Run(read, n, threads);
+  return 0;
+}
@@ -0,0 +1,52 @@
+#include "tylib/time/clock.h"
+
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "tylib/time/timer.h"
+
+namespace {
+
+using tylib::Clock;
+
+TEST(Clock, TiersAgree) {
+  const int64_t ms = 1000 * 1000;
+  Clock::TscScale();  // the first TSC read sleeps to calibrate
+  const int64_t wall = Clock::RealtimeNs();
+  const int64_t mono = Clock::MonotonicNs();
+  EXPECT_NEAR(Clock::RealtimeNs(Clock::TIER_COARSE), wall, 20 * ms);
+  EXPECT_NEAR(Clock::MonotonicNs(Clock::TIER_COARSE), mono, 20 * ms);
+  EXPECT_NEAR(Clock::RealtimeNs(Clock::TIER_TSC), wall, 5 * ms);
+  EXPECT_NEAR(Clock::MonotonicNs(Clock::TIER_TSC), mono, 5 * ms);
+  EXPECT_NEAR(g_now_ms, wall / ms, 20);
+}
+
+TEST(Clock, TscNeverGoesBack) {
+  int64_t last = Clock::MonotonicNs(Clock::TIER_TSC);
+  for (int i = 0; i < 100000; ++i) {
+    int64_t now = Clock::MonotonicNs(Clock::TIER_TSC);
+    ASSERT_GE(now, last);
+    last = now;
+  }
+}
+
+TEST(Clock, CachedIsTheLastUpdate) {
+  std::thread([] {
+    // before an Update of the thread, a precise read
+    EXPECT_NEAR(Clock::MonotonicNs(Clock::TIER_CACHED), Clock::MonotonicNs(),
+                1000 * 1000);
+
+    Clock::Update();
+    const int64_t mono = Clock::MonotonicNs(Clock::TIER_CACHED);
+    const int64_t wall = Clock::RealtimeNs(Clock::TIER_CACHED);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    EXPECT_EQ(Clock::MonotonicNs(Clock::TIER_CACHED), mono);
+
+    Time now;
+    now.ComputeNow(Clock::TIER_CACHED);
+    EXPECT_EQ(now.MonotonicUs(), mono / 1000);
+    EXPECT_EQ(now.MicroSeconds(), wall / 1000);
+  }).join();
+}
+
+}  // namespace
@@ -0,0 +1,71 @@
+#ifndef TYLIB_TIME_MPSC_QUEUE_H_
+#define TYLIB_TIME_MPSC_QUEUE_H_
+
+#include <atomic>
+
+namespace tylib {
+
+struct MpscNode {
+  std::atomic<MpscNode*> next{nullptr};
+};
+
+// Intrusive unbounded queue, many producers and one consumer (Vyukov).
+// Push is one exchange and never waits. Pop may return nullptr while a
+// push is half done, the node shows up on a later Pop.
+class MpscQueue {
+ public:
+  MpscQueue() : m_head(&m_stub), m_tail(&m_stub) {}
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  // any thread
+  void Push(MpscNode* node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    MpscNode* prev = m_head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // consumer thread only
+  MpscNode* Pop() {
+    MpscNode* tail = m_tail;
+    MpscNode* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &m_stub) {
+      if (!next) return nullptr;
+      m_tail = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+      m_tail = next;
+      return tail;
+    }
+    if (tail != m_head.load(std::memory_order_acquire)) return nullptr;
+
+    // tail is the last node, the stub goes behind it so it can be taken
+    Push(&m_stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+      m_tail = next;
+      return tail;
+    }
+    return nullptr;
+  }
+
+  // Consumer thread only. False if a Pop may return a node, true may miss
+  // a push still half done, as Pop does. The head is no hint: Pop puts the
+  // stub there while nodes behind its tail wait for a half done push.
+  bool Empty() const {
+    return m_tail == &m_stub &&
+           m_stub.next.load(std::memory_order_acquire) == nullptr;
+  }
+
+ private:
+  std::atomic<MpscNode*> m_head;  // last pushed
+  MpscNode* m_tail;               // next to pop
+  MpscNode m_stub;
+};
+
+}  // namespace tylib
+
+#endif  // TYLIB_TIME_MPSC_QUEUE_H_
@@ -3,23 +3,43 @@
 
 #include <sys/time.h>
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <ctime>
-#include <mutex>
+#include <limits>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "tylib/time/clock.h"
+#include "tylib/time/mpsc_queue.h"
+
+// Build with -DTYLIB_TIMER_STATS, everywhere as it changes the layout of
+// the wheels, for BasicTimerManager::GetStats. Without it nothing is kept.
+#ifdef TYLIB_TIMER_STATS
+#define TYLIB_TIMER_STAT(...) __VA_ARGS__
+#else
+#define TYLIB_TIMER_STAT(...)
+#endif
+
 // extern Time g_now;
 // #define g_now_ms g_now.MilliSeconds()
 
-// https://stackoverflow.com/questions/19555121/how-to-get-current-timestamp-in-milliseconds-since-1970-just-the-way-java-gets
-// Maybe you want store nowMs in one loop process to avoid call each time.
-#define g_now_ms                                           \
-  std::chrono::duration_cast<std::chrono::milliseconds>(   \
-      std::chrono::system_clock::now().time_since_epoch()) \
-      .count()
+// ms from 1970 as of the last kernel tick, a few ns a read. For one value
+// per loop turn, Time::ComputeNow(tylib::Clock::TIER_CACHED).
+#define g_now_ms \
+  (tylib::Clock::RealtimeNs(tylib::Clock::TIER_COARSE) / 1000000)
 
+// A reading of the wall clock, and of CLOCK_MONOTONIC with it. The
+// wheels tick on the monotonic one, steps of the wall clock by NTP or by
+// hand do not move it.
 class Time {
  public:
   Time();
@@ -27,11 +47,17 @@ class Time {
   // OPT: year month day, and Effective cpp item 18
   Time(int hour, int min, int sec);
 
-  void ComputeNow();
+  // given readings, e.g. of a virtual clock
+  Time(int64_t wallUs, int64_t monoUs);
+
+  void ComputeNow(tylib::Clock::Tier tier = tylib::Clock::TIER_PRECISE);
   int64_t MilliSeconds() const { return m_ms; }
   int64_t MicroSeconds() const { return m_us; }
+  int64_t MonotonicMs() const { return m_mono / 1000; }
+  int64_t MonotonicUs() const { return m_mono; }
   const char* FormatTime(char* buf, int size) const;
   void AddDelay(uint64_t delay);
+  void AddDelayUs(uint64_t delay);  // for wheels of sub ms ticks
 
   int GetYear() const {
     _UpdateTm();
@@ -65,6 +91,7 @@ class Time {
  private:
   int64_t m_ms;  // milliseconds from 1970
   int64_t m_us;
+  int64_t m_mono;  // us of CLOCK_MONOTONIC
   mutable tm m_tm;
   mutable bool m_valid;
 
@@ -73,69 +100,795 @@ class Time {
 
 extern Time g_now;  // for compatibility
 
-class Timer {
-  friend class TimerManager;
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+class BasicTimerManager;
+
+// 1ms ticks, 256 slots then 4 levels of 64, about 49 days
+typedef BasicTimerManager<1000, 8, 6, 5> TimerManager;
+
+// handle of a timer of TimerManager::Schedule, 0 is none
+typedef uint64_t TimerId;
+
+// intrusive link of a Timer, the list heads of TimerManager are bare links
+struct TimerLink {
+  TimerLink* m_next = nullptr;
+  TimerLink* m_prev = nullptr;
+};
+
+// 56 bytes on LP64: link, expiry, interval, count, slack, jump policy
+// and owner
+class Timer : private TimerLink {
+  template <int, int, int, int>
+  friend class BasicTimerManager;
 
  public:
+  // what a step of the wall clock does to the timer
+  enum ClockJump : uint8_t {
+    JUMP_IGNORE,    // due once its time elapsed, the default
+    JUMP_REANCHOR,  // due when the wall clock reads its time
+    JUMP_SPREAD,    // as REANCHOR, but the ones a step made due are spread
+  };
+
   explicit Timer(uint32_t interval = uint32_t(-1), int32_t count = -1);
   virtual ~Timer() {}
   bool OnTimer();
   void SetRemainCnt(int32_t remain) { m_count = remain; }
 
+  // may fire up to slack ms late, so timers due close together fire in
+  // one tick, see TimerManager::AddTimer. Kept for the repeats.
+  void SetSlack(uint32_t slack) { m_slack = slack; }
+
+  // before ScheduleAt, see TimerManager::SetJumpThreshold
+  void SetClockJump(ClockJump policy) { m_jump = policy; }
+
+  // wheel the timer was last added to, from any thread. M is the type
+  // of that wheel.
+  template <class M = TimerManager>
+  M* Owner() const {
+    return static_cast<M*>(__atomic_load_n(&m_owner, __ATOMIC_ACQUIRE));
+  }
+
  private:
   // if return false, never execute the timer task
   virtual bool _OnTimer() { return false; }
 
-  Timer* m_next;
-  Timer* m_prev;
-  Time m_triggerTime;
+  int64_t m_expire;  // us of CLOCK_MONOTONIC it fires at
   uint32_t m_interval;
   int32_t m_count;
+  uint32_t m_slack;
+  ClockJump m_jump;
+  void* m_owner;
 };
 
-class TimerManager {
+// A hierarchical timing wheel: a first level of 2^List1Bits slots of
+// TickUs us, then Levels - 1 levels of 2^ListBits slots, each slot as
+// long as the whole level below it. A timer fires in the tick its expiry
+// falls in. The default TimerManager has 1ms ticks, a pacer may want
+// BasicTimerManager<100, 8, 6, 5>, a coarse one <10000, 6, 6, 5>, whose
+// first level of 64 links fits in 1KB.
+//
+// A wheel ticks on CLOCK_MONOTONIC. ScheduleAt takes the monotonic part
+// of the Time, so a timer is due after the time elapsed whatever the wall
+// clock does. A timer of JUMP_REANCHOR or JUMP_SPREAD is instead due when
+// the wall clock reads its time: when UpdateTimers sees the wall clock
+// step by more than SetJumpThreshold against the monotonic one, those
+// timers move with it.
+//
+// A wheel is driven by one thread, its owner: the first to call
+// UpdateTimers, or the thread of Local(). ScheduleAt, AddTimer and
+// KillTimer are for the owner only. Other threads use the Async calls,
+// which queue a command run by the owner in its next UpdateTimers. A timer
+// is in one wheel at a time and stays alive until its commands ran.
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+class BasicTimerManager {
+  static_assert(TickUs > 0 && List1Bits > 0 && ListBits > 0 && Levels >= 2,
+                "bad wheel geometry");
+  static_assert(List1Bits + (Levels - 1) * ListBits <= 62,
+                "wheel horizon overflows the tick");
+
  public:
-  ~TimerManager();
+  static const int TICK_US = TickUs;
+
+  BasicTimerManager()
+      : m_thread(std::thread::id()),
+        m_freeSlot(NO_SLOT),
+        m_jumpUs(500 * 1000),
+        m_spreadUs(1000 * 1000) {
+    Time now;
+    m_lastCheck = now.MonotonicUs() / TICK_US;
+    m_offset = now.MicroSeconds() - now.MonotonicUs();
+    memset(m_bits, 0, sizeof(m_bits));
+    TYLIB_TIMER_STAT(ResetStats());
+  }
+
+  ~BasicTimerManager() {
+    // timers of queued commands are not touched, they may be gone
+    while (tylib::MpscNode* node = m_commands.Pop()) {
+      delete static_cast<Command*>(node);
+    }
 
+    for (int level = 0; level < LEVELS; ++level) {
+      TimerLink* list = _List(level);
+      for (int i = 0; i < _Size(level); ++i) {
+        while (list[i].m_next != nullptr) _Unlink(_Of(list[i].m_next));
+      }
+    }
+
+    for (Slot* slab : m_slabs) {
+      for (uint32_t i = 0; i < SLAB_SIZE; ++i) {
+        if (slab[i].m_fn) slab[i].m_destroy(slab[i].m_fn);
+      }
+      delete[] slab;
+    }
+  }
+
+  BasicTimerManager(const BasicTimerManager&) = delete;
+  BasicTimerManager& operator=(const BasicTimerManager&) = delete;
+
+  // fire timers due at now, ticks with nothing to do are skipped
   bool UpdateTimers(const Time& now);
-  void ScheduleAt(Timer* pTimer, const Time& triggerTime);
-  void AddTimer(Timer* pTimer);
-  void AsyncAddTimer(Timer* pTimer);
-  void KillTimer(Timer* pTimer);
 
-  static TimerManager* Instance() {
-    static TimerManager mgr;
+  // Monotonic ms of the earliest timer, rounded up, -1 if none, e.g. for
+  // the timeout of epoll_wait against Time::MonotonicMs(). Queued commands
+  // of other threads are not seen.
+  int64_t NextExpiry() const {
+    int64_t us = NextExpiryUs();
+    return us < 0 ? -1 : (us + 999) / 1000;
+  }
+
+  // monotonic us of the start of the tick of the earliest timer, -1 if
+  // none
+  int64_t NextExpiryUs() const;
+
+  void ScheduleAt(Timer* pTimer, const Time& triggerTime) {
+    if (!pTimer) return;
+
+    _SetExpire(pTimer, triggerTime.MicroSeconds(), triggerTime.MonotonicUs());
+    AddTimer(pTimer);
+  }
+
+  void AddTimer(Timer* pTimer) {
+    TYLIB_TIMER_STAT(++m_stats.added);
+    _AddTimer(pTimer);
+  }
+
+  // With slack the timer fires at the tick of [expiry, expiry + slack]
+  // with the most low zero bits, the same tick for nearby timers, so they
+  // share a slot and a wakeup. The repeats keep the slack but not the
+  // delay, they are due an interval after the exact expiry.
+  void ScheduleAt(Timer* pTimer, const Time& triggerTime, uint32_t slack) {
+    if (!pTimer) return;
+
+    pTimer->m_slack = slack;
+    ScheduleAt(pTimer, triggerTime);
+  }
+
+  void AddTimer(Timer* pTimer, uint32_t slack) {
+    if (!pTimer) return;
+
+    pTimer->m_slack = slack;
+    AddTimer(pTimer);
+  }
+
+  // if pTimer is never added, no effect
+  void KillTimer(Timer* pTimer) {
+    TYLIB_TIMER_STAT(if (pTimer && pTimer->m_prev) ++m_stats.killed);
+    _Unlink(pTimer);
+  }
+
+  // A timer owned by the wheel: fn() runs delay ms after the wheel's
+  // clock, then every interval ms, count times in all, -1 forever. fn is
+  // kept in a slab node, allocated only if bigger than kInlineSize. 0 if
+  // count is 0. Owner thread only, like AddTimer.
+  template <class F>
+  TimerId Schedule(uint32_t delay, uint32_t interval, int32_t count, F&& fn);
+
+  // false if id fired its last time or was cancelled, also from inside
+  // its own fn
+  bool Cancel(TimerId id) {
+    Slot* pSlot = _FindSlot(id);
+    if (!pSlot) return false;
+
+    if (pSlot->m_running) {
+      pSlot->m_cancelled = true;
+    } else {
+      _FreeSlot(pSlot);
+    }
+    return true;
+  }
+
+  static const size_t kInlineSize = 48;
+
+  // A wall clock step of more than ms, against the monotonic clock, moves
+  // the timers of JUMP_REANCHOR and JUMP_SPREAD; 500 by default.
+  void SetJumpThreshold(uint32_t ms) { m_jumpUs = ms * 1000LL; }
+
+  // the JUMP_SPREAD timers a step made due fire evenly over ms from the
+  // step on, not in one burst; 1000 by default
+  void SetJumpSpread(uint32_t ms) { m_spreadUs = ms * 1000LL; }
+
+#ifdef TYLIB_TIMER_STATS
+  // What the wheel did since it was built or ResetStats. Added and killed
+  // are of the API, not the moves of cascades and repeats.
+  struct Stats {
+    static const int LATE_BUCKETS = 32;
+
+    uint64_t ticks;    // run, a slot fired or cascaded
+    uint64_t jumps;    // wall clock steps seen
+    uint64_t skipped;  // empty ticks jumped over
+    uint64_t fired;
+    uint64_t added;
+    uint64_t killed;
+    uint64_t maxFired;  // in one tick
+
+    uint64_t cascades[Levels];  // by level cascaded, 0 is unused
+    uint64_t moved[Levels];     // timers they moved down
+
+    uint64_t longestChain;  // of a slot, when it fired or cascaded
+
+    // us fired after m_expire, slack included: [0] on time, [i] from
+    // 2^(i-1) to below 2^i, the last one beyond
+    uint64_t late[LATE_BUCKETS];
+    int64_t maxLate;
+  };
+
+  // a copy, on the owner thread or one Posted to it
+  Stats GetStats() const { return m_stats; }
+  void ResetStats() { memset(&m_stats, 0, sizeof(m_stats)); }
+#endif
+
+  // any thread, run at once on the owner thread
+  void AsyncAddTimer(Timer* pTimer) { _Post(CMD_ADD, pTimer, nullptr); }
+  void AsyncScheduleAt(Timer* pTimer, const Time& triggerTime) {
+    _Post(CMD_SCHEDULE, pTimer, &triggerTime);
+  }
+  void AsyncKillTimer(Timer* pTimer) { _Post(CMD_KILL, pTimer, nullptr); }
+
+  bool IsOwnerThread() const {
+    return m_thread.load(std::memory_order_acquire) ==
+           std::this_thread::get_id();
+  }
+
+  // process-wide wheel, for a single event loop
+  static BasicTimerManager* Instance() {
+    static BasicTimerManager mgr;
+    return &mgr;
+  }
+
+  // wheel of the calling thread, gone with the thread
+  static BasicTimerManager* Local() {
+    static thread_local BasicTimerManager mgr;
+    mgr._BindThread();
     return &mgr;
   }
 
  private:
-  TimerManager() : m_count(0) {}
+  enum CommandType { CMD_ADD, CMD_SCHEDULE, CMD_KILL };
+
+  // node of a Schedule'd timer, fn is in m_buf or on the heap
+  class Slot : public Timer {
+   public:
+    void* m_fn = nullptr;
+    void (*m_invoke)(void*) = nullptr;
+    void (*m_destroy)(void*) = nullptr;
+    uint32_t m_gen = 1;       // bumped on free, stale ids miss
+    uint32_t m_index = 0;     // in the slabs
+    uint32_t m_nextFree = 0;  // index, while free
+    bool m_running = false;
+    bool m_cancelled = false;
+    alignas(std::max_align_t) unsigned char m_buf[kInlineSize];
 
-  bool _Cacsade(Timer pList[], int index);
-  int _Index(int level);
+   private:
+    bool _OnTimer() override {
+      return Owner<BasicTimerManager>()->_RunSlot(this);
+    }
+  };
 
-  static const int LIST1_BITS = 8;
-  static const int LIST_BITS = 6;
+  struct Command : tylib::MpscNode {
+    CommandType type;
+    Timer* timer;
+    int64_t wall;
+    int64_t mono;
+  };
+
+  static const int LIST1_BITS = List1Bits;
+  static const int LIST_BITS = ListBits;
   static const int LIST1_SIZE = 1 << LIST1_BITS;
   static const int LIST_SIZE = 1 << LIST_BITS;
+  static const int LEVELS = Levels;
+  static const int WORDS = ((LIST1_SIZE > LIST_SIZE ? LIST1_SIZE : LIST_SIZE) +
+                            63) / 64;
+
+  // A timer anchored to the wall clock is converted at the offset of the
+  // last UpdateTimers, not of a clock read here, which is not the clock of
+  // a wheel driven by a virtual Time. A step since is found by the next
+  // UpdateTimers and moves this timer with the others.
+  void _SetExpire(Timer* pTimer, int64_t wall, int64_t mono) {
+    if (pTimer->m_jump == Timer::JUMP_IGNORE) {
+      pTimer->m_expire = mono;
+      return;
+    }
+    pTimer->m_expire = wall - m_offset;
+  }
+
+  // moves the anchored timers if the wall clock stepped
+  void _CheckJump(const Time& now) {
+    const int64_t offset = now.MicroSeconds() - now.MonotonicUs();
+    const int64_t step = offset - m_offset;
+    m_offset = offset;  // slews too
+    if (step > m_jumpUs || step < -m_jumpUs) _OnJump(step, now.MonotonicUs());
+  }
+
+  void _OnJump(int64_t step, int64_t nowUs);
+
+  void _BindThread() {
+    std::thread::id none;
+    m_thread.compare_exchange_strong(none, std::this_thread::get_id());
+  }
+
+  void _Post(CommandType type, Timer* pTimer, const Time* triggerTime);
+
+  // in order of posting per thread
+  void _RunCommands() {
+    while (tylib::MpscNode* node = m_commands.Pop()) {
+      Command* cmd = static_cast<Command*>(node);
+      if (cmd->type == CMD_ADD) {
+        AddTimer(cmd->timer);
+      } else if (cmd->type == CMD_SCHEDULE) {
+        _SetExpire(cmd->timer, cmd->wall, cmd->mono);
+        AddTimer(cmd->timer);
+      } else {
+        KillTimer(cmd->timer);
+      }
+      delete cmd;
+    }
+  }
+
+  Slot* _AllocSlot();
+
+  void _FreeSlot(Slot* pSlot) {
+    KillTimer(pSlot);
+    pSlot->m_destroy(pSlot->m_fn);
+    pSlot->m_fn = nullptr;
+    pSlot->m_cancelled = false;
+    if (++pSlot->m_gen == 0) pSlot->m_gen = 1;
+    pSlot->m_nextFree = m_freeSlot;
+    m_freeSlot = pSlot->m_index;
+  }
+
+  // id is the generation over the index
+  Slot* _FindSlot(TimerId id) {
+    const uint32_t index = id & 0xffffffff;
+    if ((index >> SLAB_BITS) >= m_slabs.size()) return nullptr;
+
+    Slot* pSlot = &m_slabs[index >> SLAB_BITS][index & (SLAB_SIZE - 1)];
+    if (!pSlot->m_fn || pSlot->m_cancelled || pSlot->m_gen != (id >> 32)) {
+      return nullptr;
+    }
+    return pSlot;
+  }
+
+  TimerId _StartSlot(Slot* pSlot, uint32_t delay, uint32_t interval,
+                     int32_t count) {
+    pSlot->m_interval = interval;
+    pSlot->m_count = count;
+    pSlot->m_expire = m_lastCheck * TICK_US + delay * 1000LL;
+    AddTimer(pSlot);
+    return (static_cast<TimerId>(pSlot->m_gen) << 32) | pSlot->m_index;
+  }
+
+  // fn may Schedule or Cancel, itself too: the slot is freed after it
+  bool _RunSlot(Slot* pSlot) {
+    pSlot->m_running = true;
+    pSlot->m_invoke(pSlot->m_fn);
+    pSlot->m_running = false;
+
+    if (pSlot->m_cancelled || pSlot->m_count == 0) {
+      _FreeSlot(pSlot);
+      return false;
+    }
+    return true;
+  }
+
+  static Timer* _Of(TimerLink* link) { return static_cast<Timer*>(link); }
+
+  // AddTimer and KillTimer, uncounted, for the moves of the wheel itself
+  void _AddTimer(Timer* pTimer);
+
+  void _Unlink(Timer* pTimer) {
+    if (pTimer && pTimer->m_prev) {
+      TimerLink* prev = pTimer->m_prev;
+      prev->m_next = pTimer->m_next;
+
+      if (nullptr != pTimer->m_next) {
+        pTimer->m_next->m_prev = pTimer->m_prev;
+      } else if (!prev->m_prev && !prev->m_next) {
+        _Emptied(prev);  // only list heads have no m_prev
+      }
+
+      pTimer->m_prev = nullptr;
+      pTimer->m_next = nullptr;
+    }
+  }
+
+  bool _Cacsade(TimerLink pList[], int index);
 
-  Time m_lastCheckTime;
+  int _Index(int level) const {
+    return (m_lastCheck >> _Shift(level + 1)) & (LIST_SIZE - 1);
+  }
+
+  // level 0 is m_list1
+  TimerLink* _List(int level) const {
+    return const_cast<TimerLink*>(level ? m_lists[level - 1] : m_list1);
+  }
+  static constexpr int _Size(int level) {
+    return level ? LIST_SIZE : LIST1_SIZE;
+  }
+  static constexpr int _Shift(int level) {
+    return level ? LIST1_BITS + (level - 1) * LIST_BITS : 0;
+  }
+
+  void _SetBit(int level, int index) {
+    m_bits[level][index >> 6] |= 1ULL << (index & 63);
+  }
+  void _ClearBit(int level, int index) {
+    m_bits[level][index >> 6] &= ~(1ULL << (index & 63));
+  }
+  bool _Occupied(int level, int index) const {
+    return m_bits[level][index >> 6] & (1ULL << (index & 63));
+  }
+
+  // slots from index on, wrapping, to the first occupied one; -1 if none
+  int _Distance(int level, int index) const;
+
+  // empty list head, its bit is cleared
+  void _Emptied(TimerLink* pListHead) {
+    for (int level = 0; level < LEVELS; ++level) {
+      TimerLink* list = _List(level);
+      if (pListHead >= list && pListHead < list + _Size(level)) {
+        _ClearBit(level, pListHead - list);
+        return;
+      }
+    }
+  }
+
+  // tick a timer fires at, its expiry moved by its slack
+  static int64_t _Tick(const Timer* pTimer) {
+    const int64_t tick = pTimer->m_expire / TICK_US;
+    const int64_t slack = pTimer->m_slack * 1000LL / TICK_US;
+    if (slack == 0) return tick;
+
+    // the highest bit that differs, cleared below in the limit
+    const int64_t limit = tick + slack;
+    const int bit = 63 - __builtin_clzll(tick ^ limit);
+    return limit & ~((1LL << bit) - 1);
+  }
+
+  // first tick from tick on with a timer to fire or a slot to cascade
+  int64_t _NextTick(int64_t tick) const;
+
+  int64_t m_lastCheck;  // next tick to run, TICK_US from 1970
+
+  TimerLink m_list1[LIST1_SIZE];
+  TimerLink m_lists[LEVELS - 1][LIST_SIZE];
+
+  // bit of a non-empty list per level
+  uint64_t m_bits[LEVELS][WORDS];
+
+  std::atomic<std::thread::id> m_thread;  // owner
+  tylib::MpscQueue m_commands;             // of other threads
+
+  static const uint32_t SLAB_BITS = 8;
+  static const uint32_t SLAB_SIZE = 1 << SLAB_BITS;
+  static const uint32_t NO_SLOT = uint32_t(-1);
+
+  std::vector<Slot*> m_slabs;  // of SLAB_SIZE slots, never moved
+  uint32_t m_freeSlot;         // head of the free list
 
-  Timer m_list1[LIST1_SIZE];  // 256 ms
-  Timer m_list2[LIST_SIZE];   // 64 * 256ms = 16秒
-  Timer m_list3[LIST_SIZE];   // 64 * 64 * 256ms = 17分钟
-  Timer m_list4[LIST_SIZE];   // 64 * 64 * 64 * 256ms = 18 小时
-  Timer m_list5[LIST_SIZE];   // 64 * 64 * 64 * 64 * 256ms = 49 天
+  int64_t m_offset;  // wall us minus monotonic us, as last seen
+  int64_t m_jumpUs;
+  int64_t m_spreadUs;
 
-  std::mutex m_lock;  // protect m_timers
-  std::vector<Timer*> m_timers;
-  volatile std::atomic_int m_count;  // count size of m_timers
+#ifdef TYLIB_TIMER_STATS
+  void _CountFired(const Timer* pTimer, const Time& now) {
+    ++m_stats.fired;
+    const int64_t late = now.MonotonicUs() - pTimer->m_expire;
+    int bucket = late > 0 ? 64 - __builtin_clzll(late) : 0;
+    if (bucket >= Stats::LATE_BUCKETS) bucket = Stats::LATE_BUCKETS - 1;
+    ++m_stats.late[bucket];
+    if (late > m_stats.maxLate) m_stats.maxLate = late;
+  }
+
+  void _CountChain(uint64_t n) {
+    if (n > m_stats.longestChain) m_stats.longestChain = n;
+  }
+
+  void _CountCascade(const TimerLink pList[], uint64_t n) {
+    for (int level = 1; level < LEVELS; ++level) {
+      if (pList != _List(level)) continue;
+      ++m_stats.cascades[level];
+      m_stats.moved[level] += n;
+    }
+    _CountChain(n);
+  }
+
+  Stats m_stats;
+#endif
 };
 
-inline int TimerManager::_Index(int level) {
-  int64_t current = m_lastCheckTime.MilliSeconds();
-  current >>= (LIST1_BITS + level * LIST_BITS);
-  return current & (LIST_SIZE - 1);
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+bool BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::UpdateTimers(
+    const Time& now) {
+  _BindThread();
+  if (!m_commands.Empty()) _RunCommands();
+  _CheckJump(now);
+
+  const int64_t nowTick = now.MonotonicUs() / TICK_US;
+  const bool hasUpdated(m_lastCheck <= nowTick);
+
+  while (m_lastCheck <= nowTick) {
+    int64_t tick = m_lastCheck;
+    int index = tick & (LIST1_SIZE - 1);
+    if (index != 0 && !_Occupied(0, index)) {
+      int64_t next = _NextTick(tick);
+      if (next > nowTick) next = nowTick + 1;
+      TYLIB_TIMER_STAT(m_stats.skipped += next - tick);
+      m_lastCheck = next;
+      continue;
+    }
+
+    // a level is cascaded when the one below it wraps
+    for (int level = 1; index == 0 && level < LEVELS; ++level) {
+      int i = _Index(level - 1);
+      _Cacsade(_List(level), i);
+      if (i != 0) break;
+    }
+
+    ++m_lastCheck;
+    TYLIB_TIMER_STAT(++m_stats.ticks; uint64_t n = 0);
+
+    while (m_list1[index].m_next != nullptr) {
+      Timer* pTimer = _Of(m_list1[index].m_next);
+      _Unlink(pTimer);
+      TYLIB_TIMER_STAT(_CountFired(pTimer, now); ++n);
+      if (pTimer->OnTimer()) {
+        _AddTimer(pTimer);
+      };
+    }
+    TYLIB_TIMER_STAT(_CountChain(n);
+                     if (n > m_stats.maxFired) m_stats.maxFired = n);
+  }
+
+  return hasUpdated;
 }
 
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+void BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::_AddTimer(
+    Timer* pTimer) {
+  _Unlink(pTimer);
+  __atomic_store_n(&pTimer->m_owner, static_cast<void*>(this),
+                   __ATOMIC_RELEASE);
+
+  int64_t trigTime = _Tick(pTimer);
+  int64_t diff = trigTime - m_lastCheck;
+  int level = 0;
+  int index = 0;
+
+  if (diff < 0) {
+    index = m_lastCheck & (LIST1_SIZE - 1);
+  } else {
+    // the last level takes the rest, beyond the horizon it wraps
+    while (level + 1 < LEVELS && diff >= (1LL << _Shift(level + 1))) ++level;
+    index = (trigTime >> _Shift(level)) & (_Size(level) - 1);
+  }
+  TimerLink* pListHead = &_List(level)[index];
+  _SetBit(level, index);
+
+  assert(!pListHead->m_prev);
+  pTimer->m_prev = pListHead;
+  pTimer->m_next = pListHead->m_next;
+  if (pListHead->m_next != nullptr) {
+    pListHead->m_next->m_prev = pTimer;
+  }
+  pListHead->m_next = pTimer;
+}
+
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+void BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::_Post(
+    CommandType type, Timer* pTimer, const Time* triggerTime) {
+  if (!pTimer) return;
+
+  if (IsOwnerThread()) {
+    if (type == CMD_ADD) {
+      AddTimer(pTimer);
+    } else if (type == CMD_SCHEDULE) {
+      ScheduleAt(pTimer, *triggerTime);
+    } else {
+      KillTimer(pTimer);
+    }
+    return;
+  }
+
+  if (type != CMD_KILL) {
+    __atomic_store_n(&pTimer->m_owner, static_cast<void*>(this),
+                     __ATOMIC_RELEASE);
+  }
+
+  Command* cmd = new Command;
+  cmd->type = type;
+  cmd->timer = pTimer;
+  if (triggerTime) {
+    cmd->wall = triggerTime->MicroSeconds();
+    cmd->mono = triggerTime->MonotonicUs();
+  }
+  m_commands.Push(cmd);
+}
+
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+typename BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::Slot*
+BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::_AllocSlot() {
+  if (m_freeSlot == NO_SLOT) {
+    const uint32_t base = m_slabs.size() * SLAB_SIZE;
+    Slot* slab = new Slot[SLAB_SIZE];
+    for (uint32_t i = 0; i < SLAB_SIZE; ++i) {
+      slab[i].m_index = base + i;
+      slab[i].m_nextFree = i + 1 < SLAB_SIZE ? base + i + 1 : NO_SLOT;
+    }
+    m_slabs.push_back(slab);
+    m_freeSlot = base;
+  }
+
+  const uint32_t index = m_freeSlot;
+  Slot* pSlot = &m_slabs[index >> SLAB_BITS][index & (SLAB_SIZE - 1)];
+  m_freeSlot = pSlot->m_nextFree;
+  return pSlot;
+}
+
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+template <class F>
+TimerId BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::Schedule(
+    uint32_t delay, uint32_t interval, int32_t count, F&& fn) {
+  typedef typename std::decay<F>::type Fn;
+  if (count == 0) return 0;
+
+  Slot* pSlot = _AllocSlot();
+  if constexpr (sizeof(Fn) <= kInlineSize &&
+                alignof(Fn) <= alignof(std::max_align_t)) {
+    pSlot->m_fn = new (pSlot->m_buf) Fn(std::forward<F>(fn));
+    pSlot->m_destroy = [](void* p) { static_cast<Fn*>(p)->~Fn(); };
+  } else {
+    pSlot->m_fn = new Fn(std::forward<F>(fn));
+    pSlot->m_destroy = [](void* p) { delete static_cast<Fn*>(p); };
+  }
+  pSlot->m_invoke = [](void* p) { (*static_cast<Fn*>(p))(); };
+  return _StartSlot(pSlot, delay, interval, count);
+}
+
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+void BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::_OnJump(
+    int64_t step, int64_t nowUs) {
+  TYLIB_TIMER_STAT(++m_stats.jumps);
+
+  // the anchored timers, out of the lists before any is added back
+  std::vector<Timer*> anchored;
+  for (int level = 0; level < LEVELS; ++level) {
+    TimerLink* list = _List(level);
+    for (int i = 0; i < _Size(level); ++i) {
+      for (TimerLink* t = list[i].m_next; t; t = t->m_next) {
+        if (_Of(t)->m_jump != Timer::JUMP_IGNORE) anchored.push_back(_Of(t));
+      }
+    }
+  }
+  for (Timer* pTimer : anchored) {
+    _Unlink(pTimer);
+    pTimer->m_expire -= step;
+  }
+
+  // those now due, in the order they were due, over the spread
+  std::vector<Timer*> due;
+  for (Timer* pTimer : anchored) {
+    if (pTimer->m_jump == Timer::JUMP_SPREAD && pTimer->m_expire < nowUs) {
+      due.push_back(pTimer);
+    }
+  }
+  std::stable_sort(due.begin(), due.end(), [](Timer* a, Timer* b) {
+    return a->m_expire < b->m_expire;
+  });
+  for (size_t i = 0; i < due.size(); ++i) {
+    due[i]->m_expire = nowUs + m_spreadUs * static_cast<int64_t>(i) /
+                                   static_cast<int64_t>(due.size());
+  }
+
+  for (Timer* pTimer : anchored) _AddTimer(pTimer);
+}
+
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+int BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::_Distance(
+    int level, int index) const {
+  const int size = _Size(level);
+  const int words = (size + 63) / 64;
+  const uint64_t* bits = m_bits[level];
+
+  // the word of index from index on, the other words, then the word of
+  // index before index
+  int w = index >> 6;
+  uint64_t b = bits[w] & (~0ULL << (index & 63));
+  for (int i = 0; i <= words; ++i) {
+    if (b) {
+      int slot = ((w << 6) | __builtin_ctzll(b));
+      return (slot - index + size) % size;
+    }
+    w = (w + 1) % words;
+    b = bits[w];
+    if (i == words - 1) b &= ~(~0ULL << (index & 63));
+  }
+  return -1;
+}
+
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+int64_t BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::_NextTick(
+    int64_t tick) const {
+  int64_t next = std::numeric_limits<int64_t>::max();
+  for (int level = 0; level < LEVELS; ++level) {
+    // level 0 slots fire at any tick, the others at a multiple of unit
+    const int64_t unit = 1LL << _Shift(level);
+    const int64_t first = (tick + unit - 1) & ~(unit - 1);
+    const int index = (first >> _Shift(level)) & (_Size(level) - 1);
+    int d = _Distance(level, index);
+    if (d >= 0) next = std::min(next, first + d * unit);
+  }
+  return next;
+}
+
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+int64_t BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::NextExpiryUs()
+    const {
+  const int64_t tick = m_lastCheck;
+  int64_t next = -1;
+  for (int level = 0; level < LEVELS; ++level) {
+    const int64_t unit = 1LL << _Shift(level);
+    const int64_t first = (tick + unit - 1) & ~(unit - 1);
+    const int index = (first >> _Shift(level)) & (_Size(level) - 1);
+    int d = _Distance(level, index);
+    if (d < 0) continue;
+
+    // the first occupied slot of a level holds its earliest timers
+    const TimerLink* head = &_List(level)[(index + d) % _Size(level)];
+    for (TimerLink* t = head->m_next; t; t = t->m_next) {
+      int64_t at = _Tick(_Of(t));
+      if (next < 0 || at < next) next = at;
+    }
+  }
+  return next < 0 ? -1 : next * TICK_US;
+}
+
+template <int TickUs, int List1Bits, int ListBits, int Levels>
+bool BasicTimerManager<TickUs, List1Bits, ListBits, Levels>::_Cacsade(
+    TimerLink pList[], int index) {
+  if (index < 0 || index >= LIST_SIZE || !pList || !pList[index].m_next) {
+    return false;
+  }
+
+  TimerLink* tmpListHead = pList[index].m_next;
+  pList[index].m_next = nullptr;
+  for (int level = 1; level < LEVELS; ++level) {
+    if (pList == _List(level)) _ClearBit(level, index);
+  }
+
+  TYLIB_TIMER_STAT(uint64_t n = 0);
+  while (tmpListHead != nullptr) {
+    TimerLink* next = tmpListHead->m_next;
+    tmpListHead->m_prev = tmpListHead->m_next = nullptr;
+    _AddTimer(_Of(tmpListHead));
+    tmpListHead = next;
+    TYLIB_TIMER_STAT(++n);
+  }
+  TYLIB_TIMER_STAT(_CountCascade(pList, n));
+
+  return true;
+}
+
+// built once in timer.cc
+extern template class BasicTimerManager<1000, 8, 6, 5>;
+
 #endif  // TYLIB_TIME_TIMER_H_
@@ -0,0 +1,427 @@
+// Cost of TimerManager against a binary heap, on a virtual clock.
+//
+// usage: timer_bench [-w add,fire,cascade,catchup,churn] [-s wheel,heap]
+//                    [-n 10000,100000,1000000] [-g gap ms] [-d seconds]
+//
+// Time is moved by hand, nothing waits for the real clock and every run
+// sees the same timers. Unless told otherwise delays mix RPC timeouts, 90%
+// of 10ms to 1s, with idle connection timers of 30s to 10min.
+//
+//   add      add n timers then kill them in random order, ns per call
+//   fire     add n timers, step 1ms at a time until all fired, ns per
+//            timer fired, max is the slowest step
+//   cascade  n timers in one level 3 slot, due within 256ms of its
+//            boundary, max is the step that cascades them
+//   catchup  n timers, steps of -g ms as a loop stalled between wakeups
+//   churn    n idle timers for -d seconds, each ms 100 RPC timeouts are
+//            added and 95% of them killed 5ms later, 100 idle ones are
+//            pushed back; ns per add, kill or step
+//
+// bytes/timer is the node a timer carries plus the memory of the
+// scheduler itself per timer. 10M timers take about 1.5GB.
+
+#include <getopt.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "tylib/string/string_split.h"
+#include "tylib/time/timer.h"
+
+namespace {
+
+uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64, the same sequence each run
+struct Rand {
+  uint64_t s = 88172645463325252ULL;
+
+  uint64_t Next() {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+  }
+
+  int64_t Range(int64_t lo, int64_t hi) { return lo + Next() % (hi - lo); }
+};
+
+int64_t MixDelay(Rand* r) {
+  if (r->Next() % 10) return r->Range(10, 1000);
+  return r->Range(30 * 1000, 600 * 1000);
+}
+
+class BenchTimer : public Timer {
+ public:
+  BenchTimer() : m_pos(-1), m_fired(&m_dropped) {}
+
+  int m_pos;  // in the heap, -1 if not
+  uint64_t* m_fired;
+
+ private:
+  bool _OnTimer() override {
+    ++*m_fired;
+    return false;
+  }
+
+  static uint64_t m_dropped;
+};
+
+uint64_t BenchTimer::m_dropped = 0;
+
+// ms are from an origin aligned to every level below the last, so a
+// workload knows where the cascade boundaries are
+class Wheel {
+ public:
+  Wheel() : m_mgr(new TimerManager) {
+    m_base.AddDelay((1 << 20) - m_base.MonotonicMs() % (1 << 20));
+    m_mgr->UpdateTimers(m_base);
+  }
+  ~Wheel() { delete m_mgr; }
+
+  void Add(BenchTimer* t, int64_t when) { m_mgr->ScheduleAt(t, _At(when)); }
+  void Kill(BenchTimer* t) { m_mgr->KillTimer(t); }
+  void Advance(int64_t now) { m_mgr->UpdateTimers(_At(now)); }
+
+  size_t Bytes() const { return sizeof(TimerManager); }
+  static size_t NodeBytes() { return sizeof(Timer); }
+
+ private:
+  Time _At(int64_t ms) const {
+    Time t = m_base;
+    t.AddDelay(ms);
+    return t;
+  }
+
+  TimerManager* m_mgr;
+  Time m_base;  // after m_mgr, not before its first tick
+};
+
+// indexed binary min-heap of due ms, the baseline
+class Heap {
+ public:
+  void Add(BenchTimer* t, int64_t when) {
+    Kill(t);
+    t->m_pos = m_heap.size();
+    m_heap.push_back(Entry{when, t});
+    _Up(t->m_pos);
+  }
+
+  void Kill(BenchTimer* t) {
+    int pos = t->m_pos;
+    if (pos < 0) return;
+    t->m_pos = -1;
+    Entry last = m_heap.back();
+    m_heap.pop_back();
+    if (last.timer == t) return;
+    m_heap[pos] = last;
+    last.timer->m_pos = pos;
+    _Down(pos);
+    _Up(last.timer->m_pos);
+  }
+
+  void Advance(int64_t now) {
+    while (!m_heap.empty() && m_heap[0].when <= now) {
+      BenchTimer* t = m_heap[0].timer;
+      Kill(t);
+      t->OnTimer();
+    }
+  }
+
+  size_t Bytes() const { return m_heap.capacity() * sizeof(Entry); }
+  static size_t NodeBytes() { return sizeof(void*) * 2; }  // vptr and pos
+
+ private:
+  struct Entry {
+    int64_t when;
+    BenchTimer* timer;
+  };
+
+  void _Set(int pos, const Entry& e) {
+    m_heap[pos] = e;
+    e.timer->m_pos = pos;
+  }
+
+  void _Up(int pos) {
+    Entry e = m_heap[pos];
+    while (pos > 0 && m_heap[(pos - 1) / 2].when > e.when) {
+      _Set(pos, m_heap[(pos - 1) / 2]);
+      pos = (pos - 1) / 2;
+    }
+    _Set(pos, e);
+  }
+
+  void _Down(int pos) {
+    const int size = m_heap.size();
+    Entry e = m_heap[pos];
+    for (int child; (child = pos * 2 + 1) < size; pos = child) {
+      if (child + 1 < size && m_heap[child + 1].when < m_heap[child].when) {
+        ++child;
+      }
+      if (m_heap[child].when >= e.when) break;
+      _Set(pos, m_heap[child]);
+    }
+    _Set(pos, e);
+  }
+
+  std::vector<Entry> m_heap;
+};
+
+struct Config {
+  int64_t gap;
+  int seconds;
+};
+
+void Print(const char* workload, const char* sched, int n, uint64_t ops,
+           uint64_t ns, uint64_t maxNs, double bytes) {
+  char max[32] = "-";
+  if (maxNs) snprintf(max, sizeof(max), "%.1f", maxNs / 1e3);
+  printf("%-8s %-6s %9d %10llu %9.1f %10s %12.1f\n", workload, sched, n,
+         static_cast<unsigned long long>(ops), ops ? double(ns) / ops : 0.0,
+         max, bytes);
+  fflush(stdout);
+}
+
+template <class S>
+double BytesPerTimer(const S& s, int n) {
+  return S::NodeBytes() + double(s.Bytes()) / n;
+}
+
+// step from the clock after from to to, the slowest step in *maxNs
+template <class S>
+uint64_t Steps(S* s, int64_t from, int64_t to, int64_t step, uint64_t* maxNs,
+               const uint64_t* fired, uint64_t want) {
+  uint64_t begin = NowNs();
+  uint64_t last = begin;
+  for (int64_t now = from + step; now <= to && *fired < want; now += step) {
+    s->Advance(now);
+    uint64_t t = NowNs();
+    *maxNs = std::max(*maxNs, t - last);
+    last = t;
+  }
+  return last - begin;
+}
+
+template <class S>
+void RunAdd(const char* name, int n, const Config&) {
+  Rand r;
+  std::vector<BenchTimer> timers(n);
+  std::vector<int64_t> when(n);
+  std::vector<int> order(n);
+  for (int i = 0; i < n; ++i) {
+    when[i] = MixDelay(&r);
+    order[i] = i;
+  }
+  for (int i = n - 1; i > 0; --i) {
+    std::swap(order[i], order[r.Next() % (i + 1)]);
+  }
+
+  S s;
+  uint64_t begin = NowNs();
+  for (int i = 0; i < n; ++i) s.Add(&timers[i], when[i]);
+  uint64_t add = NowNs() - begin;
+  const double bytes = BytesPerTimer(s, n);
+
+  begin = NowNs();
+  for (int i = 0; i < n; ++i) s.Kill(&timers[order[i]]);
+  uint64_t kill = NowNs() - begin;
+
+  Print("add", name, n, n, add, 0, bytes);
+  Print("kill", name, n, n, kill, 0, bytes);
+}
+
+template <class S>
+void RunFire(const char* name, int n, const Config&) {
+  Rand r;
+  uint64_t fired = 0;
+  int64_t last = 0;
+  std::vector<BenchTimer> timers(n);
+  S s;
+  for (int i = 0; i < n; ++i) {
+    timers[i].m_fired = &fired;
+    int64_t when = MixDelay(&r);
+    last = std::max(last, when);
+    s.Add(&timers[i], when);
+  }
+  const double bytes = BytesPerTimer(s, n);
+
+  uint64_t maxNs = 0;
+  uint64_t ns = Steps(&s, 0, last, 1, &maxNs, &fired, n);
+  Print("fire", name, n, fired, ns, maxNs, bytes);
+}
+
+template <class S>
+void RunCascade(const char* name, int n, const Config&) {
+  // 2 << 14 is the start of level 3 slot 2, cascaded into m_list1 at once
+  const int64_t boundary = 2 << 14;
+  Rand r;
+  uint64_t fired = 0;
+  std::vector<BenchTimer> timers(n);
+  S s;
+  for (int i = 0; i < n; ++i) {
+    timers[i].m_fired = &fired;
+    s.Add(&timers[i], boundary + r.Range(0, 256));
+  }
+  const double bytes = BytesPerTimer(s, n);
+  s.Advance(boundary - 1);
+
+  uint64_t maxNs = 0;
+  uint64_t ns = Steps(&s, boundary - 1, boundary + 255, 1, &maxNs, &fired, n);
+  Print("cascade", name, n, fired, ns, maxNs, bytes);
+}
+
+template <class S>
+void RunCatchup(const char* name, int n, const Config& c) {
+  Rand r;
+  uint64_t fired = 0;
+  int64_t last = 0;
+  std::vector<BenchTimer> timers(n);
+  S s;
+  for (int i = 0; i < n; ++i) {
+    timers[i].m_fired = &fired;
+    int64_t when = MixDelay(&r);
+    last = std::max(last, when);
+    s.Add(&timers[i], when);
+  }
+  const double bytes = BytesPerTimer(s, n);
+
+  uint64_t maxNs = 0;
+  uint64_t ns = Steps(&s, 0, last + c.gap, c.gap, &maxNs, &fired, n);
+  Print("catchup", name, n, fired, ns, maxNs, bytes);
+}
+
+template <class S>
+void RunChurn(const char* name, int n, const Config& c) {
+  const int kRpcPerMs = 100;
+  const int kTouchPerMs = 100;
+  const int kRpcLatency = 5;
+  Rand r;
+  std::vector<BenchTimer> idle(n);
+  // a slot is reused 1000ms later, its timeout has fired or been killed
+  std::vector<BenchTimer> rpc(kRpcPerMs * 1000);
+  S s;
+  for (int i = 0; i < n; ++i) s.Add(&idle[i], r.Range(30 * 1000, 600 * 1000));
+
+  uint64_t ops = 0;
+  uint64_t maxNs = 0;
+  uint64_t begin = NowNs();
+  uint64_t last = begin;
+  for (int64_t now = 1; now <= c.seconds * 1000; ++now) {
+    for (int k = 0; k < kRpcPerMs; ++k) {
+      BenchTimer* t = &rpc[(now * kRpcPerMs + k) % rpc.size()];
+      s.Add(t, now + r.Range(50, 500));
+    }
+    if (now > kRpcLatency) {
+      for (int k = 0; k < kRpcPerMs; ++k) {
+        if (r.Next() % 20 == 0) continue;  // timed out
+        s.Kill(&rpc[((now - kRpcLatency) * kRpcPerMs + k) % rpc.size()]);
+        ++ops;
+      }
+    }
+    for (int k = 0; k < kTouchPerMs; ++k) {
+      s.Add(&idle[r.Next() % n], now + r.Range(30 * 1000, 600 * 1000));
+    }
+    s.Advance(now);
+    ops += kRpcPerMs + kTouchPerMs + 1;
+
+    uint64_t t = NowNs();
+    maxNs = std::max(maxNs, t - last);
+    last = t;
+  }
+  Print("churn", name, n, ops, last - begin, maxNs, BytesPerTimer(s, n));
+}
+
+template <class S>
+void Run(const std::string& workload, const char* name, int n,
+         const Config& c) {
+  if (workload == "add") {
+    RunAdd<S>(name, n, c);
+  } else if (workload == "fire") {
+    RunFire<S>(name, n, c);
+  } else if (workload == "cascade") {
+    RunCascade<S>(name, n, c);
+  } else if (workload == "catchup") {
+    RunCatchup<S>(name, n, c);
+  } else if (workload == "churn") {
+    RunChurn<S>(name, n, c);
+  } else {
+    fprintf(stderr, "unknown workload %s\n", workload.c_str());
+  }
+}
+
+void Run(const std::string& workload, const std::string& sched, int n,
+         const Config& c) {
+  if (sched == "wheel") {
+    Run<Wheel>(workload, "wheel", n, c);
+  } else if (sched == "heap") {
+    Run<Heap>(workload, "heap", n, c);
+  } else {
+    fprintf(stderr, "unknown scheduler %s\n", sched.c_str());
+  }
+}
+
+std::vector<std::string> List(const char* arg) {
+  return tylib::StringSplit(arg, ",");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::vector<std::string> workloads = {"add", "fire", "cascade", "catchup",
+                                        "churn"};
+  std::vector<std::string> scheds = {"wheel", "heap"};
+  std::vector<std::string> counts = {"10000", "100000", "1000000"};
+  Config c;
+  c.gap = 60 * 1000;
+  c.seconds = 10;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:s:n:g:d:h")) != -1) {
+    switch (opt) {
+      case 'w':
+        workloads = List(optarg);
+        break;
+      case 's':
+        scheds = List(optarg);
+        break;
+      case 'n':
+        counts = List(optarg);
+        break;
+      case 'g':
+        c.gap = atoll(optarg);
+        break;
+      case 'd':
+        c.seconds = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-w workloads] [-s wheel,heap] [-n timers] "
+                "[-g gap ms] [-d seconds]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (c.gap <= 0 || c.seconds <= 0) {
+    fprintf(stderr, "-g and -d must be positive\n");
+    return 1;
+  }
+
+  printf("%-8s %-6s %9s %10s %9s %10s %12s\n", "workload", "sched", "timers",
+         "ops", "ns/op", "max(us)", "bytes/timer");
+  for (const auto& w : workloads)
+    for (const auto& n : counts)
+      for (const auto& s : scheds) {
+        int timers = atoi(n.c_str());
+        if (timers > 0) Run(w, s, timers, c);
+      }
+  return 0;
+}
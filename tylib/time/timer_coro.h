@@ -0,0 +1,185 @@
+// C++20 awaitables on a timing wheel, for coroutines run by its owner
+// thread, e.g. the thread of an EventLoop:
+//
+//   co_await tylib::SleepFor(100, loop.Timers());
+//   co_await tylib::SleepUntil(Time(23, 0, 0));  // on TimerManager::Local()
+//   if (!co_await tylib::WithTimeout(reply.Wait(), 500)) ...  // timed out
+//
+// An awaiter is a Timer kept in the coroutine frame across the suspension,
+// nothing is allocated. Destroying a suspended frame unlinks its timer.
+
+#ifndef TYLIB_TIME_TIMER_CORO_H_
+#define TYLIB_TIME_TIMER_CORO_H_
+
+#if __cplusplus < 202002L
+#error "tylib/time/timer_coro.h needs -std=c++20"
+#endif
+
+#include <coroutine>
+#include <cstdint>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "tylib/time/timer.h"
+
+namespace tylib {
+
+// resumes the coroutine at a time, from the UpdateTimers of the wheel
+template <class M = TimerManager>
+class SleepAwaiter : public Timer {
+ public:
+  SleepAwaiter(M* wheel, const Time& at) : m_wheel(wheel), m_at(at) {}
+  ~SleepAwaiter() { m_wheel->KillTimer(this); }
+
+  bool await_ready() const { return false; }  // a past time still yields
+  void await_suspend(std::coroutine_handle<> handle) {
+    m_handle = handle;
+    m_wheel->ScheduleAt(this, m_at);
+  }
+  void await_resume() const {}
+
+  // after await_suspend the coroutine is not resumed, for WithTimeout
+  void Cancel() { m_wheel->KillTimer(this); }
+
+ private:
+  // the frame, so this, may be gone once resumed
+  bool _OnTimer() override {
+    m_handle.resume();
+    return false;
+  }
+
+  M* m_wheel;
+  Time m_at;
+  std::coroutine_handle<> m_handle;
+};
+
+template <class M = TimerManager>
+SleepAwaiter<M> SleepUntil(const Time& at, M* wheel = M::Local()) {
+  return SleepAwaiter<M>(wheel, at);
+}
+
+// ms from the clock, not from the wheel's last tick
+template <class M = TimerManager>
+SleepAwaiter<M> SleepFor(uint32_t ms, M* wheel = M::Local()) {
+  Time at;
+  at.AddDelay(ms);
+  return SleepAwaiter<M>(wheel, at);
+}
+
+// One shot, set by the thread of the coroutine, one waiter at a time:
+//
+//   tylib::Event reply;
+//   Send(request, [&reply] { reply.Set(); });
+//   co_await reply.Wait();
+class Event {
+ public:
+  class Awaiter {
+   public:
+    explicit Awaiter(Event* event) : m_event(event) {}
+    Awaiter(Awaiter&& other) : m_event(other.m_event) {}  // before suspend
+    ~Awaiter() { Cancel(); }
+
+    bool await_ready() const { return m_event->m_set; }
+    void await_suspend(std::coroutine_handle<> handle) {
+      m_handle = handle;
+      m_event->m_waiter = this;
+    }
+    void await_resume() const {}
+
+    void Cancel() {
+      if (m_event->m_waiter == this) m_event->m_waiter = nullptr;
+    }
+
+   private:
+    friend class Event;
+
+    Event* m_event;
+    std::coroutine_handle<> m_handle;
+  };
+
+  Event() {}
+  Event(const Event&) = delete;
+  Event& operator=(const Event&) = delete;
+
+  // resumes the waiter, if any, before returning
+  void Set() {
+    m_set = true;
+    if (Awaiter* waiter = m_waiter) {
+      m_waiter = nullptr;
+      waiter->m_handle.resume();
+    }
+  }
+
+  bool IsSet() const { return m_set; }
+  void Reset() { m_set = false; }
+
+  Awaiter Wait() { return Awaiter(this); }
+
+ private:
+  bool m_set = false;
+  Awaiter* m_waiter = nullptr;
+};
+
+// Awaits inner for at most ms. inner is an awaiter with a Cancel() after
+// which it no longer resumes the coroutine, such as SleepAwaiter and
+// Event::Awaiter, whose await_suspend returns void. The result is false
+// or an empty optional on timeout.
+template <class A, class M = TimerManager>
+class TimeoutAwaiter : public Timer {
+  typedef decltype(std::declval<A&>().await_resume()) Inner;
+
+ public:
+  typedef typename std::conditional<std::is_void<Inner>::value, bool,
+                                    std::optional<Inner>>::type Result;
+
+  TimeoutAwaiter(A inner, uint32_t ms, M* wheel)
+      : m_inner(std::move(inner)), m_wheel(wheel), m_ms(ms) {}
+  ~TimeoutAwaiter() { m_wheel->KillTimer(this); }
+
+  bool await_ready() { return m_inner.await_ready(); }
+  void await_suspend(std::coroutine_handle<> handle) {
+    static_assert(std::is_void<decltype(m_inner.await_suspend(handle))>::value,
+                  "WithTimeout takes awaiters whose await_suspend is void");
+    m_handle = handle;
+    Time at;
+    at.AddDelay(m_ms);
+    m_wheel->ScheduleAt(this, at);
+    m_inner.await_suspend(handle);
+  }
+
+  Result await_resume() {
+    m_wheel->KillTimer(this);
+    if constexpr (std::is_void<Inner>::value) {
+      if (!m_timedOut) m_inner.await_resume();
+      return !m_timedOut;
+    } else {
+      if (m_timedOut) return std::nullopt;
+      return m_inner.await_resume();
+    }
+  }
+
+ private:
+  bool _OnTimer() override {
+    m_timedOut = true;
+    m_inner.Cancel();
+    m_handle.resume();
+    return false;
+  }
+
+  A m_inner;
+  M* m_wheel;
+  uint32_t m_ms;
+  bool m_timedOut = false;
+  std::coroutine_handle<> m_handle;
+};
+
+template <class A, class M = TimerManager>
+TimeoutAwaiter<A, M> WithTimeout(A inner, uint32_t ms,
+                                 M* wheel = M::Local()) {
+  return TimeoutAwaiter<A, M>(std::move(inner), ms, wheel);
+}
+
+}  // namespace tylib
+
+#endif  // TYLIB_TIME_TIMER_CORO_H_
@@ -0,0 +1,121 @@
+#include "tylib/time/timer_coro.h"
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// runs at once, the frame is kept until the Task goes
+struct Task {
+  struct promise_type {
+    Task get_return_object() {
+      return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  Task(Task&& other) : handle(other.handle) { other.handle = nullptr; }
+  explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+  ~Task() {
+    if (handle) handle.destroy();
+  }
+
+  bool Done() const { return handle.done(); }
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+void RunUntil(TimerManager* wheel, const Task& task) {
+  for (int i = 0; i < 2000 && !task.Done(); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    wheel->UpdateTimers(Time());
+  }
+}
+
+Task Sleeper(TimerManager* wheel, uint32_t ms, int* steps) {
+  ++*steps;
+  co_await tylib::SleepFor(ms, wheel);
+  ++*steps;
+}
+
+TEST(TimerCoroTest, SleepForResumesFromTheWheel) {
+  TimerManager wheel;
+  int steps = 0;
+  auto begin = std::chrono::steady_clock::now();
+  Task task = Sleeper(&wheel, 20, &steps);
+  EXPECT_EQ(steps, 1);
+
+  RunUntil(&wheel, task);
+  EXPECT_TRUE(task.Done());
+  EXPECT_EQ(steps, 2);
+  EXPECT_GE(std::chrono::steady_clock::now() - begin,
+            std::chrono::milliseconds(19));
+  EXPECT_EQ(wheel.NextExpiryUs(), -1);
+}
+
+Task Waiter(TimerManager* wheel, tylib::Event* event, uint32_t ms,
+            int* result) {
+  *result = co_await tylib::WithTimeout(event->Wait(), ms, wheel) ? 1 : 0;
+}
+
+TEST(TimerCoroTest, WithTimeoutSetInTime) {
+  TimerManager wheel;
+  tylib::Event event;
+  int result = -1;
+  Task task = Waiter(&wheel, &event, 1000, &result);
+  wheel.Schedule(10, 0, 1, [&event] { event.Set(); });
+
+  RunUntil(&wheel, task);
+  EXPECT_EQ(result, 1);
+  EXPECT_EQ(wheel.NextExpiryUs(), -1);  // the timeout is gone
+}
+
+TEST(TimerCoroTest, WithTimeoutExpires) {
+  TimerManager wheel;
+  tylib::Event event;
+  int result = -1;
+  Task task = Waiter(&wheel, &event, 10, &result);
+
+  RunUntil(&wheel, task);
+  EXPECT_EQ(result, 0);
+  event.Set();  // the waiter was cancelled, nothing to resume
+  EXPECT_TRUE(event.IsSet());
+}
+
+TEST(TimerCoroTest, WithTimeoutOfASleep) {
+  TimerManager wheel;
+  int result = -1;
+  auto race = [](TimerManager* w, uint32_t sleep, int* r) -> Task {
+    *r = co_await tylib::WithTimeout(tylib::SleepFor(sleep, w), 10, w);
+  };
+  Task task = race(&wheel, 5000, &result);
+
+  RunUntil(&wheel, task);
+  EXPECT_EQ(result, 0);
+  EXPECT_EQ(wheel.NextExpiryUs(), -1);  // the sleep is unlinked too
+}
+
+TEST(TimerCoroTest, DestroyedFrameUnlinksItsTimer) {
+  TimerManager wheel;
+  tylib::Event event;
+  int steps = 0;
+  int result = -1;
+  {
+    Task sleeper = Sleeper(&wheel, 1000, &steps);
+    Task waiter = Waiter(&wheel, &event, 1000, &result);
+    EXPECT_GE(wheel.NextExpiryUs(), 0);
+  }
+  EXPECT_EQ(wheel.NextExpiryUs(), -1);
+  event.Set();  // no waiter left
+  EXPECT_EQ(steps, 1);
+  EXPECT_EQ(result, -1);
+}
+
+}  // namespace
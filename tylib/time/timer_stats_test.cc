@@ -0,0 +1,86 @@
+// built with -DTYLIB_TIMER_STATS, see the timer_stats_test target
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tylib/time/timer.h"
+
+namespace {
+
+class NopTimer : public Timer {
+ private:
+  bool _OnTimer() override { return false; }
+};
+
+Time At(const Time& base, int64_t ms) {
+  Time t = base;
+  t.AddDelay(ms - base.MonotonicMs());
+  return t;
+}
+
+TEST(TimerStats, FiredAddedKilledAndLateness) {
+  TimerManager wheel;
+  Time base;
+  const int64_t t0 = base.MonotonicMs();
+  wheel.UpdateTimers(base);
+
+  std::vector<std::unique_ptr<NopTimer>> timers;
+  for (int i = 0; i < 100; ++i) {
+    timers.emplace_back(new NopTimer);
+    wheel.ScheduleAt(timers.back().get(), At(base, t0 + 5));
+  }
+  for (int i = 0; i < 10; ++i) wheel.KillTimer(timers[i].get());
+  wheel.KillTimer(timers[0].get());  // not linked, not counted
+
+  for (int64_t ms = t0 + 1; ms <= t0 + 5; ++ms) {
+    wheel.UpdateTimers(At(base, ms));
+  }
+  TimerManager::Stats stats = wheel.GetStats();
+  EXPECT_EQ(stats.added, 100U);
+  EXPECT_EQ(stats.killed, 10U);
+  EXPECT_EQ(stats.fired, 90U);
+  EXPECT_EQ(stats.maxFired, 90U);
+  EXPECT_EQ(stats.longestChain, 90U);
+  EXPECT_EQ(stats.late[0], 90U);  // fired at their expiry exactly
+  EXPECT_EQ(stats.maxLate, 0);
+  EXPECT_EQ(stats.ticks + stats.skipped, 6U);  // t0 to t0 + 5
+
+  // a loop 3ms late: 3000us, in [2048, 4096)
+  wheel.ScheduleAt(timers[0].get(), At(base, t0 + 10));
+  wheel.UpdateTimers(At(base, t0 + 13));
+  stats = wheel.GetStats();
+  EXPECT_EQ(stats.late[12], 1U);
+  EXPECT_EQ(stats.maxLate, 3000);
+
+  wheel.ResetStats();
+  stats = wheel.GetStats();
+  EXPECT_EQ(stats.fired, 0U);
+  EXPECT_EQ(stats.late[12], 0U);
+}
+
+TEST(TimerStats, CascadesByLevel) {
+  TimerManager wheel;
+  Time base;
+  const int64_t t0 = base.MonotonicMs();
+  wheel.UpdateTimers(base);
+
+  // beyond the 256 ticks of the first level, moved down once
+  std::vector<std::unique_ptr<NopTimer>> timers;
+  for (int i = 0; i < 3; ++i) {
+    timers.emplace_back(new NopTimer);
+    wheel.ScheduleAt(timers.back().get(), At(base, t0 + 1000));
+  }
+  for (int64_t ms = t0 + 1; ms <= t0 + 1000; ++ms) {
+    wheel.UpdateTimers(At(base, ms));
+  }
+
+  TimerManager::Stats stats = wheel.GetStats();
+  EXPECT_EQ(stats.fired, 3U);
+  EXPECT_EQ(stats.added, 3U);  // the cascade is no add
+  EXPECT_GE(stats.cascades[1], 1U);
+  EXPECT_EQ(stats.moved[1], 3U);
+  EXPECT_EQ(stats.cascades[2], 0U);
+  EXPECT_EQ(stats.longestChain, 3U);
+}
+
+}  // namespace
@@ -0,0 +1,474 @@
+#include "tylib/time/timer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+class CountTimer : public Timer {
+ public:
+  CountTimer(std::atomic<int>* fired, uint32_t interval)
+      : Timer(interval, 1), m_fired(fired) {}
+
+ private:
+  bool _OnTimer() override {
+    ++*m_fired;
+    return false;
+  }
+
+  std::atomic<int>* m_fired;
+};
+
+// records the virtual now it fires at, repeats if given an interval
+class StampTimer : public Timer {
+ public:
+  StampTimer(const int64_t* now, std::vector<int64_t>* fired,
+             uint32_t interval = uint32_t(-1), int32_t count = -1)
+      : Timer(interval, count),
+        m_now(now),
+        m_fired(fired),
+        m_repeat(interval != uint32_t(-1)) {}
+
+ private:
+  bool _OnTimer() override {
+    m_fired->push_back(*m_now);
+    return m_repeat;
+  }
+
+  const int64_t* m_now;
+  std::vector<int64_t>* m_fired;
+  bool m_repeat;
+};
+
+Time At(const Time& base, int64_t ms) {
+  Time t = base;
+  t.AddDelay(ms - base.MonotonicMs());
+  return t;
+}
+
+TEST(TimerManager, NextExpiryExact) {
+  TimerManager wheel;
+  Time base;
+  // both sides of each level boundary, up to the last level
+  const int64_t kDelays[] = {0,     1,     255,         256,
+                             300,   16383, 16384,       20000,
+                             1 << 20, 3600 * 1000, 1 << 26,
+                             30LL * 24 * 3600 * 1000};
+  const int kTimers = sizeof(kDelays) / sizeof(kDelays[0]);
+
+  int64_t now = 0;
+  std::vector<int64_t> fired;
+  std::vector<std::unique_ptr<StampTimer>> timers;
+  std::vector<int64_t> due;
+  for (int64_t d : kDelays) {
+    timers.emplace_back(new StampTimer(&now, &fired));
+    due.push_back(base.MonotonicMs() + d);
+    wheel.ScheduleAt(timers.back().get(), At(base, due.back()));
+  }
+
+  // a wakeup per distinct expiry, each fires exactly on time
+  int wakeups = 0;
+  for (int64_t e; (e = wheel.NextExpiry()) >= 0 && wakeups <= kTimers;
+       ++wakeups) {
+    now = e;
+    wheel.UpdateTimers(At(base, now));
+  }
+  EXPECT_LE(wakeups, kTimers);
+  EXPECT_EQ(fired, due);
+}
+
+// each timer fires in the tick its expiry falls in, on all levels
+template <class Wheel>
+void CheckGeometry(const std::vector<int64_t>& ticks) {
+  Wheel wheel;
+  Time base;
+  wheel.UpdateTimers(base);
+
+  int64_t now = 0;
+  std::vector<int64_t> fired;
+  std::vector<std::unique_ptr<StampTimer>> timers;
+  std::vector<int64_t> due;
+  for (int64_t t : ticks) {
+    Time at = base;
+    at.AddDelayUs(t * Wheel::TICK_US + Wheel::TICK_US / 2);
+    timers.emplace_back(new StampTimer(&now, &fired));
+    due.push_back(at.MonotonicUs() / Wheel::TICK_US * Wheel::TICK_US);
+    wheel.ScheduleAt(timers.back().get(), at);
+  }
+
+  int wakeups = 0;
+  for (int64_t e; (e = wheel.NextExpiryUs()) >= 0 &&
+                  wakeups <= static_cast<int>(ticks.size());
+       ++wakeups) {
+    now = e;
+    Time at = base;
+    at.AddDelayUs(now - base.MonotonicUs());
+    wheel.UpdateTimers(at);
+  }
+  EXPECT_EQ(fired, due);
+}
+
+TEST(TimerManager, Geometry) {
+  // 1ms, 100us pacing, 10ms with a 64 slot first level
+  const std::vector<int64_t> ticks = {1,    2,     63,    64,    65,
+                                      255,  256,   257,   4095,  4096,
+                                      4097, 16383, 16384, 100000, 1 << 22};
+  CheckGeometry<TimerManager>(ticks);
+  CheckGeometry<BasicTimerManager<100, 8, 6, 5>>(ticks);
+  CheckGeometry<BasicTimerManager<10000, 6, 6, 5>>(ticks);
+
+  // 4 levels of 16, 8, 8, 8 slots, a horizon of 8192 ticks
+  CheckGeometry<BasicTimerManager<1000, 4, 3, 4>>(
+      {1, 15, 16, 17, 127, 128, 129, 1023, 1024, 1025, 5000, 8191});
+}
+
+TEST(TimerManager, LongStall) {
+  TimerManager wheel;
+  Time base;
+  int64_t now = 0;
+  std::vector<int64_t> fired;
+  StampTimer near(&now, &fired);
+  StampTimer far(&now, &fired);
+  wheel.ScheduleAt(&near, At(base, base.MonotonicMs() + 10));
+  wheel.ScheduleAt(&far, At(base, base.MonotonicMs() + 100 * 1000));
+
+  // 10s late, one call, the far one is left
+  now = base.MonotonicMs() + 10 * 1000;
+  wheel.UpdateTimers(At(base, now));
+  ASSERT_EQ(fired.size(), 1U);
+  EXPECT_EQ(wheel.NextExpiry(), base.MonotonicMs() + 100 * 1000);
+
+  // 40 days of ticks on an otherwise empty wheel, not walked one by one
+  now = base.MonotonicMs() + 40LL * 24 * 3600 * 1000;
+  wheel.UpdateTimers(At(base, now));
+  EXPECT_EQ(fired.size(), 2U);
+  EXPECT_EQ(wheel.NextExpiry(), -1);
+}
+
+TEST(TimerManager, SlackCoalesces) {
+  TimerManager wheel;
+  Time base;
+  const int kTimers = 100;
+  const uint32_t kSlack = 100;
+
+  int64_t now = 0;
+  std::vector<int64_t> fired;
+  std::vector<std::unique_ptr<StampTimer>> timers;
+  std::vector<int64_t> due;
+  for (int i = 0; i < kTimers; ++i) {
+    timers.emplace_back(new StampTimer(&now, &fired));
+    due.push_back(base.MonotonicMs() + 1000 + i);
+    wheel.ScheduleAt(timers.back().get(), At(base, due.back()), kSlack);
+  }
+
+  int wakeups = 0;
+  for (int64_t e; (e = wheel.NextExpiry()) >= 0 && wakeups <= kTimers;
+       ++wakeups) {
+    now = e;
+    wheel.UpdateTimers(At(base, now));
+  }
+  // 100 expiries 1ms apart, a slack wider than them: a few ticks, each
+  // aligned to a power of 2 the expiries of one side of it share
+  EXPECT_LE(wakeups, 5);
+  ASSERT_EQ(fired.size(), due.size());
+  for (int i = 0; i < kTimers; ++i) {
+    EXPECT_GE(fired[i], due[i]);
+    EXPECT_LE(fired[i], due[i] + kSlack);
+  }
+}
+
+TEST(TimerManager, SlackRepeatsDoNotDrift) {
+  TimerManager wheel;
+  Time base;
+  int64_t now = 0;
+  std::vector<int64_t> fired;
+  StampTimer timer(&now, &fired, 1000, 5);
+  const int64_t first = base.MonotonicMs() + 777;
+  wheel.ScheduleAt(&timer, At(base, first), 200);
+
+  for (now = base.MonotonicMs(); now <= first + 6000; ++now) {
+    wheel.UpdateTimers(At(base, now));
+  }
+  ASSERT_EQ(fired.size(), 5U);
+  for (int k = 0; k < 5; ++k) {
+    EXPECT_GE(fired[k], first + k * 1000);
+    EXPECT_LE(fired[k], first + k * 1000 + 200);
+  }
+}
+
+// base ms monotonic ms on, with the wall clock stepped by step ms
+Time Stepped(const Time& base, int64_t ms, int64_t step) {
+  return Time(base.MicroSeconds() + (ms + step) * 1000,
+              base.MonotonicUs() + ms * 1000);
+}
+
+TEST(TimerManager, ClockStepIgnoredByDefault) {
+  TimerManager wheel;
+  Time base;
+  int64_t now = 0;
+  std::vector<int64_t> fired;
+  StampTimer timer(&now, &fired);
+  wheel.ScheduleAt(&timer, Stepped(base, 100, 0));
+
+  // an hour back, then two forward: due 100ms on all the same
+  for (now = 1; now <= 100; ++now) {
+    wheel.UpdateTimers(Stepped(base, now, now < 50 ? -3600000 : 7200000));
+  }
+  EXPECT_EQ(fired, (std::vector<int64_t>{100}));
+}
+
+TEST(TimerManager, ClockStepReanchors) {
+  TimerManager wheel;
+  Time base;
+  int64_t now = 0;
+  std::vector<int64_t> fired;
+  StampTimer at10(&now, &fired);
+  StampTimer at20(&now, &fired);
+  StampTimer at30(&now, &fired);
+  at10.SetClockJump(Timer::JUMP_REANCHOR);
+  at20.SetClockJump(Timer::JUMP_REANCHOR);
+  at30.SetClockJump(Timer::JUMP_REANCHOR);
+  wheel.ScheduleAt(&at10, Stepped(base, 10000, 0));
+  wheel.ScheduleAt(&at20, Stepped(base, 20000, 0));
+  wheel.ScheduleAt(&at30, Stepped(base, 30000, 0));
+
+  // 5s forward: the wall reads 10s at 5s, 20s at 15s
+  wheel.UpdateTimers(Stepped(base, 1, 5000));
+  EXPECT_EQ(wheel.NextExpiry(), base.MonotonicMs() + 5000);
+
+  // then 400ms more, below the threshold: a slew, nothing moves
+  for (now = 1; now <= 30000; ++now) {
+    wheel.UpdateTimers(Stepped(base, now, now <= 20000 ? 5000 : 5400));
+  }
+  EXPECT_EQ(fired, (std::vector<int64_t>{5000, 15000, 25000}));
+}
+
+TEST(TimerManager, VirtualClockSchedulesAnchored) {
+  // a day ahead of the real wall clock, as a replayed or a test clock
+  TimerManager wheel;
+  Time base = Stepped(Time(), 0, 86400000);
+  wheel.UpdateTimers(base);
+
+  int64_t now = 0;
+  std::vector<int64_t> fired;
+  StampTimer at10(&now, &fired);
+  StampTimer at20(&now, &fired);
+  at10.SetClockJump(Timer::JUMP_REANCHOR);
+  at20.SetClockJump(Timer::JUMP_REANCHOR);
+  wheel.ScheduleAt(&at10, Stepped(base, 10, 0));
+  wheel.ScheduleAt(&at20, Stepped(base, 20, 0));
+  EXPECT_EQ(wheel.NextExpiry(), base.MonotonicMs() + 10);
+
+  for (now = 1; now <= 30; ++now) wheel.UpdateTimers(Stepped(base, now, 0));
+  EXPECT_EQ(fired, (std::vector<int64_t>{10, 20}));
+}
+
+TEST(TimerManager, ClockStepSpreadsWhatItMadeDue) {
+  const int kTimers = 100;
+  TimerManager wheel;
+  Time base;
+  int64_t now = 0;
+  std::vector<int64_t> fired;
+  std::vector<std::unique_ptr<StampTimer>> timers;
+  for (int i = 0; i < kTimers; ++i) {
+    timers.emplace_back(new StampTimer(&now, &fired));
+    timers.back()->SetClockJump(Timer::JUMP_SPREAD);
+    wheel.ScheduleAt(timers.back().get(), Stepped(base, 60000 + i * 1000, 0));
+  }
+
+  // an hour forward makes all due: fired over 1s, not at once
+  for (now = 1; now <= 1000 && fired.size() < kTimers; ++now) {
+    wheel.UpdateTimers(Stepped(base, now, 3600000));
+  }
+  ASSERT_EQ(fired.size(), static_cast<size_t>(kTimers));
+  EXPECT_EQ(fired.front(), 1);
+  EXPECT_GE(fired.back(), 980);
+  EXPECT_LE(std::count(fired.begin(), fired.end(), fired[50]), 2);
+}
+
+TEST(TimerManager, ScheduleCountAndStaleId) {
+  TimerManager wheel;
+  Time base;
+  wheel.UpdateTimers(base);
+  const int64_t t0 = base.MonotonicMs() + 1;  // the wheel's clock
+
+  int64_t now = 0;
+  std::vector<int64_t> fired;
+  TimerId id = wheel.Schedule(10, 5, 3, [&] { fired.push_back(now); });
+  ASSERT_NE(id, 0U);
+  EXPECT_EQ(wheel.Schedule(10, 5, 0, [] {}), 0U);
+
+  for (now = t0; now <= t0 + 100; ++now) wheel.UpdateTimers(At(base, now));
+  EXPECT_EQ(fired, (std::vector<int64_t>{t0 + 10, t0 + 15, t0 + 20}));
+  EXPECT_FALSE(wheel.Cancel(id));
+
+  // the slot is reused, the old id does not reach the new timer
+  int again = 0;
+  TimerId id2 = wheel.Schedule(1, 1, -1, [&again] { ++again; });
+  EXPECT_NE(id2, id);
+  EXPECT_EQ(id2 & 0xffffffff, id & 0xffffffff);
+  EXPECT_FALSE(wheel.Cancel(id));
+  wheel.UpdateTimers(At(base, now + 10));
+  EXPECT_GT(again, 0);
+  EXPECT_TRUE(wheel.Cancel(id2));
+  EXPECT_FALSE(wheel.Cancel(id2));
+}
+
+TEST(TimerManager, ScheduleCancelFromCallback) {
+  TimerManager wheel;
+  Time base;
+  wheel.UpdateTimers(base);
+
+  int runs = 0;
+  TimerId self = 0;
+  TimerId other = 0;
+  self = wheel.Schedule(1, 1, -1, [&] {
+    if (++runs == 2) {
+      EXPECT_TRUE(wheel.Cancel(self));
+      EXPECT_FALSE(wheel.Cancel(self));
+      EXPECT_TRUE(wheel.Cancel(other));
+    }
+  });
+  other = wheel.Schedule(1000, 0, 1, [] { ADD_FAILURE(); });
+
+  for (int64_t ms = 1; ms <= 2000; ++ms) {
+    wheel.UpdateTimers(At(base, base.MonotonicMs() + ms));
+  }
+  EXPECT_EQ(runs, 2);
+  EXPECT_FALSE(wheel.Cancel(self));
+}
+
+TEST(TimerManager, ScheduleReleasesCallables) {
+  auto token = std::make_shared<int>(0);
+  char big[TimerManager::kInlineSize * 2] = {};
+  {
+    TimerManager wheel;
+    TimerId small = wheel.Schedule(1000, 0, 1, [token] {});
+    TimerId large = wheel.Schedule(1000, 0, 1, [token, big] { (void)big; });
+    wheel.Schedule(1000, 0, 1, [token] {});
+    EXPECT_EQ(token.use_count(), 4);
+
+    EXPECT_TRUE(wheel.Cancel(small));
+    EXPECT_TRUE(wheel.Cancel(large));
+    EXPECT_EQ(token.use_count(), 2);
+  }
+  // pending at destruction
+  EXPECT_EQ(token.use_count(), 1);
+}
+
+TEST(TimerManager, LocalPerThread) {
+  TimerManager* mine = TimerManager::Local();
+  EXPECT_EQ(mine, TimerManager::Local());
+  EXPECT_TRUE(mine->IsOwnerThread());
+
+  TimerManager* other = nullptr;
+  std::thread([&other] { other = TimerManager::Local(); }).join();
+  EXPECT_NE(mine, other);
+}
+
+TEST(TimerManager, CrossThreadAddKill) {
+  const int kProducers = 4;
+  const int kTimers = 1000;
+  std::atomic<int> fired{0};
+  std::atomic<int> killedFired{0};
+  std::vector<CountTimer*> timers;
+  std::vector<CountTimer*> killed;
+  for (int i = 0; i < kProducers * kTimers; ++i) {
+    timers.push_back(new CountTimer(&fired, 1));
+    killed.push_back(new CountTimer(&killedFired, 60 * 1000));
+  }
+
+  std::atomic<TimerManager*> wheel{nullptr};
+  std::atomic<bool> stop{false};
+  std::thread loop([&] {
+    wheel = TimerManager::Local();
+    while (!stop) {
+      wheel.load()->UpdateTimers(Time());
+      std::this_thread::yield();
+    }
+    wheel.load()->UpdateTimers(Time());
+  });
+  while (!wheel) std::this_thread::yield();
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; ++p) {
+    producers.emplace_back([&, p] {
+      for (int i = p * kTimers; i < (p + 1) * kTimers; ++i) {
+        wheel.load()->AsyncAddTimer(timers[i]);
+        wheel.load()->AsyncAddTimer(killed[i]);
+        EXPECT_EQ(killed[i]->Owner(), wheel.load());
+        killed[i]->Owner()->AsyncKillTimer(killed[i]);
+      }
+    });
+  }
+  for (auto& t : producers) t.join();
+
+  for (int i = 0; i < 5000 && fired < kProducers * kTimers; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  stop = true;
+  loop.join();
+
+  EXPECT_EQ(fired, kProducers * kTimers);
+  EXPECT_EQ(killedFired, 0);
+  for (auto* t : timers) delete t;
+  for (auto* t : killed) delete t;
+}
+
+// Rounds of posts from many threads at once, then none: each round must
+// run in full on the spinning owner without a later post to wake it.
+TEST(TimerManager, CrossThreadCommandsAllRun) {
+  const int kProducers = 8;
+  const int kRounds = 1000;
+  std::atomic<int> fired{0};
+  std::vector<std::unique_ptr<CountTimer>> timers;
+  for (int i = 0; i < kProducers * kRounds; ++i) {
+    timers.emplace_back(new CountTimer(&fired, 1));
+  }
+
+  std::atomic<TimerManager*> wheel{nullptr};
+  std::atomic<bool> stop{false};
+  std::thread loop([&] {
+    wheel = TimerManager::Local();
+    while (!stop) {
+      wheel.load()->UpdateTimers(Time());
+      std::this_thread::yield();
+    }
+  });
+  while (!wheel) std::this_thread::yield();
+
+  std::atomic<int> round{-1};
+  std::atomic<int> posted{0};
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; ++p) {
+    producers.emplace_back([&, p] {
+      for (int r = 0; r < kRounds; ++r) {
+        while (round < r) std::this_thread::yield();
+        wheel.load()->AsyncAddTimer(timers[r * kProducers + p].get());
+        ++posted;
+      }
+    });
+  }
+
+  for (int r = 0; r < kRounds; ++r) {
+    round = r;
+    const int want = (r + 1) * kProducers;
+    while (posted < want) std::this_thread::yield();
+    for (int i = 0; i < 1000 && fired < want; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQ(fired, want) << "round " << r;
+  }
+
+  stop = true;
+  loop.join();
+  for (auto& t : producers) t.join();
+}
+
+}  // namespace